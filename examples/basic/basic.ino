@@ -1,32 +1,19 @@
 #include "Arduino.h"
 #include "NowMesh.h"
 
-// Scan every 5 seconds. If your nodes don't move around much or you don't
-//  require high availability/reliability, you can increase this.
-// Scans take around 3 seconds to complete, so don't go too low.
-#define SCAN_INTERVAL 5000
-
 // Send a message every second.
 #define MESSAGE_INTERVAL 1000
 
-// In this example sketch, we use a interval timer to scan.
-os_timer_t scan_timer;
-// The callback from the timer sets this boolean to true.
-volatile bool should_scan = true;
-// We'll do the same for our message timer.
+// In this example sketch, we use a interval timer to send messages.
 os_timer_t message_timer;
+// The callback from the timer sets this boolean to true.
 // Only not attempt a message right away as we won't have any peers yet.
 volatile bool should_message = false;
 
 // Create mesh object.
 NowMesh mesh;
 
-// Here's the timer callback. Very simple. We'll check should_scan in loop().
-void scanTimerCallback(void* arg) {
- should_scan = true;
-}
-
-// And the same for the message timer.
+// Here's the timer callback. Very simple. We'll check should_message in loop().
 void messageTimerCallback(void* arg) {
  should_message = true;
 }
@@ -49,40 +36,95 @@ void messageReceivedCallback(String request, bool self_is_target, uint8_t* origi
  Serial.println(" " + request);
 }
 
+// If you'd rather send binary data, use mesh.setMessageCallback instead of mesh.setReceiveCallback.
+// The callback gets a mesh_message, whose data and len point straight into the received frame.
+// It also tells you how many hops the message took, in message.hops.
+// void binaryMessageCallback(const mesh_message& message) {
+//  float reading;
+//  if (message.len == sizeof(reading)) {
+//   memcpy(&reading, message.data, sizeof(reading));
+//  }
+// }
+// It's called for every message, so to skip std::function altogether, set a plain function with
+//  mesh.setMessageHandler instead. It gets back the context pointer it was set with on every call:
+// void messageHandler(void* context, const mesh_message& message) { }
+// mesh.setMessageHandler(messageHandler, &readings);
+
 // When a message has been sent, whatever function we have set as sendcallback will be called.
 // This does not necessarily indicate success. Check the status argument before assuming success.
 void messageSendCallback(int status) {
  Serial.println("Message sent with status " + String(status, DEC));
 }
+// Frames are queued and sent one at a time. To tell which message a report is about,
+//  use mesh.setSendStatusCallback instead. Its callback also gets the mesh_handle send() returned:
+// void messageSendStatusCallback(const mesh_handle& handle, int status) { }
+// Sent means handed to a neighbor, not received by the target. For that, send targeted messages
+//  with mesh.sendReliable, which resends them until the target acknowledges them,
+//  and set a delivery callback with mesh.setDeliveryCallback:
+// void deliveryCallback(const mesh_handle& handle, bool delivered, uint32_t latency_ms, uint8_t attempts) { }
 
 void setup() {
  Serial.begin(115200);
+ // To come back from a reset already knowing its peers and routes, call this before mesh.begin().
+ // The state is kept in RTC memory. See mesh.setStateStore to keep it in flash instead.
+ // mesh.setPersistence(true);
  // Initialize the mesh. No arguments necessary.
  mesh.begin();
  // Receive and Send callbacks must be set.
  mesh.setReceiveCallback(messageReceivedCallback);
  mesh.setSendCallback(messageSendCallback);
- // Initialize the timers.
- os_timer_setfn(&scan_timer, scanTimerCallback, NULL);
- os_timer_arm(&scan_timer, SCAN_INTERVAL, true);
+ // Let the mesh find peers on its own. It learns neighbors from the frames and beacons they send,
+ //  and only scans when it has too few.
+ // Scans take around 3 seconds, during which messages are lost, so this is better than scanning on a timer.
+ // If you'd rather scan yourself, leave discovery off and call mesh.scanForPeers() every few seconds.
+ mesh.setDiscovery(true);
+ // In a dense mesh most rebroadcasts reach nodes that already have the broadcast.
+ // This has each node hold a broadcast briefly and drop it if it hears three copies meanwhile.
+ // mesh.setFlooding(FLOOD_COUNTER, 3);
+ // To stay off a busy channel, scan them all and join the one the mesh is on, or the quietest.
+ // mesh.probeChannel();
+ // Only hear, and be heard by, nodes with the same 16 byte key.
+ // const uint8_t key[16] = {...};
+ // mesh.setNetworkKey(key);
+ // On batteries, sleep the radio and wake every 10 seconds to collect messages from a parent.
+ // mesh.setLeaf(10000);
+ // Built with -DNOWMESH_TRACE=1, record what happens to each message here, and write it out in loop()
+ //  for extras/trace/nowmesh_trace.py, which skips the sketch's other output.
+ // mesh.setTracing(true);
+ // Initialize the timer.
  os_timer_setfn(&message_timer, messageTimerCallback, NULL);
  os_timer_arm(&message_timer, MESSAGE_INTERVAL, true);
 }
 
 void loop() {
- // Check if the scan timer has fired.
- if (should_scan) {
-  // Scan for peers. NowMesh will automatically connect to found peers.
-  mesh.scanForPeers();
-  should_scan = false;
- }
- // And if the message timer has fired
+ // Let the mesh process received messages. This must be called often.
+ mesh.loop();
+ // With tracing on, pass recorded events to Serial as there's room for them.
+ // uint8_t trace[256];
+ // Serial.write(trace, mesh.readTrace(trace, min((size_t)Serial.availableForWrite(), sizeof(trace))));
+ // Check if the message timer has fired
  if (should_message) {
   // Send a message.
   mesh.send("hi!");
+  should_message = false;
   // You can also call NowMesh.send with two arguments,
   //  the second being the MAC address of the target.
   // uint8_t target = {0x0a, 0xdf, 0xae, 0x5c, 0x9d, 0x07};
   // mesh.send("hi", target);
+  // A third argument limits how many hops the message may travel. Pass NULL as the target to broadcast.
+  // mesh.send("hi", NULL, 2);
+  // A fourth sets the priority class. Alarms sent at PRIORITY_HIGH overtake telemetry sent at PRIORITY_BULK,
+  //  and bulk frames are the first dropped when the queue is full.
+  // mesh.send("alarm!", NULL, DEFAULT_MAX_HOPS, PRIORITY_HIGH);
+  // mesh.getStats() returns counters of frames received, dropped, forwarded and so on.
+  // mesh_stats stats = mesh.getStats();
+  // Serial.println(String(stats.dropped_duplicate, DEC) + " duplicates");
+  // Binary data can be sent by passing a pointer and a length, up to MAX_PAYLOAD_LEN bytes.
+  // Longer messages, up to MAX_FRAGMENTED_LEN bytes, are sent in fragments and reassembled by the target.
+  // float reading = 21.5;
+  // mesh.send(reinterpret_cast<const uint8_t*>(&reading), sizeof(reading));
+  // If one node calls mesh.setGateway(true), the others keep a route up a tree towards it,
+  //  and reports sent with sendToGateway cost one frame per hop instead of a flood.
+  // mesh.sendToGateway(reinterpret_cast<const uint8_t*>(&reading), sizeof(reading));
  }
 }
@@ -0,0 +1,495 @@
+#include "Radio.h"
+#include <math.h>
+
+// Simulated radio, and the SDK stubs on top of it.
+
+Radio* Radio::current = NULL;
+SimSerial Serial;
+
+static const uint8_t broadcast[6] = {0xff, 0xff, 0xff, 0xff, 0xff, 0xff};
+
+// ESP Now allows this many peers.
+#define SIM_MAX_PEERS 20
+
+Radio::Radio(const radio_config& config) : config(config), rng(config.seed) {
+ current = this;
+}
+
+Radio::~Radio() {
+ for (size_t i = 0; i < nodes.size(); i++) {
+  delete nodes[i].mesh;
+ }
+ if (current == this) {
+  current = NULL;
+ }
+}
+
+double Radio::distance(int a, int b) const {
+ double dx = nodes[a].x - nodes[b].x;
+ double dy = nodes[a].y - nodes[b].y;
+ return sqrt(dx * dx + dy * dy);
+}
+
+double Radio::lossAt(double meters) const {
+ double reach = meters / config.range;
+ return config.loss_near + (config.loss_edge - config.loss_near) * reach * reach;
+}
+
+int Radio::addNode(double x, double y) {
+ int index = nodes.size();
+ nodes.push_back(sim_node());
+ sim_node& node = nodes.back();
+ node.x = x;
+ node.y = y;
+ // As on an ESP8266, the softAP MAC is the station MAC with the locally administered bit set.
+ uint8_t mac[6] = {0x5c, 0x4d, 0x00, 0x00, (uint8_t)(index >> 8), (uint8_t)index};
+ memcpy(node.mac, mac, 6);
+ mac[0] |= 0x02;
+ memcpy(node.ap_mac, mac, 6);
+ // Nodes booted at different times, so their clocks disagree by up to a few seconds. This doesn't
+ //  draw from rng, so it changes nothing else about the run.
+ node.clock_offset = index * 2654435761u % 5000000;
+ for (int other = 0; other < index; other++) {
+  if (distance(index, other) <= config.range) {
+   nodes[index].neighbors.push_back(other);
+   nodes[other].neighbors.push_back(index);
+  }
+ }
+ nodes[index].mesh = new NowMesh();
+ as(index, [this, index]() {
+  if (onBoot) {
+   onBoot(index, nodes[index].mesh);
+  }
+  nodes[index].mesh->begin();
+  nodes[index].mesh->setDiscovery(true);
+ });
+ // Nodes don't all boot at the same instant.
+ schedule(now + std::uniform_int_distribution<uint32_t>(0, config.loop_interval * 100)(rng), index, [this, index]() {
+  loopNode(index);
+ });
+ return index;
+}
+
+void Radio::switchOff(int node) {
+ nodes[node].off = true;
+ nodes[node].asleep = true;
+}
+
+void Radio::reboot(int node) {
+ delete nodes[node].mesh;
+ nodes[node].mesh = new NowMesh();
+ nodes[node].peers.clear();
+ nodes[node].fetch_position = 0;
+ nodes[node].asleep = false;
+ nodes[node].clock_offset = -(uint32_t)now;
+ as(node, [this, node]() {
+  if (onBoot) {
+   onBoot(node, nodes[node].mesh);
+  }
+  nodes[node].mesh->begin();
+  nodes[node].mesh->setDiscovery(true);
+ });
+}
+
+void Radio::schedule(uint64_t time, int node, std::function<void()> action) {
+ event entry;
+ entry.time = time;
+ entry.sequence = sequence++;
+ entry.node = node;
+ entry.action = action;
+ events.push(entry);
+}
+
+void Radio::as(int node, std::function<void()> action) {
+ int previous = running;
+ Radio* previous_radio = current;
+ running = node;
+ current = this;
+ action();
+ running = previous;
+ current = previous_radio;
+}
+
+sim_node& Radio::self() {
+ return nodes[running];
+}
+
+int Radio::findNode(const uint8_t* mac) const {
+ // Nodes' MACs end in their index.
+ int index = (mac[4] << 8) | mac[5];
+ if (index < (int)nodes.size() && (memcmp(nodes[index].mac, mac, 6) == 0 || memcmp(nodes[index].ap_mac, mac, 6) == 0)) {
+  return index;
+ }
+ return -1;
+}
+
+void Radio::run(uint32_t ms) {
+ uint64_t end = now + (uint64_t)ms * 1000;
+ while (!events.empty() && events.top().time <= end) {
+  event entry = events.top();
+  events.pop();
+  now = entry.time;
+  as(entry.node, entry.action);
+ }
+ now = end;
+}
+
+void Radio::loopNode(int node) {
+ if (nodes[node].off) {
+  return;
+ }
+ nodes[node].mesh->loop();
+ schedule(now + config.loop_interval, node, [this, node]() {
+  loopNode(node);
+ });
+}
+
+// Wait a random backoff, then send the frame at the front of the node's fifo if the channel is clear.
+void Radio::channelAccess(int node) {
+ nodes[node].tx_busy = true;
+ uint32_t backoff = 50 + std::uniform_int_distribution<int>(0, config.contention_slots - 1)(rng) * config.slot_time;
+ schedule(now + backoff, node, [this, node]() {
+  sim_node& sender = nodes[node];
+  // What it had queued is never sent.
+  if (sender.off) {
+   return;
+  }
+  if (sender.scanning_until > now) {
+   schedule(sender.scanning_until, node, [this, node]() {
+    channelAccess(node);
+   });
+   return;
+  }
+  if (sender.rx_until > now) {
+   schedule(sender.rx_until, node, [this, node]() {
+    channelAccess(node);
+   });
+   return;
+  }
+  startTransmission(node);
+ });
+}
+
+void Radio::startTransmission(int node) {
+ sim_node& sender = nodes[node];
+ const sim_node::queued_frame& frame = sender.tx_fifo.front();
+ int id = next_transmission++;
+ transmission& air = transmissions[id];
+ air.sender = node;
+ air.dest = frame.dest;
+ air.data = frame.data;
+ uint64_t end = now + config.frame_overhead + frame.data.size() * config.byte_time;
+ sender.transmitting = true;
+ counters.frames++;
+ for (size_t i = 0; i < sender.neighbors.size(); i++) {
+  int index = sender.neighbors[i];
+  sim_node& receiver = nodes[index];
+  if (receiver.channel != sender.channel || receiver.transmitting || receiver.scanning_until > now || receiver.asleep) {
+   continue;
+  }
+  bool intact = true;
+  if (receiver.rx_until > now) {
+   // Already hearing something. Both frames are lost here.
+   intact = false;
+   std::unordered_map<int, transmission>::iterator other = transmissions.find(receiver.rx_transmission);
+   if (other != transmissions.end()) {
+    for (size_t j = 0; j < other->second.receivers.size(); j++) {
+     if (other->second.receivers[j] == index) {
+      other->second.intact[j] = false;
+     }
+    }
+   }
+   if (end > receiver.rx_until) {
+    receiver.rx_until = end;
+   }
+  }
+  else {
+   receiver.rx_until = end;
+  }
+  receiver.rx_transmission = id;
+  air.receivers.push_back(index);
+  air.intact.push_back(intact);
+ }
+ schedule(end, -1, [this, id]() {
+  endTransmission(id);
+ });
+}
+
+void Radio::endTransmission(int id) {
+ transmission air = transmissions[id];
+ transmissions.erase(id);
+ sim_node& sender = nodes[air.sender];
+ sender.transmitting = false;
+ bool is_broadcast = memcmp(air.dest.data(), broadcast, 6) == 0;
+ bool acked = false;
+ for (size_t i = 0; i < air.receivers.size(); i++) {
+  int index = air.receivers[i];
+  sim_node& receiver = nodes[index];
+  if (receiver.rx_transmission == id) {
+   receiver.rx_transmission = -1;
+  }
+  if (!air.intact[i]) {
+   counters.collisions++;
+   continue;
+  }
+  if (receiver.scanning_until > now || receiver.asleep || std::uniform_real_distribution<double>(0, 1)(rng) < lossAt(distance(air.sender, index))) {
+   continue;
+  }
+  // The radio filters out unicast frames for others.
+  if (!is_broadcast && memcmp(receiver.ap_mac, air.dest.data(), 6) != 0) {
+   continue;
+  }
+  acked = acked || !is_broadcast;
+  counters.delivered++;
+  std::vector<uint8_t> data = air.data;
+  std::vector<uint8_t> mac(sender.ap_mac, sender.ap_mac + 6);
+  schedule(now + 20, index, [this, index, data, mac]() mutable {
+   if (onReceive) {
+    onReceive(index, data.data(), data.size());
+   }
+   nodes[index].mesh->handleReceive(mac.data(), data.data(), data.size());
+  });
+ }
+ sim_node::queued_frame& frame = sender.tx_fifo.front();
+ int node = air.sender;
+ uint64_t done = now + (is_broadcast ? 0 : config.ack_time);
+ if (!is_broadcast && !acked && frame.attempts < 1 + config.mac_retries) {
+  frame.attempts++;
+  schedule(done, node, [this, node]() {
+   channelAccess(node);
+  });
+  return;
+ }
+ std::vector<uint8_t> dest = frame.dest;
+ sender.tx_fifo.pop();
+ uint8_t status = is_broadcast || acked ? 0 : 1;
+ if (reportDelay) {
+  done += reportDelay(node, dest.data(), status);
+ }
+ schedule(done, node, [this, node, dest, status]() mutable {
+  nodes[node].mesh->handleSent(dest.data(), status);
+  if (!nodes[node].tx_fifo.empty()) {
+   channelAccess(node);
+  }
+  else {
+   nodes[node].tx_busy = false;
+  }
+ });
+}
+
+int Radio::send(const uint8_t* dest, const uint8_t* data, int len) {
+ sim_node& node = self();
+ if (len <= 0 || len > 250 || node.asleep) {
+  return -1;
+ }
+ std::vector<std::vector<uint8_t>> targets;
+ if (dest == NULL) {
+  targets = node.peers;
+ }
+ else if (esp_now_is_peer_exist(const_cast<uint8_t*>(dest))) {
+  targets.push_back(std::vector<uint8_t>(dest, dest + 6));
+ }
+ if (targets.empty()) {
+  return -1;
+ }
+ if (onSend) {
+  onSend(running, dest, data, len);
+ }
+ for (size_t i = 0; i < targets.size(); i++) {
+  sim_node::queued_frame frame;
+  frame.dest = targets[i];
+  frame.data.assign(data, data + len);
+  frame.attempts = 1;
+  node.tx_fifo.push(frame);
+ }
+ if (!node.tx_busy) {
+  channelAccess(running);
+ }
+ return 0;
+}
+
+void Radio::scan(uint8_t channel) {
+ int index = running;
+ sim_node& node = self();
+ node.scanning_until = now + (uint64_t)config.scan_time * 1000;
+ schedule(node.scanning_until, index, [this, index, channel]() {
+  sim_node& node = nodes[index];
+  node.scan_results.clear();
+  for (size_t i = 0; i < node.neighbors.size(); i++) {
+   int other = node.neighbors[i];
+   // A sleeping node's AP isn't beaconing.
+   if ((channel != 0 && nodes[other].channel != channel) || nodes[other].asleep) {
+    continue;
+   }
+   double meters = distance(index, other);
+   // Scans miss the odd AP, the far ones more often.
+   if (std::uniform_real_distribution<double>(0, 1)(rng) < lossAt(meters)) {
+    continue;
+   }
+   bss_info info;
+   memset(&info, 0, sizeof(info));
+   memcpy(info.bssid, nodes[other].ap_mac, 6);
+   info.ssid_len = snprintf((char*)info.ssid, sizeof(info.ssid), "ESP_%02X%02X%02X", nodes[other].ap_mac[3], nodes[other].ap_mac[4], nodes[other].ap_mac[5]);
+   info.channel = nodes[other].channel;
+   info.rssi = -40 - (int)(50 * meters / config.range);
+   node.scan_results.push_back(info);
+  }
+  for (size_t i = 0; i < node.scan_results.size(); i++) {
+   node.scan_results[i].next.stqe_next = i + 1 < node.scan_results.size() ? &node.scan_results[i + 1] : NULL;
+  }
+  node.mesh->handleScanDone(node.scan_results.empty() ? NULL : &node.scan_results[0], OK);
+ });
+}
+
+// Arduino stubs.
+
+uint32_t millis() {
+ return Radio::current->now / 1000;
+}
+
+uint32_t micros() {
+ return Radio::current->now + Radio::current->self().clock_offset;
+}
+
+long random(long max) {
+ return max <= 0 ? 0 : std::uniform_int_distribution<long>(0, max - 1)(Radio::current->rng);
+}
+
+long random(long min, long max) {
+ return min + random(max - min);
+}
+
+// SDK stubs. The radio calls NowMesh's handlers itself, so registering callbacks does nothing.
+
+int esp_now_init(void) {
+ return 0;
+}
+
+int esp_now_register_send_cb(esp_now_send_cb_t) {
+ return 0;
+}
+
+int esp_now_register_recv_cb(esp_now_recv_cb_t) {
+ return 0;
+}
+
+int esp_now_set_self_role(u8) {
+ return 0;
+}
+
+int esp_now_send(u8* da, u8* data, int len) {
+ return Radio::current->send(da, data, len);
+}
+
+int esp_now_add_peer(u8* mac_addr, u8, u8, u8*, u8) {
+ sim_node& node = Radio::current->self();
+ if (esp_now_is_peer_exist(mac_addr) || node.peers.size() >= SIM_MAX_PEERS) {
+  return -1;
+ }
+ node.peers.push_back(std::vector<uint8_t>(mac_addr, mac_addr + 6));
+ return 0;
+}
+
+int esp_now_del_peer(u8* mac_addr) {
+ sim_node& node = Radio::current->self();
+ for (size_t i = 0; i < node.peers.size(); i++) {
+  if (memcmp(node.peers[i].data(), mac_addr, 6) == 0) {
+   node.peers.erase(node.peers.begin() + i);
+   // Deleting the peer just fetched mustn't skip the next one.
+   if (i < node.fetch_position) {
+    node.fetch_position--;
+   }
+   return 0;
+  }
+ }
+ return -1;
+}
+
+u8* esp_now_fetch_peer(bool restart) {
+ sim_node& node = Radio::current->self();
+ if (restart) {
+  node.fetch_position = 0;
+ }
+ if (node.fetch_position >= node.peers.size()) {
+  return NULL;
+ }
+ // Hand out a copy, so deleting the peer doesn't pull it from under the caller.
+ static uint8_t fetched[6];
+ memcpy(fetched, node.peers[node.fetch_position++].data(), 6);
+ return fetched;
+}
+
+int esp_now_is_peer_exist(u8* mac_addr) {
+ sim_node& node = Radio::current->self();
+ for (size_t i = 0; i < node.peers.size(); i++) {
+  if (memcmp(node.peers[i].data(), mac_addr, 6) == 0) {
+   return 1;
+  }
+ }
+ return 0;
+}
+
+int esp_now_get_cnt_info(u8* all_cnt, u8* encrypt_cnt) {
+ *all_cnt = Radio::current->self().peers.size();
+ *encrypt_cnt = 0;
+ return 0;
+}
+
+bool wifi_station_scan(struct scan_config* config, scan_done_cb_t) {
+ // Like the SDK, refuse to start a scan while one is running.
+ if (Radio::current->self().scanning_until > Radio::current->now) {
+  return false;
+ }
+ Radio::current->scan(config->channel);
+ return true;
+}
+
+bool system_rtc_mem_write(uint8_t des_addr, const void* src_addr, uint16_t save_size) {
+ std::vector<uint8_t>& memory = Radio::current->self().rtc_memory;
+ if ((size_t)des_addr * 4 + save_size > memory.size()) {
+  return false;
+ }
+ memcpy(memory.data() + des_addr * 4, src_addr, save_size);
+ return true;
+}
+
+bool system_rtc_mem_read(uint8_t src_addr, void* des_addr, uint16_t save_size) {
+ std::vector<uint8_t>& memory = Radio::current->self().rtc_memory;
+ if ((size_t)src_addr * 4 + save_size > memory.size()) {
+  return false;
+ }
+ memcpy(des_addr, memory.data() + src_addr * 4, save_size);
+ return true;
+}
+
+bool wifi_get_macaddr(uint8_t if_index, uint8_t* macaddr) {
+ memcpy(macaddr, if_index == SOFTAP_IF ? Radio::current->self().ap_mac : Radio::current->self().mac, 6);
+ return true;
+}
+
+bool wifi_set_opmode(uint8_t) {
+ return true;
+}
+
+bool wifi_set_channel(uint8_t channel) {
+ Radio::current->self().channel = channel;
+ return true;
+}
+
+void wifi_fpm_set_sleep_type(enum sleep_type) {
+}
+
+void wifi_fpm_open(void) {
+}
+
+void wifi_fpm_close(void) {
+}
+
+void wifi_fpm_do_wakeup(void) {
+ Radio::current->self().asleep = false;
+}
+
+sint8 wifi_fpm_do_sleep(uint32_t) {
+ Radio::current->self().asleep = true;
+ return 0;
+}
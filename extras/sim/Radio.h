@@ -0,0 +1,178 @@
+#ifndef NOWMESH_SIM_RADIO_H
+#define NOWMESH_SIM_RADIO_H
+
+// A discrete-event model of a shared 2.4 GHz channel, for running many NowMesh nodes in one process.
+// Nodes sit on a plane. A frame reaches every node within range, minus random loss that grows
+//  with distance. Frames take airtime, senders wait for a clear channel, and two frames
+//  overlapping at a receiver are both lost there, so hidden nodes collide.
+// Unicast frames are acknowledged and retried like the real MAC, and the send callback
+//  reports whether the target got one. Radios are half duplex and deaf while scanning or asleep,
+//  and only hear nodes on their own channel.
+// The SDK stubs act on the node the radio is currently running, which it switches as it goes.
+
+#include <stdint.h>
+#include <functional>
+#include <queue>
+#include <random>
+#include <unordered_map>
+#include <vector>
+#include "NowMesh.h"
+
+// Bytes of RTC memory, 192 blocks of 4 like the ESP8266's.
+#define SIM_RTC_MEMORY 768
+
+struct radio_config {
+ // Meters a frame carries.
+ double range = 100;
+ // Chance of losing a frame at zero distance and at the edge of range. Loss grows with distance squared.
+ double loss_near = 0.02;
+ double loss_edge = 0.3;
+ // Microseconds per byte on the air, 8 at 1 Mbit/s, and per frame for the preamble and MAC overhead.
+ uint32_t byte_time = 8;
+ uint32_t frame_overhead = 192 + 43 * 8;
+ // Microseconds from the end of a unicast frame to the end of its ACK.
+ uint32_t ack_time = 304;
+ // Times the MAC retries a unicast frame that wasn't acknowledged.
+ int mac_retries = 3;
+ // Contention window, in slots, and slot length in microseconds.
+ int contention_slots = 32;
+ uint32_t slot_time = 20;
+ // Microseconds between calls to each node's loop().
+ uint32_t loop_interval = 1000;
+ // Milliseconds a scan takes, during which the node hears nothing.
+ uint32_t scan_time = 1500;
+ unsigned int seed = 1;
+};
+
+// Counts the radio keeps, for the benchmark to report.
+struct radio_counters {
+ // Transmissions started, data and other, retries included.
+ uint32_t frames = 0;
+ // Frames lost to collisions at a receiver.
+ uint32_t collisions = 0;
+ // Frames that reached a node's receive handler.
+ uint32_t delivered = 0;
+};
+
+// One simulated node: a NowMesh instance and what the SDK would know about it.
+struct sim_node {
+ NowMesh* mesh;
+ // Station MAC, which NowMesh knows the node by, and softAP MAC, which its frames go out from and
+ //  peers add it by.
+ uint8_t mac[6];
+ uint8_t ap_mac[6];
+ double x;
+ double y;
+ // Nodes within range.
+ std::vector<int> neighbors;
+ // ESP Now peer list, and where esp_now_fetch_peer is up to in it.
+ std::vector<std::vector<uint8_t>> peers;
+ size_t fetch_position = 0;
+ // Frames handed to esp_now_send, waiting for the air.
+ struct queued_frame {
+  std::vector<uint8_t> dest;
+  std::vector<uint8_t> data;
+  int attempts;
+ };
+ std::queue<queued_frame> tx_fifo;
+ // Whether a frame from the fifo is on the air or waiting out a backoff.
+ bool tx_busy = false;
+ // Transmission being received, -1 for none, and when it ends.
+ int rx_transmission = -1;
+ uint64_t rx_until = 0;
+ bool transmitting = false;
+ uint64_t scanning_until = 0;
+ // The radio is off for forced sleep.
+ bool asleep = false;
+ // The node is switched off, see Radio::switchOff.
+ bool off = false;
+ // Added to the simulation's clock for the node's micros(), which like a real one counts from its own boot.
+ uint32_t clock_offset = 0;
+ // RTC memory, which keeps its contents when the node reboots.
+ std::vector<uint8_t> rtc_memory = std::vector<uint8_t>(SIM_RTC_MEMORY, 0);
+ // Nodes only hear, and collide with, nodes on their own channel. Channels are taken not to overlap.
+ uint8_t channel = 1;
+ // Results of the last scan. The scan callback gets a pointer into this.
+ std::vector<bss_info> scan_results;
+};
+
+class Radio {
+ struct event {
+  uint64_t time;
+  uint64_t sequence;
+  int node;
+  std::function<void()> action;
+  bool operator>(const event& other) const {
+   return time != other.time ? time > other.time : sequence > other.sequence;
+  }
+ };
+ struct transmission {
+  int sender;
+  std::vector<uint8_t> dest;
+  std::vector<uint8_t> data;
+  // Receivers in range that weren't busy, and whether the frame survived at each.
+  std::vector<int> receivers;
+  std::vector<bool> intact;
+ };
+
+ std::priority_queue<event, std::vector<event>, std::greater<event>> events;
+ uint64_t sequence = 0;
+ std::unordered_map<int, transmission> transmissions;
+ int next_transmission = 0;
+ int running = -1;
+
+ double distance(int a, int b) const;
+ double lossAt(double meters) const;
+ void channelAccess(int node);
+ void startTransmission(int node);
+ void endTransmission(int id);
+ void loopNode(int node);
+
+public:
+ radio_config config;
+ radio_counters counters;
+ std::vector<sim_node> nodes;
+ std::mt19937 rng;
+ // Microseconds since the simulation started.
+ uint64_t now = 0;
+ // Called with each node's new NowMesh just before begin(), when it's added and when it reboots.
+ std::function<void(int, NowMesh*)> onBoot;
+ // Called with the receiving node for every frame that reaches one, before NowMesh sees it.
+ std::function<void(int, const uint8_t*, uint8_t)> onReceive;
+ // Called with the sending node and destination, NULL for every peer, for every frame handed to
+ //  esp_now_send that it takes.
+ std::function<void(int, const uint8_t*, const uint8_t*, int)> onSend;
+ // Called with the sending node, destination and status of every send report, returns the
+ //  microseconds the SDK holds it back for. A real one now and then takes longer than TX_TIMEOUT,
+ //  so the report comes after NowMesh gave up on the frame. The node sends nothing more meanwhile.
+ std::function<uint32_t(int, const uint8_t*, uint8_t)> reportDelay;
+
+ // The radio stubs talk to this one.
+ static Radio* current;
+
+ Radio(const radio_config& config);
+ ~Radio();
+ // Add a node at x, y and start it, with discovery on. Returns its index.
+ int addNode(double x, double y);
+ // Switch a node off for good, as if it lost power. Its radio goes quiet and its loop() stops.
+ void switchOff(int node);
+ // Restart a node with a new NowMesh, as if it was reset. It begins again with discovery on, and
+ //  only its RTC memory is kept. Whatever was set on the old instance has to be set again.
+ void reboot(int node);
+ // Run the simulation for this many milliseconds.
+ void run(uint32_t ms);
+ // Schedule something at a time, in microseconds, running as node, or as no node if that's -1.
+ void schedule(uint64_t time, int node, std::function<void()> action);
+ // Run an action as node, so SDK stubs called from it act on that node.
+ void as(int node, std::function<void()> action);
+ sim_node& self();
+ // The node with this station or softAP MAC, or -1.
+ int findNode(const uint8_t* mac) const;
+
+ // SDK stubs call these.
+ int send(const uint8_t* dest, const uint8_t* data, int len);
+ // Scan one channel, or all of them if channel is 0.
+ void scan(uint8_t channel);
+};
+
+#endif
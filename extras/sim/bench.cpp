@@ -0,0 +1,551 @@
+// Benchmark NowMesh on the simulated radio.
+// For each topology and size, nodes boot with discovery on and get time to find each other,
+//  then random nodes send targeted messages to random others, and a few broadcast.
+// Reported per run:
+//  delivery  share of targeted messages that reached their target
+//  p50, p99  end-to-end latency of delivered targeted messages, in milliseconds
+//  reach     share of the other nodes each broadcast reached
+//  dup rx    data frames received by a node that already had that frame, per message sent
+//  frames    frames on the air, retries and control traffic included, per delivered targeted message
+//  bc frames frames on the air per broadcast, from the first broadcast to the end, control traffic included
+// With --collect node 0 is a gateway, and targeted messages go from random nodes to it with sendToGateway.
+// --gossip p and --counter k set every node's flooding strategy, see NowMesh::setFlooding.
+// With --split the nodes on the right half move to channel 6, and a bridge joins the halves.
+// With --auth every node tags its frames with the same network key, see NowMesh::setNetworkKey.
+//  The radio model takes no time for processing, so the time it adds is measured on its own, on this host.
+// --leaves adds half as many leaves again, scattered over the same area, that wake up every
+//  LEAF_BENCH_INTERVAL, see NowMesh::setLeaf. Half the targeted messages then go from a leaf
+//  and half to one, and the share of the time leaves had their radio on is reported, along with
+//  their radio on time per delivered message from a leaf.
+// --churn switches one in CHURN_SHARE nodes off as traffic starts, after the others have learned
+//  routes through them. Messages then only go between, and reach is counted over, the nodes left.
+// --reboot resets one in CHURN_SHARE nodes halfway through the targeted messages, and has every
+//  other targeted message after that come from one of them. Nodes keep their state in RTC memory
+//  if persistence is built in, see NowMesh::setPersistence.
+// --trace file turns tracing on at every node and writes their events to file as NowMesh::readTrace
+//  gives them, for extras/trace/nowmesh_trace.py. Only the last run is kept. It needs a build with
+//  tracing in, make bench-trace.
+// Usage: bench [grid|line|random] [nodes...] [--seed n] [--collect] [--gossip p | --counter k] [--split] [--auth] [--leaves] [--churn] [--reboot] [--trace file]
+
+#include <algorithm>
+#include <chrono>
+#include <math.h>
+#include <string>
+#include <unordered_set>
+#include "Radio.h"
+
+// Milliseconds nodes get to find each other before traffic starts.
+#define WARMUP_TIME 20000
+#define TARGETED_MESSAGES 100
+#define TARGETED_INTERVAL 100
+#define BROADCAST_MESSAGES 10
+#define BROADCAST_INTERVAL 500
+// Microseconds a frame takes across a bridge's serial link, and per byte of it, at 921600 baud.
+#define BRIDGE_LATENCY 500
+#define BRIDGE_BYTE_TIME 11
+// Milliseconds left for the last messages to arrive.
+#define DRAIN_TIME 5000
+#define PAYLOAD_LEN 32
+#define PAYLOAD_MAGIC 0x4e4d4245
+// Milliseconds between a leaf's wake ups.
+#define LEAF_BENCH_INTERVAL 1000
+// One in this many nodes is switched off with --churn, or reset with --reboot.
+#define CHURN_SHARE 10
+// Microseconds between reads of the nodes' trace buffers with --trace.
+#define TRACE_READ_INTERVAL 5000
+// Frames tagged to time the tag.
+#define TAG_TIMING_FRAMES 1000000
+
+static const uint8_t bench_key[16] = {'N', 'o', 'w', 'M', 'e', 's', 'h', ' ', 'b', 'e', 'n', 'c', 'h', 'k', 'e', 'y'};
+
+struct bench_payload {
+ uint32_t magic;
+ uint32_t sequence;
+ uint8_t padding[PAYLOAD_LEN - 8];
+};
+
+struct sent_message {
+ int source;
+ int target;
+ uint64_t sent_at;
+ uint64_t delivered_at;
+ bool delivered;
+ // Nodes a broadcast reached. A node's duplicate store can forget a message and deliver it again.
+ std::vector<bool> reached;
+};
+
+struct bench_result {
+ double delivery;
+ double p50;
+ double p99;
+ double reach;
+ double duplicates;
+ double frames;
+ double broadcast_frames;
+ // Share of the time leaves were awake, and milliseconds awake per message from a leaf delivered.
+ double leaf_awake;
+ double leaf_awake_per_message;
+};
+
+static void place(Radio& radio, const std::string& topology, int count) {
+ double range = radio.config.range;
+ if (topology == "grid") {
+  int side = ceil(sqrt(count));
+  for (int i = 0; i < count; i++) {
+   radio.addNode((i % side) * range * 0.6, (i / side) * range * 0.6);
+  }
+ }
+ else if (topology == "line") {
+  for (int i = 0; i < count; i++) {
+   radio.addNode(i * range * 0.7, 0);
+  }
+ }
+ else {
+  // Square sized so nodes have around ten neighbors on average.
+  double side = sqrt(count * M_PI * range * range / 10);
+  std::uniform_real_distribution<double> coordinate(0, side);
+  for (int i = 0; i < count; i++) {
+   radio.addNode(coordinate(radio.rng), coordinate(radio.rng));
+  }
+ }
+}
+
+#if NOWMESH_BRIDGE
+// Move the right half of the nodes to channel 6, and put a bridge in the middle: a node on each
+//  channel, wired together so each hands the other the frames it should pass on.
+static void split(Radio& radio, int count) {
+ double right = 0;
+ double bottom = 0;
+ for (int i = 0; i < count; i++) {
+  right = std::max(right, radio.nodes[i].x);
+  bottom = std::max(bottom, radio.nodes[i].y);
+ }
+ for (int i = 0; i < count; i++) {
+  if (radio.nodes[i].x > right / 2) {
+   radio.as(i, [&radio, i]() {
+    radio.nodes[i].mesh->setChannel(6);
+   });
+  }
+ }
+ int ends[2];
+ ends[0] = radio.addNode(right / 2, bottom / 2);
+ ends[1] = radio.addNode(right / 2, bottom / 2);
+ radio.as(ends[1], [&radio, &ends]() {
+  radio.nodes[ends[1]].mesh->setChannel(6);
+ });
+ for (int end = 0; end < 2; end++) {
+  int other = ends[1 - end];
+  radio.nodes[ends[end]].mesh->setBridgeCallback([&radio, other](const uint8_t* frame, size_t len) {
+   std::vector<uint8_t> copy(frame, frame + len);
+   radio.schedule(radio.now + BRIDGE_LATENCY + len * BRIDGE_BYTE_TIME, other, [&radio, other, copy]() {
+    radio.nodes[other].mesh->bridgeReceive(copy.data(), copy.size());
+   });
+  });
+ }
+}
+#endif
+
+#if NOWMESH_LEAF
+// Add count / 2 leaves at random spots among the first count nodes. Returns their indices.
+static std::vector<int> addLeaves(Radio& radio, int count) {
+ double right = 0;
+ double bottom = 0;
+ for (int i = 0; i < count; i++) {
+  right = std::max(right, radio.nodes[i].x);
+  bottom = std::max(bottom, radio.nodes[i].y);
+ }
+ std::vector<int> leaves;
+ for (int i = 0; i < count / 2; i++) {
+  double x = std::uniform_real_distribution<double>(0, right)(radio.rng);
+  double y = std::uniform_real_distribution<double>(0, bottom)(radio.rng);
+  int leaf = radio.addNode(x, y);
+  radio.as(leaf, [&radio, leaf]() {
+   radio.nodes[leaf].mesh->setLeaf(LEAF_BENCH_INTERVAL);
+  });
+  leaves.push_back(leaf);
+ }
+ return leaves;
+}
+#endif
+
+#if NOWMESH_AUTH
+// Nanoseconds it takes to tag a frame of len bytes, which is also about what checking one takes.
+// A frame costs that once to check on the way in and once to tag on the way out, at every hop.
+static double tagTime(size_t len) {
+ SipHash hash;
+ hash.setKey(bench_key);
+ uint8_t mac[6] = {0x5e, 1, 2, 3, 4, 5};
+ uint8_t frame[250];
+ memset(frame, 0x5a, sizeof(frame));
+ uint64_t sink = 0;
+ std::chrono::steady_clock::time_point started = std::chrono::steady_clock::now();
+ for (int i = 0; i < TAG_TIMING_FRAMES; i++) {
+  // Feed each tag into the next frame, so the compiler can't skip any.
+  frame[0] = sink;
+  sink ^= hash.hash(mac, 6, frame, len);
+ }
+ std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - started;
+ return sink == 1 ? 0 : elapsed.count() / TAG_TIMING_FRAMES;
+}
+#endif
+
+// What each node's message handler gets back as its context.
+struct bench_receiver {
+ Radio* radio;
+ std::vector<sent_message>* sent;
+ int node;
+};
+
+static void messageReceived(void* context, const mesh_message& message) {
+ bench_receiver* receiver = static_cast<bench_receiver*>(context);
+ bench_payload payload;
+ if (message.len != sizeof(payload)) {
+  return;
+ }
+ memcpy(&payload, message.data, sizeof(payload));
+ if (payload.magic != PAYLOAD_MAGIC || payload.sequence >= receiver->sent->size()) {
+  return;
+ }
+ sent_message& record = (*receiver->sent)[payload.sequence];
+ if (record.target < 0) {
+  record.reached[receiver->node] = true;
+ }
+ else if (record.target == receiver->node && !record.delivered) {
+  record.delivered = true;
+  record.delivered_at = receiver->radio->now;
+ }
+}
+
+static bench_result runBench(const std::string& topology, int count, unsigned int seed, bool collect, int flood_mode, int flood_parameter, bool split_channels, bool auth, bool leaves, bool churn, bool reboot, const char* trace_path) {
+ radio_config config;
+ config.seed = seed;
+ Radio radio(config);
+#if NOWMESH_PERSIST
+ if (reboot) {
+  radio.onBoot = [](int, NowMesh* mesh) {
+   mesh->setPersistence(true);
+  };
+ }
+#endif
+ place(radio, topology, count);
+ if (split_channels) {
+#if NOWMESH_BRIDGE
+  split(radio, count);
+#endif
+ }
+ std::vector<int> leaf_nodes;
+#if NOWMESH_LEAF
+ if (leaves) {
+  leaf_nodes = addLeaves(radio, count);
+ }
+#else
+ (void)leaves;
+#endif
+ std::vector<sent_message> sent;
+ std::vector<bench_receiver> receivers(radio.nodes.size());
+ // Set up a node's NowMesh, once it's added and again whenever it reboots.
+ auto configure = [&](int i) {
+  NowMesh* mesh = radio.nodes[i].mesh;
+  mesh->setMessageHandler(messageReceived, &receivers[i]);
+#if NOWMESH_FLOOD_CONTROL
+  if (i < count) {
+   mesh->setFlooding(flood_mode, flood_parameter);
+  }
+#endif
+#if NOWMESH_AUTH
+  if (auth) {
+   mesh->setNetworkKey(bench_key);
+  }
+#endif
+#if NOWMESH_TRACE
+  mesh->setTracing(trace_path != NULL);
+#endif
+ };
+#if !NOWMESH_FLOOD_CONTROL
+ (void)flood_mode;
+ (void)flood_parameter;
+#endif
+#if !NOWMESH_AUTH
+ (void)auth;
+#endif
+#if NOWMESH_TRACE
+ // Read the trace buffers often enough that they don't fill up, as a sketch writing them to Serial would.
+ FILE* trace_file = trace_path != NULL ? fopen(trace_path, "wb") : NULL;
+ std::function<void()> readTraces = [&radio, trace_file, &readTraces]() {
+  uint8_t buffer[512];
+  for (size_t i = 0; i < radio.nodes.size(); i++) {
+   size_t len;
+   while ((len = radio.nodes[i].mesh->readTrace(buffer, sizeof(buffer))) > 0) {
+    fwrite(buffer, 1, len, trace_file);
+   }
+  }
+  radio.schedule(radio.now + TRACE_READ_INTERVAL, -1, readTraces);
+ };
+ if (trace_file != NULL) {
+  radio.schedule(radio.now, -1, readTraces);
+ }
+#else
+ (void)trace_path;
+#endif
+ for (int i = 0; i < (int)radio.nodes.size(); i++) {
+  receivers[i].radio = &radio;
+  receivers[i].sent = &sent;
+  receivers[i].node = i;
+  configure(i);
+ }
+#if NOWMESH_COLLECTION
+ if (collect) {
+  radio.as(0, [&radio]() {
+   radio.nodes[0].mesh->setGateway(true);
+  });
+ }
+#endif
+ radio.run(WARMUP_TIME);
+
+ // Node 0 stays on, since it may be the gateway.
+ std::vector<bool> alive(radio.nodes.size(), true);
+ int live = count;
+ std::uniform_int_distribution<int> pick_router(1, count - 1);
+ for (int i = 0; churn && i < count / CHURN_SHARE; i++) {
+  int victim;
+  do {
+   victim = pick_router(radio.rng);
+  } while (!alive[victim]);
+  alive[victim] = false;
+  live--;
+  radio.switchOff(victim);
+ }
+
+ // Count data frames that reach a node a second time.
+ uint32_t duplicates = 0;
+ std::unordered_set<uint64_t> seen;
+ radio.onReceive = [&duplicates, &seen](int node, const uint8_t* data, uint8_t len) {
+  if (len < sizeof(mesh_header)) {
+   return;
+  }
+  const mesh_header* header = reinterpret_cast<const mesh_header*>(data);
+  if (header->type != MESSAGE_BROADCAST && header->type != MESSAGE_TARGETED) {
+   return;
+  }
+  uint64_t key = ((uint64_t)node << 40) | ((uint64_t)header->originator[4] << 32) | ((uint64_t)header->originator[5] << 24) | ((uint64_t)header->id << 8) | header->flags;
+  if (!seen.insert(key).second) {
+   duplicates++;
+  }
+ };
+ uint32_t frames_before = radio.counters.frames;
+ uint64_t traffic_started = radio.now;
+ uint64_t awake_before = 0;
+#if NOWMESH_STATS
+ for (size_t i = 0; i < leaf_nodes.size(); i++) {
+  awake_before += radio.nodes[leaf_nodes[i]].mesh->getStats().awake_time;
+ }
+#endif
+ std::uniform_int_distribution<int> pick(collect ? 1 : 0, count - 1);
+ std::uniform_int_distribution<int> pick_leaf(0, std::max(0, (int)leaf_nodes.size() - 1));
+ uint32_t broadcast_frames_before = 0;
+ std::vector<int> rebooted;
+ for (int i = 0; i < TARGETED_MESSAGES + BROADCAST_MESSAGES; i++) {
+  bool broadcast = i >= TARGETED_MESSAGES;
+  if (i == TARGETED_MESSAGES) {
+   broadcast_frames_before = radio.counters.frames;
+  }
+  if (reboot && i == TARGETED_MESSAGES / 2) {
+   for (int j = 0; j < count / CHURN_SHARE; j++) {
+    int victim;
+    do {
+     victim = pick_router(radio.rng);
+    } while (!alive[victim] || std::find(rebooted.begin(), rebooted.end(), victim) != rebooted.end());
+    rebooted.push_back(victim);
+    radio.as(victim, [&radio, victim]() {
+     radio.reboot(victim);
+    });
+    configure(victim);
+   }
+  }
+  sent_message record;
+  do {
+   record.source = pick(radio.rng);
+  } while (!alive[record.source]);
+  record.target = -1;
+  if (!broadcast && collect) {
+   record.target = 0;
+  }
+  while (!broadcast && (record.target < 0 || record.target == record.source || !alive[record.target])) {
+   record.target = pick(radio.rng);
+  }
+  // With leaves, every other targeted message comes from one, and the rest go to one.
+  if (!broadcast && !leaf_nodes.empty()) {
+   if (i % 2 == 0) {
+    record.source = leaf_nodes[pick_leaf(radio.rng)];
+   }
+   else if (!collect) {
+    record.target = leaf_nodes[pick_leaf(radio.rng)];
+   }
+  }
+  if (!broadcast && !rebooted.empty() && i % 2 == 0) {
+   record.source = rebooted[std::uniform_int_distribution<int>(0, rebooted.size() - 1)(radio.rng)];
+   while (record.target == record.source || !alive[record.target]) {
+    record.target = pick(radio.rng);
+   }
+  }
+  record.sent_at = radio.now;
+  record.delivered_at = 0;
+  record.delivered = false;
+  record.reached.assign(radio.nodes.size(), false);
+  sent.push_back(record);
+  bench_payload payload;
+  memset(&payload, 0, sizeof(payload));
+  payload.magic = PAYLOAD_MAGIC;
+  payload.sequence = i;
+  radio.as(record.source, [&radio, &record, &payload, collect]() {
+   NowMesh* mesh = radio.nodes[record.source].mesh;
+   const uint8_t* data = reinterpret_cast<const uint8_t*>(&payload);
+   if (record.target < 0) {
+    mesh->send(data, sizeof(payload));
+   }
+#if NOWMESH_COLLECTION
+   else if (collect) {
+    mesh->sendToGateway(data, sizeof(payload));
+   }
+#endif
+   else {
+    mesh->send(data, sizeof(payload), radio.nodes[record.target].mac);
+   }
+  });
+  radio.run(broadcast ? BROADCAST_INTERVAL : TARGETED_INTERVAL);
+ }
+ radio.run(DRAIN_TIME);
+#if NOWMESH_TRACE
+ if (trace_file != NULL) {
+  readTraces();
+  fclose(trace_file);
+ }
+#endif
+
+ bench_result result;
+ std::vector<double> latencies;
+ int reached = 0;
+ for (size_t i = 0; i < sent.size(); i++) {
+  if (sent[i].target < 0) {
+   for (int node = 0; node < count; node++) {
+    reached += alive[node] && sent[i].reached[node];
+   }
+  }
+  else if (sent[i].delivered) {
+   latencies.push_back((sent[i].delivered_at - sent[i].sent_at) / 1000.0);
+  }
+ }
+ std::sort(latencies.begin(), latencies.end());
+ result.delivery = (double)latencies.size() / TARGETED_MESSAGES;
+ result.p50 = latencies.empty() ? 0 : latencies[latencies.size() / 2];
+ result.p99 = latencies.empty() ? 0 : latencies[std::min(latencies.size() - 1, latencies.size() * 99 / 100)];
+ result.reach = (double)reached / (BROADCAST_MESSAGES * (live - 1));
+ result.duplicates = (double)duplicates / (TARGETED_MESSAGES + BROADCAST_MESSAGES);
+ result.frames = latencies.empty() ? 0 : (double)(broadcast_frames_before - frames_before) / latencies.size();
+ result.broadcast_frames = (double)(radio.counters.frames - broadcast_frames_before) / BROADCAST_MESSAGES;
+ result.leaf_awake = 0;
+ result.leaf_awake_per_message = 0;
+#if NOWMESH_STATS
+ if (!leaf_nodes.empty()) {
+  uint64_t awake = 0;
+  for (size_t i = 0; i < leaf_nodes.size(); i++) {
+   awake += radio.nodes[leaf_nodes[i]].mesh->getStats().awake_time;
+  }
+  awake -= awake_before;
+  int from_leaves = 0;
+  for (size_t i = 0; i < sent.size(); i++) {
+   if (sent[i].target >= 0 && sent[i].delivered && sent[i].source >= count) {
+    from_leaves++;
+   }
+  }
+  result.leaf_awake = (double)awake / (leaf_nodes.size() * (radio.now - traffic_started) / 1000.0);
+  result.leaf_awake_per_message = from_leaves == 0 ? 0 : (double)awake / from_leaves;
+ }
+#endif
+ return result;
+}
+
+int main(int argc, char** argv) {
+ std::vector<std::string> topologies;
+ std::vector<int> sizes;
+ unsigned int seed = 1;
+ bool collect = false;
+ bool split_channels = false;
+ bool auth = false;
+ bool leaves = false;
+ bool churn = false;
+ bool reboot = false;
+ const char* trace_path = NULL;
+ int flood_mode = 0;
+ int flood_parameter = 0;
+ for (int i = 1; i < argc; i++) {
+  std::string arg = argv[i];
+  if (arg == "--seed" && i + 1 < argc) {
+   seed = atoi(argv[++i]);
+  }
+  else if ((arg == "--gossip" || arg == "--counter") && i + 1 < argc) {
+   flood_mode = arg == "--gossip" ? 1 : 2;
+   flood_parameter = atoi(argv[++i]);
+  }
+  else if (arg == "--split") {
+   split_channels = true;
+  }
+  else if (arg == "--auth") {
+   auth = true;
+  }
+  else if (arg == "--leaves") {
+   leaves = true;
+  }
+  else if (arg == "--churn") {
+   churn = true;
+  }
+  else if (arg == "--reboot") {
+   reboot = true;
+  }
+  else if (arg == "--trace" && i + 1 < argc) {
+   trace_path = argv[++i];
+#if !NOWMESH_TRACE
+   fprintf(stderr, "--trace needs a build with tracing in, make bench-trace\n");
+   return 1;
+#endif
+  }
+  else if (arg == "--collect") {
+   collect = true;
+  }
+  else if (arg == "grid" || arg == "line" || arg == "random") {
+   topologies.push_back(arg);
+  }
+  else if (atoi(arg.c_str()) > 1) {
+   sizes.push_back(atoi(arg.c_str()));
+  }
+  else {
+   fprintf(stderr, "Usage: %s [grid|line|random] [nodes...] [--seed n] [--collect] [--gossip p | --counter k] [--split] [--auth] [--leaves] [--churn] [--reboot] [--trace file]\n", argv[0]);
+   return 1;
+  }
+ }
+ if (topologies.empty()) {
+  topologies = {"grid", "line", "random"};
+ }
+ if (sizes.empty()) {
+  sizes = {10, 50, 100, 200};
+ }
+ // Build with -DNOWMESH_FRAGMENTATION=0 and the like to see what leaving features out saves.
+ printf("Each node's NowMesh takes %u bytes\n", (unsigned)sizeof(NowMesh));
+#if NOWMESH_AUTH
+ if (auth) {
+  printf("Tagging a frame takes %.0f ns at 32 bytes and %.0f ns at %u bytes on this host\n", tagTime(32), tagTime(MAX_MSG_LEN), (unsigned)MAX_MSG_LEN);
+ }
+#endif
+ printf("%-8s %6s %9s %9s %9s %7s %8s %8s %9s\n", "topology", "nodes", "delivery", "p50 ms", "p99 ms", "reach", "dup rx", "frames", "bc frames");
+ for (size_t t = 0; t < topologies.size(); t++) {
+  for (size_t s = 0; s < sizes.size(); s++) {
+   bench_result result = runBench(topologies[t], sizes[s], seed, collect, flood_mode, flood_parameter, split_channels, auth, leaves, churn, reboot, trace_path);
+   printf("%-8s %6d %8.1f%% %9.1f %9.1f %6.1f%% %8.1f %8.1f %9.1f\n", topologies[t].c_str(), sizes[s], result.delivery * 100, result.p50, result.p99, result.reach * 100, result.duplicates, result.frames, result.broadcast_frames);
+   if (leaves) {
+    printf("%15s leaves awake %.1f%% of the time, %.1f ms per message delivered from one\n", "", result.leaf_awake * 100, result.leaf_awake_per_message);
+   }
+   fflush(stdout);
+  }
+ }
+ return 0;
+}
@@ -0,0 +1,868 @@
+// Check NowMesh features on the simulated radio.
+// Where the benchmark measures, these pass or fail. Each scenario sets up a small mesh, exercises one
+//  feature and checks what came out the far end, and prints a line saying what it saw.
+// The exit status is the number of scenarios that failed, so make check fails when one does.
+// Usage: scenarios [scenario...]
+
+#include <map>
+#include <string>
+#include <unistd.h>
+#include "Radio.h"
+
+// Milliseconds nodes get to find each other before a scenario starts.
+#define WARMUP_TIME 20000
+// Milliseconds left for the last messages to arrive.
+#define DRAIN_TIME 5000
+#define PAYLOAD_MAGIC 0x4e4d4348
+// Grid spacing, as a share of the radio's range, the same as the benchmark's.
+#define GRID_SPACING 0.6
+
+// Messages carry a magic number, their sequence and a pattern derived from it, so a receiver can tell
+//  a message arrived whole.
+struct check_header {
+ uint32_t magic;
+ uint32_t sequence;
+};
+
+// How many times each node got each message.
+struct check_tally {
+ std::vector<std::vector<int>> received;
+ // Messages that were the right length but had the wrong bytes in them.
+ int corrupt = 0;
+};
+
+struct check_receiver {
+ check_tally* tally;
+ int node;
+};
+
+static void fillPayload(uint8_t* data, size_t len, uint32_t sequence) {
+ check_header header = {PAYLOAD_MAGIC, sequence};
+ memcpy(data, &header, sizeof(header));
+ for (size_t i = sizeof(header); i < len; i++) {
+  data[i] = (uint8_t)(sequence * 31 + i);
+ }
+}
+
+static void messageReceived(void* context, const mesh_message& message) {
+ check_receiver* receiver = static_cast<check_receiver*>(context);
+ check_header header;
+ if (message.len < sizeof(header)) {
+  return;
+ }
+ memcpy(&header, message.data, sizeof(header));
+ if (header.magic != PAYLOAD_MAGIC || header.sequence >= receiver->tally->received.size()) {
+  return;
+ }
+ for (size_t i = sizeof(header); i < message.len; i++) {
+  if (message.data[i] != (uint8_t)(header.sequence * 31 + i)) {
+   receiver->tally->corrupt++;
+   return;
+  }
+ }
+ receiver->tally->received[header.sequence][receiver->node]++;
+}
+
+// Have every node count what it receives into tally.
+static void countReceived(Radio& radio, check_tally& tally, std::vector<check_receiver>& receivers) {
+ receivers.resize(radio.nodes.size());
+ for (size_t i = 0; i < radio.nodes.size(); i++) {
+  receivers[i].tally = &tally;
+  receivers[i].node = i;
+  radio.nodes[i].mesh->setMessageHandler(messageReceived, &receivers[i]);
+ }
+}
+
+// A side by side grid of nodes, GRID_SPACING of the range apart, each counting what it receives into tally.
+static void placeGrid(Radio& radio, int side, check_tally& tally, std::vector<check_receiver>& receivers) {
+ double spacing = radio.config.range * GRID_SPACING;
+ for (int i = 0; i < side * side; i++) {
+  radio.addNode((i % side) * spacing, (i / side) * spacing);
+ }
+ countReceived(radio, tally, receivers);
+}
+
+// Send message sequence from source, to target or as a broadcast if target is -1, in a priority class.
+// A reliable one goes with sendReliable, which needs a target.
+// Returns the handle send gave, whose id is 0 if it was refused. The sequence is used up either way.
+static mesh_handle sendPayload(Radio& radio, check_tally& tally, int source, int target, size_t len, uint8_t priority = PRIORITY_NORMAL, bool reliable = false) {
+ uint32_t sequence = tally.received.size();
+ tally.received.push_back(std::vector<int>(radio.nodes.size(), 0));
+ std::vector<uint8_t> data(len);
+ fillPayload(data.data(), len, sequence);
+ mesh_handle handle = {};
+ radio.as(source, [&]() {
+  NowMesh* mesh = radio.nodes[source].mesh;
+#if NOWMESH_RELIABLE
+  if (reliable) {
+   handle = mesh->sendReliable(data.data(), len, radio.nodes[target].mac, DEFAULT_MAX_HOPS, priority);
+   return;
+  }
+#else
+  (void)reliable;
+#endif
+  handle = target < 0 ? mesh->send(data.data(), len, NULL, DEFAULT_MAX_HOPS, priority) : mesh->send(data.data(), len, radio.nodes[target].mac, DEFAULT_MAX_HOPS, priority);
+ });
+ return handle;
+}
+
+#if NOWMESH_AGGREGATION
+// Bursts of small messages, targeted and flooded, with aggregation on at every node.
+// Messages have to come out of the aggregates whole and only once, broadcasts have to reach every
+//  other node, and it has to take fewer frames than the same traffic with aggregation off.
+// send() is best effort, so a targeted message may be lost now and then, but no more than
+//  AGGREGATION_MIN_DELIVERY of them. sendReliable is checked on its own.
+#define AGGREGATION_BURSTS 10
+#define AGGREGATION_BURST_LEN 8
+#define AGGREGATION_WINDOW 20
+#define AGGREGATION_MIN_DELIVERY 0.98
+
+struct aggregation_result {
+ int targeted;
+ int targeted_delivered;
+ int targeted_twice;
+ int broadcasts;
+ int broadcasts_everywhere;
+ int corrupt;
+ uint32_t frames;
+ uint32_t aggregates;
+};
+
+static aggregation_result runAggregation(uint16_t window) {
+ radio_config config;
+ Radio radio(config);
+ check_tally tally;
+ std::vector<check_receiver> receivers;
+ placeGrid(radio, 3, tally, receivers);
+ for (size_t i = 0; i < radio.nodes.size(); i++) {
+  radio.nodes[i].mesh->setAggregation(window);
+ }
+ radio.run(WARMUP_TIME);
+ aggregation_result result = {};
+ radio.onReceive = [&result](int, const uint8_t* data, uint8_t len) {
+  if (len >= sizeof(mesh_header) && reinterpret_cast<const mesh_header*>(data)->type == MESSAGE_AGGREGATE) {
+   result.aggregates++;
+  }
+ };
+ // Aggregation is for traffic along routes, so let the targets be heard from first.
+ sendPayload(radio, tally, 8, 0, 12);
+ sendPayload(radio, tally, 2, 6, 12);
+ radio.run(1000);
+ uint32_t frames_before = radio.counters.frames;
+ std::vector<int> targets(tally.received.size(), -2);
+ for (int burst = 0; burst < AGGREGATION_BURSTS; burst++) {
+  // Corner to corner both ways, two hops each, and a broadcast from the middle. Corners 0 and 6
+  //  don't hear each other, so their bursts are kept apart.
+  for (int i = 0; i < AGGREGATION_BURST_LEN; i++) {
+   sendPayload(radio, tally, 0, 8, 12);
+   targets.push_back(8);
+  }
+  sendPayload(radio, tally, 4, -1, 12);
+  targets.push_back(-1);
+  radio.run(250);
+  for (int i = 0; i < AGGREGATION_BURST_LEN; i++) {
+   sendPayload(radio, tally, 6, 2, 12);
+   targets.push_back(2);
+  }
+  radio.run(250);
+ }
+ radio.run(DRAIN_TIME);
+ result.frames = radio.counters.frames - frames_before;
+ result.corrupt = tally.corrupt;
+ for (size_t i = 0; i < targets.size(); i++) {
+  if (targets[i] == -2) {
+   continue;
+  }
+  if (targets[i] >= 0) {
+   result.targeted++;
+   result.targeted_delivered += tally.received[i][targets[i]] >= 1;
+   result.targeted_twice += tally.received[i][targets[i]] > 1;
+  }
+  else {
+   result.broadcasts++;
+   bool everywhere = true;
+   for (int node = 0; node < (int)radio.nodes.size(); node++) {
+    everywhere &= node == 4 || tally.received[i][node] >= 1;
+   }
+   result.broadcasts_everywhere += everywhere;
+  }
+ }
+ return result;
+}
+
+static bool checkAggregation() {
+ aggregation_result off = runAggregation(0);
+ aggregation_result on = runAggregation(AGGREGATION_WINDOW);
+ bool passed = on.targeted_delivered >= on.targeted * AGGREGATION_MIN_DELIVERY && on.targeted_twice == 0 && on.broadcasts_everywhere == on.broadcasts && on.corrupt == 0 && on.aggregates > 0 && on.frames < off.frames;
+ printf("%-12s %s  %d/%d targeted delivered, %d twice, %d/%d broadcasts everywhere, %d corrupt, %u aggregates received, %u frames against %u without\n", "aggregation", passed ? "pass" : "FAIL", on.targeted_delivered, on.targeted, on.targeted_twice, on.broadcasts_everywhere, on.broadcasts, on.corrupt, on.aggregates, on.frames, off.frames);
+ return passed;
+}
+#endif
+
+#if NOWMESH_RELIABLE
+// Reliable messages corner to corner across a grid, with the radio's own retries off and more loss,
+//  so ACKs go missing and messages are sent again after they've arrived. Each has to be delivered
+//  at most once, and its delivery reported exactly once: delivered only if it arrived, undelivered
+//  only after ACK_MAX_ATTEMPTS attempts. Then the target is switched off, and every message sent to
+//  it has to be given up on.
+#define RELIABLE_MESSAGES 40
+#define RELIABLE_UNREACHABLE 4
+// Milliseconds between sends, and to wait for the last message to be given up on.
+#define RELIABLE_INTERVAL 500
+#define RELIABLE_DRAIN_TIME 10000
+
+struct reliable_report {
+ int reports = 0;
+ bool delivered = false;
+ uint8_t attempts = 0;
+};
+
+struct reliable_run {
+ Radio* radio;
+ check_tally* tally;
+ std::map<uint16_t, uint32_t> sequences;
+ std::vector<reliable_report> reports;
+ // Per sequence, which attempts reached the target.
+ std::vector<uint16_t> attempts_heard;
+ // Messages reported on at least once, and sequences send refused.
+ int reported = 0;
+ int refused = 0;
+};
+
+// Send count messages one by one from source to target, with sendReliable.
+// A message waits for one of the PENDING_ACKS before it to be reported, rather than be refused,
+//  but not forever, in case reports never come.
+static void sendReliably(reliable_run& run, int source, int target, int count) {
+ for (int i = 0; i < count; i++) {
+  for (uint32_t waited = 0; (int)run.sequences.size() - run.reported >= PENDING_ACKS && waited < RELIABLE_DRAIN_TIME; waited += RELIABLE_INTERVAL) {
+   run.radio->run(RELIABLE_INTERVAL);
+  }
+  uint32_t sequence = run.tally->received.size();
+  mesh_handle handle = sendPayload(*run.radio, *run.tally, source, target, 12, PRIORITY_NORMAL, true);
+  run.reports.push_back(reliable_report());
+  run.attempts_heard.push_back(0);
+  if (handle.id == 0) {
+   run.refused++;
+  }
+  else {
+   run.sequences[handle.id] = sequence;
+  }
+  run.radio->run(RELIABLE_INTERVAL);
+ }
+}
+
+static bool checkReliable() {
+ radio_config config;
+ config.mac_retries = 0;
+ config.loss_near = 0.1;
+ config.loss_edge = 0.4;
+ Radio radio(config);
+ check_tally tally;
+ std::vector<check_receiver> receivers;
+ placeGrid(radio, 3, tally, receivers);
+ radio.run(WARMUP_TIME);
+ const int source = 0;
+ const int target = 8;
+ reliable_run run;
+ run.radio = &radio;
+ run.tally = &tally;
+ radio.nodes[source].mesh->setDeliveryCallback([&run](const mesh_handle& handle, bool delivered, uint32_t, uint8_t attempts) {
+  std::map<uint16_t, uint32_t>::iterator found = run.sequences.find(handle.id);
+  if (found == run.sequences.end()) {
+   return;
+  }
+  reliable_report& report = run.reports[found->second];
+  run.reported += report.reports == 0;
+  report.reports++;
+  report.delivered = delivered;
+  report.attempts = attempts;
+ });
+ radio.onReceive = [&](int node, const uint8_t* data, uint8_t len) {
+  if (node != target || len < sizeof(mesh_header) + sizeof(check_header)) {
+   return;
+  }
+  const mesh_header* header = reinterpret_cast<const mesh_header*>(data);
+  check_header payload;
+  memcpy(&payload, data + sizeof(mesh_header), sizeof(payload));
+  if (header->type == MESSAGE_TARGETED && (header->flags & FLAG_ACK_REQUEST) && payload.magic == PAYLOAD_MAGIC && payload.sequence < run.attempts_heard.size()) {
+   run.attempts_heard[payload.sequence] |= 1 << (header->flags >> FLAG_ATTEMPT_SHIFT);
+  }
+ };
+ sendReliably(run, source, target, RELIABLE_MESSAGES);
+ radio.run(RELIABLE_DRAIN_TIME);
+ uint32_t reachable = tally.received.size();
+ radio.switchOff(target);
+ sendReliably(run, source, target, RELIABLE_UNREACHABLE);
+ radio.run(RELIABLE_DRAIN_TIME);
+ int delivered = 0;
+ int reported_delivered = 0;
+ int twice = 0;
+ int unreported = 0;
+ int wrong = 0;
+ int resent_after_arriving = 0;
+ int given_up = 0;
+ for (uint32_t i = 0; i < tally.received.size(); i++) {
+  const reliable_report& report = run.reports[i];
+  int arrivals = tally.received[i][target];
+  delivered += arrivals >= 1;
+  twice += arrivals > 1;
+  unreported += report.reports != 1;
+  reported_delivered += report.delivered;
+  // Delivered means it arrived. Undelivered means every attempt was used up.
+  wrong += report.reports == 1 && (report.delivered ? arrivals == 0 : report.attempts != ACK_MAX_ATTEMPTS);
+  // Copies of more than one attempt, so one came after the message had been delivered.
+  resent_after_arriving += (run.attempts_heard[i] & (run.attempts_heard[i] - 1)) != 0;
+  given_up += i >= reachable && report.reports == 1 && !report.delivered;
+ }
+ bool passed = run.refused == 0 && twice == 0 && unreported == 0 && wrong == 0 && tally.corrupt == 0 && resent_after_arriving > 0 && given_up == RELIABLE_UNREACHABLE;
+ printf("%-12s %s  %d/%d delivered, %d reported so, %d twice, %d resent after arriving, %d/%d given up on unreachable, %d unreported or twice reported, %d wrongly reported, %d refused\n", "reliable", passed ? "pass" : "FAIL", delivered, RELIABLE_MESSAGES, reported_delivered, twice, resent_after_arriving, given_up, RELIABLE_UNREACHABLE, unreported, wrong, run.refused);
+ return passed;
+}
+#endif
+
+#if NOWMESH_FRAGMENTATION
+// Broadcasts too long for one frame, from a corner and from the middle of a grid, one at a time.
+// Every fragment is flooded, so one lost anywhere loses the message there, and the fragments have
+//  to be spaced out for the floods not to trip over each other. Floods are best effort, so a node
+//  may miss a message now and then, but no more than FRAGMENTS_MIN_DELIVERY of them all.
+#define FRAGMENTS_SIDE 4
+#define FRAGMENTS_MIN_DELIVERY 0.85
+// Milliseconds for a message to go out in fragments and reach everyone.
+#define FRAGMENTS_TIME 10000
+
+static bool checkFragments() {
+ static const size_t lengths[] = {1000, 2000, MAX_FRAGMENTED_LEN};
+ static const int sources[] = {0, FRAGMENTS_SIDE + 1};
+ radio_config config;
+ Radio radio(config);
+ check_tally tally;
+ std::vector<check_receiver> receivers;
+ placeGrid(radio, FRAGMENTS_SIDE, tally, receivers);
+ radio.run(WARMUP_TIME);
+ std::vector<int> origins;
+ int refused = 0;
+ for (int source : sources) {
+  for (size_t len : lengths) {
+   refused += sendPayload(radio, tally, source, -1, len).id == 0;
+   origins.push_back(source);
+   radio.run(FRAGMENTS_TIME);
+  }
+ }
+ int expected = 0;
+ int delivered = 0;
+ int twice = 0;
+ for (size_t i = 0; i < origins.size(); i++) {
+  for (int node = 0; node < (int)radio.nodes.size(); node++) {
+   if (node == origins[i]) {
+    continue;
+   }
+   expected++;
+   delivered += tally.received[i][node] >= 1;
+   twice += tally.received[i][node] > 1;
+  }
+ }
+ bool passed = refused == 0 && delivered >= expected * FRAGMENTS_MIN_DELIVERY && twice == 0 && tally.corrupt == 0;
+ printf("%-12s %s  %d/%d deliveries of %d messages, %d refused, %d twice, %d corrupt\n", "fragments", passed ? "pass" : "FAIL", delivered, expected, (int)origins.size(), refused, twice, tally.corrupt);
+ return passed;
+}
+#endif
+
+// A node sending more than the air can take, to a neighbor. First it queues more bulk frames than
+//  fit every step, and a high priority one. Full queues drop bulk frames, and the high priority
+//  ones all have to get out. Then it keeps high priority frames queued all the time, sending a new
+//  one whenever one goes, and bulk frames still have to get at least half the share
+//  TX_STARVATION_LIMIT promises them.
+#define PRIORITY_STEPS 100
+// Milliseconds between steps.
+#define PRIORITY_STEP_TIME 20
+#define PRIORITY_LEN 200
+// High priority frames kept queued in the second half.
+#define PRIORITY_BACKLOG 2
+
+struct priority_run {
+ Radio* radio;
+ check_tally* tally;
+ // The class of each sequence, and how the source reported on it, -1 for not yet.
+ std::vector<uint8_t> classes;
+ std::vector<int> statuses;
+ std::map<uint16_t, uint32_t> sequences;
+ // Whether a high priority frame is sent whenever one goes.
+ bool chaining = false;
+ int refused = 0;
+};
+
+static void sendPriority(priority_run& run, uint8_t priority) {
+ uint32_t sequence = run.tally->received.size();
+ mesh_handle handle = sendPayload(*run.radio, *run.tally, 0, 1, PRIORITY_LEN, priority);
+ run.classes.push_back(priority);
+ run.statuses.push_back(-1);
+ if (handle.id == 0) {
+  run.refused += priority == PRIORITY_HIGH;
+ }
+ else {
+  run.sequences[handle.id] = sequence;
+ }
+}
+
+static void prioritySent(void* context, const mesh_handle& handle, int status) {
+ priority_run& run = *static_cast<priority_run*>(context);
+ std::map<uint16_t, uint32_t>::iterator found = run.sequences.find(handle.id);
+ if (found == run.sequences.end()) {
+  return;
+ }
+ run.statuses[found->second] = status;
+ if (run.chaining && run.classes[found->second] == PRIORITY_HIGH) {
+  sendPriority(run, PRIORITY_HIGH);
+ }
+}
+
+static bool checkPriority() {
+ radio_config config;
+ Radio radio(config);
+ check_tally tally;
+ std::vector<check_receiver> receivers;
+ placeGrid(radio, 2, tally, receivers);
+ radio.run(WARMUP_TIME);
+ // Let the target be heard from, so frames go straight to it rather than to every peer.
+ sendPayload(radio, tally, 1, 0, 12);
+ radio.run(1000);
+ priority_run run;
+ run.radio = &radio;
+ run.tally = &tally;
+ run.classes.assign(tally.received.size(), PRIORITY_NORMAL);
+ run.statuses.assign(tally.received.size(), SEND_STATUS_OK);
+ radio.nodes[0].mesh->setSendStatusHandler(prioritySent, &run);
+ for (int step = 0; step < PRIORITY_STEPS; step++) {
+  for (int i = 0; i < TX_QUEUE_LEN; i++) {
+   sendPriority(run, PRIORITY_BULK);
+  }
+  sendPriority(run, PRIORITY_HIGH);
+  radio.run(PRIORITY_STEP_TIME);
+ }
+ radio.run(DRAIN_TIME);
+ uint32_t starving_from = tally.received.size();
+ run.chaining = true;
+ for (int i = 0; i < PRIORITY_BACKLOG; i++) {
+  sendPriority(run, PRIORITY_HIGH);
+ }
+ for (int step = 0; step < PRIORITY_STEPS; step++) {
+  sendPriority(run, PRIORITY_BULK);
+  radio.run(PRIORITY_STEP_TIME);
+ }
+ // Bulk frames still queued go once the high priority ones stop, so count what got out before.
+ int starving_bulk_delivered = 0;
+ for (uint32_t i = starving_from; i < tally.received.size(); i++) {
+  starving_bulk_delivered += run.classes[i] == PRIORITY_BULK && tally.received[i][1] >= 1;
+ }
+ run.chaining = false;
+ radio.run(DRAIN_TIME);
+ int high = 0;
+ int high_delivered = 0;
+ int high_dropped = 0;
+ int bulk_dropped = 0;
+ int dropped = 0;
+ int starving_bulk = 0;
+ int starving_high = 0;
+ for (uint32_t i = 0; i < tally.received.size(); i++) {
+  dropped += run.statuses[i] == SEND_STATUS_DROPPED;
+  if (run.classes[i] == PRIORITY_HIGH) {
+   high++;
+   high_delivered += tally.received[i][1] >= 1;
+   high_dropped += run.statuses[i] == SEND_STATUS_DROPPED;
+   starving_high += i >= starving_from;
+  }
+  else if (run.classes[i] == PRIORITY_BULK) {
+   bulk_dropped += run.statuses[i] == SEND_STATUS_DROPPED;
+   starving_bulk += i >= starving_from;
+  }
+ }
+ bool passed = run.refused == 0 && high_delivered == high && high_dropped == 0 && bulk_dropped > 0 && starving_bulk_delivered * TX_STARVATION_LIMIT * 2 >= starving_high && tally.corrupt == 0;
+ printf("%-12s %s  %d/%d high priority delivered, %d dropped, %d refused, %d bulk dropped of %d frames dropped, %d/%d bulk delivered behind %d high priority\n", "priority", passed ? "pass" : "FAIL", high_delivered, high, high_dropped, run.refused, bulk_dropped, dropped, starving_bulk_delivered, starving_bulk, starving_high);
+ return passed;
+}
+
+#if NOWMESH_REROUTE
+// A source with two ways to a target out of its range, through the neighbor above and the one below.
+// The next hop its route picked goes off, and the SDK's first LINK_FAILURES reports of frames to it
+//  come only after TX_TIMEOUT, each by which time a message for the other neighbor is in flight.
+//  Those reports must count against the dead neighbor alone, not fail the frame the other one got.
+//  Then, after at most LINK_FAILURES frames that fail to the dead one, every message has to go round
+//  it through the other, once, as a routed frame rather than a flood.
+#define REROUTE_MESSAGES 10
+#define REROUTE_LEARNING 3
+// Each neighbor's distance along and off the source's line to the target, as a share of the range.
+#define REROUTE_ALONG 0.6
+#define REROUTE_OFF 0.4
+
+// The send statuses each message a node originated was reported with, by id. Reports for messages
+//  it passed on for others are left out.
+struct status_log {
+ const uint8_t* originator;
+ std::map<uint16_t, std::vector<int>> statuses;
+};
+
+static void statusReported(void* context, const mesh_handle& handle, int status) {
+ status_log& log = *static_cast<status_log*>(context);
+ if (memcmp(handle.originator, log.originator, 6) == 0) {
+  log.statuses[handle.id].push_back(status);
+ }
+}
+
+static bool checkReroute() {
+ radio_config config;
+ Radio radio(config);
+ check_tally tally;
+ std::vector<check_receiver> receivers;
+ const int source = 0;
+ const int target = 3;
+ double along = radio.config.range * REROUTE_ALONG;
+ double off = radio.config.range * REROUTE_OFF;
+ radio.addNode(0, 0);
+ radio.addNode(along, off);
+ radio.addNode(along, -off);
+ radio.addNode(2 * along, 0);
+ countReceived(radio, tally, receivers);
+ status_log log;
+ log.originator = radio.nodes[source].mac;
+ radio.nodes[source].mesh->setSendStatusHandler(statusReported, &log);
+ radio.run(WARMUP_TIME);
+ // The source's targeted frames, by the node each went to, or -1 for a flood, and how many each
+ //  message went out in.
+ std::vector<int> sends;
+ std::map<uint16_t, int> frames;
+ radio.onSend = [&radio, &sends, &frames](int node, const uint8_t* dest, const uint8_t* data, int len) {
+  mesh_header header;
+  if (node != source || len < (int)sizeof(header)) {
+   return;
+  }
+  memcpy(&header, data, sizeof(header));
+  if (header.type == MESSAGE_TARGETED && memcmp(header.originator, radio.nodes[source].mac, 6) == 0) {
+   sends.push_back(dest == NULL ? -1 : radio.findNode(dest));
+   frames[header.id]++;
+  }
+ };
+ // Broadcasts from the target give the source a route through either neighbor, and the other as
+ //  its alternate, and the neighbors their own routes straight to it. A few, so one lost frame
+ //  doesn't leave a node with only a roundabout route. The first message shows which is which.
+ for (int i = 0; i < REROUTE_LEARNING; i++) {
+  sendPayload(radio, tally, target, -1, 12);
+  radio.run(1000);
+ }
+ sendPayload(radio, tally, source, target, 12);
+ radio.run(1000);
+ if (sends.empty() || sends.back() < 0) {
+  printf("%-12s FAIL  no route to the target\n", "reroute");
+  return false;
+ }
+ int failing = sends.back();
+ int alternate = failing == 1 ? 2 : 1;
+ int held = 0;
+ radio.reportDelay = [&radio, &held, failing](int node, const uint8_t* dest, uint8_t status) -> uint32_t {
+  if (node != source || status == 0 || held >= LINK_FAILURES || radio.findNode(dest) != failing) {
+   return 0;
+  }
+  held++;
+  return TX_TIMEOUT * 2000;
+ };
+ // With a neighbor gone, the others have too few and would scan, deaf for a while, which isn't
+ //  what this checks.
+ for (size_t i = 0; i < radio.nodes.size(); i++) {
+  radio.nodes[i].mesh->setDiscovery(false);
+ }
+ radio.switchOff(failing);
+ size_t first = sends.size();
+ std::vector<uint16_t> given_up;
+ std::vector<uint32_t> neighbor_messages;
+ std::vector<uint16_t> neighbor_ids;
+ for (int i = 0; i < LINK_FAILURES; i++) {
+  // This one goes to the dead neighbor, and is given up on before its report comes.
+  given_up.push_back(sendPayload(radio, tally, source, target, 12).id);
+  radio.run(TX_TIMEOUT * 3 / 2);
+  neighbor_messages.push_back(tally.received.size());
+  neighbor_ids.push_back(sendPayload(radio, tally, source, alternate, 12).id);
+  radio.run(1000);
+ }
+ std::vector<uint16_t> ids;
+ uint32_t rerouted_from = tally.received.size();
+ for (int i = 0; i < REROUTE_MESSAGES; i++) {
+  ids.push_back(sendPayload(radio, tally, source, target, 12).id);
+  radio.run(500);
+ }
+ radio.run(DRAIN_TIME);
+ int delivered = 0;
+ int twice = 0;
+ // Messages that went round the dead next hop have to be reported sent, once.
+ int reported_ok = 0;
+ for (int i = 0; i < REROUTE_MESSAGES; i++) {
+  delivered += tally.received[rerouted_from + i][target] >= 1;
+  twice += tally.received[rerouted_from + i][target] > 1;
+  reported_ok += log.statuses[ids[i]] == std::vector<int>(1, SEND_STATUS_OK);
+ }
+ // The late reports are the dead neighbor's. Taken for the frame to the other neighbor, they'd have
+ //  it fail, and go out again.
+ int given_up_reported = 0;
+ int neighbor_reported = 0;
+ int neighbor_delivered = 0;
+ for (int i = 0; i < LINK_FAILURES; i++) {
+  given_up_reported += log.statuses[given_up[i]] == std::vector<int>(1, SEND_STATUS_FAIL);
+  neighbor_reported += log.statuses[neighbor_ids[i]] == std::vector<int>(1, SEND_STATUS_OK) && frames[neighbor_ids[i]] == 1;
+  neighbor_delivered += tally.received[neighbor_messages[i]][alternate] == 1;
+ }
+ // The messages given up on, and at most LINK_FAILURES before the link is.
+ int to_failing = 0;
+ int flooded = 0;
+ // Once the link is given up on, every message is sent straight to the other neighbor.
+ int last_to_alternate = 0;
+ for (size_t i = first; i < sends.size(); i++) {
+  to_failing += sends[i] == failing;
+  flooded += sends[i] < 0;
+  last_to_alternate = sends[i] == alternate ? last_to_alternate + 1 : 0;
+ }
+ bool passed = held == LINK_FAILURES && given_up_reported == LINK_FAILURES && neighbor_reported == LINK_FAILURES && neighbor_delivered == LINK_FAILURES && delivered == REROUTE_MESSAGES && twice == 0 && reported_ok == REROUTE_MESSAGES && to_failing <= 2 * LINK_FAILURES && flooded == 0 && last_to_alternate >= REROUTE_MESSAGES - LINK_FAILURES && tally.corrupt == 0;
+ printf("%-12s %s  %d/%d delivered around the dead next hop, %d twice, %d reported sent, %d sent to it, %d flooded, %d in a row to the other, %d/%d reports held back, %d/%d messages for the other delivered once and %d sent once, %d given up on reported failed\n", "reroute", passed ? "pass" : "FAIL", delivered, REROUTE_MESSAGES, twice, reported_ok, to_failing, flooded, last_to_alternate, held, LINK_FAILURES, neighbor_delivered, LINK_FAILURES, neighbor_reported, given_up_reported);
+ return passed;
+}
+#endif
+
+#if NOWMESH_ROUTE_DISCOVERY
+// A line of nodes, each only in range of the next, so the source has never heard from the far end.
+// Messages for it have to wait for a route, not be flooded, and each go out once when the reply
+//  comes, to be delivered once. Then, to a node past the end that has gone off, the messages wait
+//  through every route request, ROUTE_REQUEST_ATTEMPTS of them ROUTE_REQUEST_TIMEOUT apart, and are
+//  flooded once after that, so they still get as far as the mesh goes.
+#define DISCOVERY_LENGTH 5
+// Messages sent before the route turns up, so no more than ROUTE_PENDING_LEN.
+#define DISCOVERY_MESSAGES 3
+
+static bool checkDiscovery() {
+ radio_config config;
+ // Frames are lost to collisions alone, so what doesn't arrive was held or dropped by the mesh.
+ config.loss_near = 0;
+ config.loss_edge = 0;
+ Radio radio(config);
+ check_tally tally;
+ std::vector<check_receiver> receivers;
+ double spacing = radio.config.range * GRID_SPACING;
+ for (int i = 0; i <= DISCOVERY_LENGTH; i++) {
+  radio.addNode(i * spacing, 0);
+ }
+ countReceived(radio, tally, receivers);
+ const int source = 0;
+ const int target = DISCOVERY_LENGTH - 1;
+ const int gone = DISCOVERY_LENGTH;
+ radio.run(WARMUP_TIME);
+ radio.switchOff(gone);
+ // What the source sent: route requests, and its targeted messages, by id, with when each first went
+ //  out and how many times as a flood and straight to a neighbor.
+ struct discovery_sends {
+  int requests = 0;
+  std::map<uint16_t, uint64_t> first_at;
+  std::map<uint16_t, int> flooded;
+  std::map<uint16_t, int> routed;
+ } sent;
+ radio.onSend = [&radio, &sent](int node, const uint8_t* dest, const uint8_t* data, int len) {
+  mesh_header header;
+  if (node != source || len < (int)sizeof(header)) {
+   return;
+  }
+  memcpy(&header, data, sizeof(header));
+  if (memcmp(header.originator, radio.nodes[source].mac, 6) != 0) {
+   return;
+  }
+  if (header.type == MESSAGE_ROUTE_REQUEST) {
+   sent.requests++;
+  }
+  if (header.type == MESSAGE_TARGETED) {
+   uint16_t id = header.id;
+   sent.first_at.insert(std::make_pair(id, radio.now));
+   (dest == NULL ? sent.flooded : sent.routed)[id]++;
+  }
+ };
+ // When the first route reply reached the source.
+ uint64_t replied_at = 0;
+ radio.onReceive = [&radio, &replied_at](int node, const uint8_t* data, uint8_t len) {
+  mesh_header header;
+  if (node == source && len >= sizeof(header) && replied_at == 0) {
+   memcpy(&header, data, sizeof(header));
+   if (header.type == MESSAGE_ROUTE_REPLY && memcmp(header.target, radio.nodes[source].mac, 6) == 0) {
+    replied_at = radio.now;
+   }
+  }
+ };
+ // Halfway between beacons, which all go out on the same ticks, so the first request isn't lost to them.
+ radio.run(BEACON_INTERVAL / 2);
+ std::vector<uint16_t> found_ids;
+ uint32_t found_from = tally.received.size();
+ for (int i = 0; i < DISCOVERY_MESSAGES; i++) {
+  found_ids.push_back(sendPayload(radio, tally, source, target, 12).id);
+ }
+ radio.run(DRAIN_TIME);
+ int found_delivered = 0;
+ int found_held = 0;
+ int found_flooded = 0;
+ for (int i = 0; i < DISCOVERY_MESSAGES; i++) {
+  found_delivered += tally.received[found_from + i][target] == 1;
+  found_held += replied_at > 0 && sent.first_at.count(found_ids[i]) > 0 && sent.first_at[found_ids[i]] > replied_at;
+  found_flooded += sent.flooded[found_ids[i]];
+ }
+ int found_requests = sent.requests;
+ radio.run(BEACON_INTERVAL / 2);
+ std::vector<uint16_t> lost_ids;
+ uint32_t lost_from = tally.received.size();
+ uint64_t lost_sent_at = radio.now;
+ for (int i = 0; i < DISCOVERY_MESSAGES; i++) {
+  lost_ids.push_back(sendPayload(radio, tally, source, gone, 12).id);
+ }
+ radio.run(DRAIN_TIME);
+ // Held through every request, then flooded once each. They go out back to back, and along a line a
+ //  node's rebroadcast can drown out the next frame for the one behind it, so only one of them has
+ //  to be seen to get as far as the mesh goes.
+ int lost_waited = 0;
+ int lost_flooded = 0;
+ int lost_reached = 0;
+ for (int i = 0; i < DISCOVERY_MESSAGES; i++) {
+  lost_waited += sent.first_at.count(lost_ids[i]) > 0 && sent.first_at[lost_ids[i]] - lost_sent_at >= (uint64_t)ROUTE_REQUEST_TIMEOUT * ROUTE_REQUEST_ATTEMPTS * 1000;
+  lost_flooded += sent.flooded[lost_ids[i]] == 1 && sent.routed[lost_ids[i]] == 0;
+  lost_reached += tally.received[lost_from + i][target] == 1;
+ }
+ int lost_requests = sent.requests - found_requests;
+ bool passed = found_requests >= 1 && found_requests <= ROUTE_REQUEST_ATTEMPTS && found_held == DISCOVERY_MESSAGES && found_flooded == 0 && found_delivered == DISCOVERY_MESSAGES && lost_requests == ROUTE_REQUEST_ATTEMPTS && lost_waited == DISCOVERY_MESSAGES && lost_flooded == DISCOVERY_MESSAGES && lost_reached >= 1 && tally.corrupt == 0;
+ printf("%-12s %s  %d request(s), %d/%d held for the reply, %d delivered once, %d flooded; for a node gone %d requests, %d/%d waited them out, %d flooded once, %d got to the end\n", "discovery", passed ? "pass" : "FAIL", found_requests, found_held, DISCOVERY_MESSAGES, found_delivered, found_flooded, lost_requests, lost_waited, DISCOVERY_MESSAGES, lost_flooded, lost_reached);
+ return passed;
+}
+#endif
+
+#if NOWMESH_TRACE
+// Traffic across a grid with tracing on, the events read out as a sketch would and put through
+//  extras/trace/nowmesh_trace.py. Simulated nodes have distinct station and softAP MACs, as on
+//  hardware, and clocks that disagree by seconds, so the decoder only lines them all up if it pairs
+//  events by the MACs frames really came from. Then hops take milliseconds, not seconds either way,
+//  and every delivered targeted message has its end to end time.
+// Needs a build with tracing in, make scenarios-trace.
+#ifndef TRACE_DECODER
+// Relative to extras/sim, where make check runs the scenarios.
+#define TRACE_DECODER "../trace/nowmesh_trace.py"
+#endif
+#define TRACE_SIDE 3
+#define TRACE_MESSAGES 20
+// Microseconds between reads of the nodes' trace buffers, the same as the benchmark's.
+#define TRACE_READ_INTERVAL 100000
+// Most milliseconds the median hop may take once clocks are lined up.
+#define TRACE_MAX_HOP_P50 20.0
+
+static bool checkTrace() {
+ radio_config config;
+ Radio radio(config);
+ check_tally tally;
+ std::vector<check_receiver> receivers;
+ placeGrid(radio, TRACE_SIDE, tally, receivers);
+ char path[] = "/tmp/nowmesh-traceXXXXXX";
+ int fd = mkstemp(path);
+ FILE* trace_file = fd >= 0 ? fdopen(fd, "wb") : NULL;
+ if (trace_file == NULL) {
+  printf("%-12s FAIL  couldn't create a trace file\n", "trace");
+  return false;
+ }
+ for (size_t i = 0; i < radio.nodes.size(); i++) {
+  radio.nodes[i].mesh->setTracing(true);
+ }
+ std::function<void()> readTraces = [&radio, trace_file, &readTraces]() {
+  uint8_t buffer[512];
+  for (size_t i = 0; i < radio.nodes.size(); i++) {
+   size_t len;
+   while ((len = radio.nodes[i].mesh->readTrace(buffer, sizeof(buffer))) > 0) {
+    fwrite(buffer, 1, len, trace_file);
+   }
+  }
+  radio.schedule(radio.now + TRACE_READ_INTERVAL, -1, readTraces);
+ };
+ radio.schedule(radio.now, -1, readTraces);
+ radio.run(WARMUP_TIME);
+ // Targeted both ways across the grid, and a broadcast from the middle now and then.
+ int last = TRACE_SIDE * TRACE_SIDE - 1;
+ std::vector<int> targets;
+ for (int i = 0; i < TRACE_MESSAGES; i++) {
+  int target = i % 2 == 0 ? last : 0;
+  sendPayload(radio, tally, last - target, target, 50);
+  targets.push_back(target);
+  if (i % 4 == 0) {
+   sendPayload(radio, tally, last / 2, -1, 50);
+   targets.push_back(-1);
+  }
+  radio.run(500);
+ }
+ radio.run(DRAIN_TIME);
+ fclose(trace_file);
+ int delivered = 0;
+ for (uint32_t i = 0; i < targets.size(); i++) {
+  delivered += targets[i] >= 0 && tally.received[i][targets[i]] >= 1;
+ }
+ std::string command = std::string("python3 " TRACE_DECODER " ") + path + " 2>&1";
+ FILE* decoder = popen(command.c_str(), "r");
+ int lined_up = -1;
+ int clocks = -1;
+ int left_out = 0;
+ int hops = 0;
+ int ends = 0;
+ double hop_p50 = 0;
+ char line[256];
+ while (decoder != NULL && fgets(line, sizeof(line), decoder) != NULL) {
+  // The reference clock's MAC has colons in it, so the counts are after the last one.
+  if (strncmp(line, "clocks lined up with ", 21) == 0) {
+   sscanf(strrchr(line, ':'), ": %d of %d", &lined_up, &clocks);
+  }
+  if (strstr(line, "events left out") != NULL) {
+   sscanf(line, "%d", &left_out);
+  }
+  sscanf(line, "hop %d samples p50 %lf", &hops, &hop_p50);
+  sscanf(line, "end %d samples", &ends);
+ }
+ int status = decoder != NULL ? pclose(decoder) : -1;
+ unlink(path);
+ bool passed = status == 0 && clocks == (int)radio.nodes.size() && lined_up == clocks && left_out == 0 && hops > 0 && hop_p50 >= 0 && hop_p50 <= TRACE_MAX_HOP_P50 && ends == delivered;
+ printf("%-12s %s  %d/%d clocks lined up, %d events left out, %d hops with p50 %.2f ms, %d/%d delivered messages timed end to end\n", "trace", passed ? "pass" : "FAIL", lined_up, clocks, left_out, hops, hop_p50, ends, delivered);
+ return passed;
+}
+#endif
+
+struct check_scenario {
+ const char* name;
+ bool (*run)();
+};
+
+static const check_scenario scenarios[] = {
+#if NOWMESH_AGGREGATION
+ {"aggregation", checkAggregation},
+#endif
+#if NOWMESH_RELIABLE
+ {"reliable", checkReliable},
+#endif
+#if NOWMESH_FRAGMENTATION
+ {"fragments", checkFragments},
+#endif
+ {"priority", checkPriority},
+#if NOWMESH_REROUTE
+ {"reroute", checkReroute},
+#endif
+#if NOWMESH_ROUTE_DISCOVERY
+ {"discovery", checkDiscovery},
+#endif
+#if NOWMESH_TRACE
+ {"trace", checkTrace},
+#endif
+};
+
+int main(int argc, char** argv) {
+ int failed = 0;
+ for (size_t i = 0; i < sizeof(scenarios) / sizeof(scenarios[0]); i++) {
+  bool wanted = argc == 1;
+  for (int arg = 1; arg < argc; arg++) {
+   wanted |= scenarios[i].name == std::string(argv[arg]);
+  }
+  if (wanted && !scenarios[i].run()) {
+   failed++;
+  }
+  fflush(stdout);
+ }
+ return failed;
+}
@@ -0,0 +1,68 @@
+#ifndef NOWMESH_SIM_ARDUINO_H
+#define NOWMESH_SIM_ARDUINO_H
+
+// Just enough of the Arduino core for NowMesh to build on a host.
+// Time comes from the simulated radio, see Radio.h.
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+
+#define ICACHE_FLASH_ATTR
+#define ICACHE_RAM_ATTR
+
+#define DEC 10
+#define HEX 16
+
+typedef uint8_t u8;
+typedef uint16_t u16;
+typedef uint32_t u32;
+typedef int8_t sint8;
+
+class String {
+ std::string value;
+public:
+ String() {}
+ String(const char* text) : value(text != NULL ? text : "") {}
+ const char* c_str() const {
+  return value.c_str();
+ }
+ unsigned int length() const {
+  return value.size();
+ }
+ String substring(unsigned int from, unsigned int to) const {
+  String result;
+  if (from < value.size()) {
+   result.value = value.substr(from, to - from);
+  }
+  return result;
+ }
+ bool operator==(const char* other) const {
+  return value == other;
+ }
+};
+
+struct SimSerial {
+ void begin(unsigned long) {}
+ void printf(const char* format, ...) {
+  va_list args;
+  va_start(args, format);
+  vprintf(format, args);
+  va_end(args);
+ }
+ void println() {
+  putchar('\n');
+ }
+};
+extern SimSerial Serial;
+
+uint32_t millis();
+uint32_t micros();
+long random(long max);
+long random(long min, long max);
+
+#endif
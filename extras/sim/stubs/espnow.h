@@ -0,0 +1,31 @@
+#ifndef NOWMESH_SIM_ESPNOW_H
+#define NOWMESH_SIM_ESPNOW_H
+
+// The parts of the ESP8266 SDK's ESP Now API NowMesh uses, backed by the simulated radio.
+// Every call acts on the node the radio is currently running, see Radio.h.
+
+#include <Arduino.h>
+
+enum esp_now_role {
+ ESP_NOW_ROLE_IDLE = 0,
+ ESP_NOW_ROLE_CONTROLLER,
+ ESP_NOW_ROLE_SLAVE,
+ ESP_NOW_ROLE_COMBO,
+ ESP_NOW_ROLE_MAX
+};
+
+typedef void (*esp_now_recv_cb_t)(u8* mac_addr, u8* data, u8 len);
+typedef void (*esp_now_send_cb_t)(u8* mac_addr, u8 status);
+
+int esp_now_init(void);
+int esp_now_register_send_cb(esp_now_send_cb_t cb);
+int esp_now_register_recv_cb(esp_now_recv_cb_t cb);
+int esp_now_set_self_role(u8 role);
+int esp_now_send(u8* da, u8* data, int len);
+int esp_now_add_peer(u8* mac_addr, u8 role, u8 channel, u8* key, u8 key_len);
+int esp_now_del_peer(u8* mac_addr);
+u8* esp_now_fetch_peer(bool restart);
+int esp_now_is_peer_exist(u8* mac_addr);
+int esp_now_get_cnt_info(u8* all_cnt, u8* encrypt_cnt);
+
+#endif
@@ -0,0 +1,63 @@
+#ifndef NOWMESH_SIM_USER_INTERFACE_H
+#define NOWMESH_SIM_USER_INTERFACE_H
+
+// The parts of the ESP8266 SDK's WiFi API NowMesh uses, backed by the simulated radio.
+
+#include <Arduino.h>
+
+typedef enum {
+ OK = 0,
+ FAIL,
+ PENDING,
+ BUSY,
+ CANCEL
+} STATUS;
+
+#define STAILQ_ENTRY(type) struct { struct type* stqe_next; }
+#define STAILQ_NEXT(elm, field) ((elm)->field.stqe_next)
+
+struct bss_info {
+ STAILQ_ENTRY(bss_info) next;
+ uint8_t bssid[6];
+ uint8_t ssid[32];
+ uint8_t ssid_len;
+ uint8_t channel;
+ sint8 rssi;
+};
+
+struct scan_config {
+ uint8_t* ssid;
+ uint8_t* bssid;
+ uint8_t channel;
+ uint8_t show_hidden;
+};
+
+typedef void (*scan_done_cb_t)(void* arg, STATUS status);
+
+bool wifi_station_scan(struct scan_config* config, scan_done_cb_t cb);
+// Each node has a station MAC and a different softAP one, as on the ESP8266. ESP Now frames go out
+//  from the softAP one, which is also the BSSID scans find.
+#define STATION_IF 0x00
+#define SOFTAP_IF 0x01
+bool wifi_get_macaddr(uint8_t if_index, uint8_t* macaddr);
+bool wifi_set_opmode(uint8_t opmode);
+bool wifi_set_channel(uint8_t channel);
+
+// RTC memory, in 4 byte blocks. It survives Radio::reboot.
+bool system_rtc_mem_write(uint8_t des_addr, const void* src_addr, uint16_t save_size);
+bool system_rtc_mem_read(uint8_t src_addr, void* des_addr, uint16_t save_size);
+
+// Forced sleep. The simulated radio hears and sends nothing from wifi_fpm_do_sleep to wifi_fpm_do_wakeup.
+enum sleep_type {
+ NONE_SLEEP_T = 0,
+ LIGHT_SLEEP_T,
+ MODEM_SLEEP_T
+};
+
+void wifi_fpm_set_sleep_type(enum sleep_type type);
+void wifi_fpm_open(void);
+void wifi_fpm_close(void);
+void wifi_fpm_do_wakeup(void);
+sint8 wifi_fpm_do_sleep(uint32_t sleep_time_in_us);
+
+#endif
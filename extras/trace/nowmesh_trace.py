@@ -0,0 +1,286 @@
+#!/usr/bin/env python3
+# Put NowMesh trace events from many nodes together, message by message.
+# Reads what NowMesh::readTrace gives, or a collector's trace callback gets, from files or stdin:
+#  runs of a trace_batch, see NowMesh.h, followed by its trace_event entries, see TraceBuffer.h.
+#  Bytes between batches, like a sketch's other Serial output, are skipped.
+# Every node stamps its events with its own micros(), so the clocks are lined up first. A frame sent
+#  from one node to another is reported sent at the first and received at the second at about the
+#  same time, so the smallest gap seen each way over a link gives the offset between their clocks.
+#  Offsets are chained out from the node with the most events. A node that rebooted starts a new clock.
+# Then for each message it prints, in milliseconds:
+#  hop    from the time a node had the message, received or originated, to the time the next one got it
+#  queue  the part of that before the SDK reported a frame with it sent
+#  end    from origination to delivery at the target, for targeted messages
+# Usage: nowmesh_trace.py [files...] [--messages n] [--message originator:id]
+
+import argparse
+import heapq
+import struct
+import sys
+
+TRACE_SYNC = 0x544e
+BATCH = struct.Struct("<H6s6sHB")
+EVENT = struct.Struct("<IBB6sHB6sB")
+
+TRACE_ORIGINATE = 1
+TRACE_RECEIVE = 2
+TRACE_DUPLICATE = 3
+TRACE_FORWARD = 4
+TRACE_SENT = 5
+TRACE_DELIVER = 6
+EVENT_NAMES = {
+ TRACE_ORIGINATE: "originate",
+ TRACE_RECEIVE: "receive",
+ TRACE_DUPLICATE: "duplicate",
+ TRACE_FORWARD: "forward",
+ TRACE_SENT: "sent",
+ TRACE_DELIVER: "deliver",
+}
+
+MESSAGE_BROADCAST = 1
+MESSAGE_TARGETED = 2
+TYPE_NAMES = {
+ 1: "broadcast",
+ 2: "targeted",
+ 5: "ack",
+ 6: "stats",
+ 10: "route request",
+ 11: "route reply",
+}
+
+BROADCAST_MAC = b"\xff" * 6
+NO_PEER = b"\x00" * 6
+SEND_SUCCESS = 0
+
+def macString(mac):
+ return ":".join("%02x" % b for b in mac)
+
+
+class Event:
+ __slots__ = ("clock", "node", "link", "time", "kind", "type", "originator", "id", "hops", "peer", "status")
+
+ def message(self):
+  return (self.type, self.originator, self.id)
+
+
+def readBatches(data):
+ # Yield (node, link, sequence, events) for every batch in data, finding batches by TRACE_SYNC.
+ pos = 0
+ while True:
+  pos = data.find(struct.pack("<H", TRACE_SYNC), pos)
+  if pos < 0 or pos + BATCH.size > len(data):
+   return
+  sync, node, link, sequence, count = BATCH.unpack_from(data, pos)
+  end = pos + BATCH.size + count * EVENT.size
+  if count == 0 or end > len(data):
+   pos += 1
+   continue
+  events = [EVENT.unpack_from(data, pos + BATCH.size + i * EVENT.size) for i in range(count)]
+  if any(entry[1] not in EVENT_NAMES for entry in events):
+   pos += 1
+   continue
+  yield node, link, sequence, events
+  pos = end
+
+
+def load(paths):
+ # Read every event, with times unwrapped and clocks numbered per node and boot.
+ # Batches from a collector can arrive out of order, so each boot's batches are put back in order
+ #  first. A sequence already seen means the node started counting again, so rebooted.
+ boots = {}
+ # Per node, its softAP MAC.
+ links = {}
+ # Per node, the last sequence of its current boot, unwrapped.
+ last_sequence = {}
+ for path in paths:
+  if path == "-":
+   data = sys.stdin.buffer.read()
+  else:
+   with open(path, "rb") as source:
+    data = source.read()
+  for node, link, sequence, batch in readBatches(data):
+   links[node] = link
+   # Each boot's batches, keyed by unwrapped sequence.
+   node_boots = boots.setdefault(node, [{}])
+   # The sequence is 16 bits, so take the nearest value to the last one.
+   unwrapped = sequence
+   if node in last_sequence:
+    unwrapped = last_sequence[node] + ((sequence - last_sequence[node] + 0x8000) & 0xffff) - 0x8000
+   if unwrapped in node_boots[-1] or unwrapped < 0:
+    node_boots.append({})
+    unwrapped = sequence
+   node_boots[-1][unwrapped] = batch
+   last_sequence[node] = unwrapped
+ events = []
+ for node, node_boots in boots.items():
+  for boot, batches in enumerate(node_boots):
+   base = 0
+   last = None
+   for sequence in sorted(batches):
+    for time, kind, message_type, originator, message_id, hops, peer, status in batches[sequence]:
+     # micros() wraps every 71 minutes.
+     if last is not None and time < last:
+      base += 1 << 32
+     last = time
+     event = Event()
+     event.clock = (node, boot)
+     event.node = node
+     event.link = links[node]
+     event.time = base + time
+     event.kind = kind
+     event.type = message_type
+     event.originator = originator
+     event.id = message_id
+     event.hops = hops
+     event.peer = peer
+     event.status = status
+     events.append(event)
+ return events
+
+
+def alignClocks(events):
+ # Returns each clock's offset from the reference clock, in microseconds, and the reference.
+ # Events name neighbors by softAP MAC, so send reports are indexed by the sender's, along with the
+ #  message and hops, oldest first.
+ sends = {}
+ for event in events:
+  if event.kind == TRACE_SENT:
+   sends.setdefault((event.link, event.message(), event.hops), []).append(event)
+ # Smallest receive time minus send time over each link, one way.
+ gaps = {}
+ for event in events:
+  if event.kind not in (TRACE_RECEIVE, TRACE_DUPLICATE):
+   continue
+  candidates = [sent for sent in sends.get((event.peer, event.message(), event.hops), []) if sent.peer in (event.link, BROADCAST_MAC)]
+  if not candidates:
+   continue
+  delivered = [sent for sent in candidates if sent.status == SEND_SUCCESS]
+  sent = (delivered or candidates)[0]
+  link = (sent.clock, event.clock)
+  gap = event.time - sent.time
+  if link not in gaps or gap < gaps[link]:
+   gaps[link] = gap
+ # Links seen both ways cancel the time a frame takes, so they're trusted first.
+ edges = {}
+ for (a, b), gap in gaps.items():
+  if (b, a) in gaps:
+   edges.setdefault(a, []).append((1, b, (gap - gaps[(b, a)]) / 2.0))
+  else:
+   edges.setdefault(a, []).append((10, b, gap))
+   edges.setdefault(b, []).append((10, a, -gap))
+ counts = {}
+ for event in events:
+  counts[event.clock] = counts.get(event.clock, 0) + 1
+ if not counts:
+  return {}, None
+ reference = max(counts, key=lambda clock: (counts[clock], clock))
+ offsets = {}
+ queue = [(0, 0, reference, 0.0)]
+ order = 0
+ while queue:
+  cost, _, clock, offset = heapq.heappop(queue)
+  if clock in offsets:
+   continue
+  offsets[clock] = offset
+  for weight, other, gap in edges.get(clock, []):
+   if other not in offsets:
+    order += 1
+    heapq.heappush(queue, (cost + weight, order, other, offset + gap))
+ return offsets, reference
+
+
+def percentile(values, share):
+ ordered = sorted(values)
+ return ordered[min(len(ordered) - 1, int(share * len(ordered)))]
+
+
+def summary(name, values):
+ if not values:
+  print("%-12s no samples" % name)
+  return
+ print("%-12s %6d samples  p50 %8.2f  p99 %8.2f  max %8.2f ms" % (name, len(values), percentile(values, 0.5) / 1000.0, percentile(values, 0.99) / 1000.0, max(values) / 1000.0))
+
+
+def analyze(events, offsets):
+ # Group events by message, on the reference clock. Events on clocks that couldn't be lined up are left out.
+ messages = {}
+ unaligned = 0
+ for event in events:
+  if event.clock not in offsets:
+   unaligned += 1
+   continue
+  event.time -= offsets[event.clock]
+  messages.setdefault(event.message(), []).append(event)
+ hops = []
+ queues = []
+ ends = []
+ for message, timeline in messages.items():
+  timeline.sort(key=lambda event: event.time)
+  # The time each node first had the message, by softAP MAC as peers name it.
+  had = {}
+  for event in timeline:
+   if event.kind in (TRACE_ORIGINATE, TRACE_RECEIVE) and event.link not in had:
+    had[event.link] = event.time
+  for event in timeline:
+   if event.kind == TRACE_RECEIVE and event.peer in had:
+    hops.append(event.time - had[event.peer])
+   elif event.kind == TRACE_SENT and event.status == SEND_SUCCESS and event.link in had:
+    queues.append(event.time - had[event.link])
+  if message[0] == MESSAGE_TARGETED:
+   originated = [event.time for event in timeline if event.kind == TRACE_ORIGINATE]
+   delivered = [event.time for event in timeline if event.kind == TRACE_DELIVER]
+   if originated and delivered:
+    ends.append(min(delivered) - min(originated))
+ return messages, hops, queues, ends, unaligned
+
+
+def printTimeline(message, timeline):
+ message_type, originator, message_id = message
+ print("%s %s id %d" % (TYPE_NAMES.get(message_type, "type %d" % message_type), macString(originator), message_id))
+ start = timeline[0].time
+ for event in timeline:
+  line = "  %10.3f  %s  %-9s  hops %2d" % ((event.time - start) / 1000.0, macString(event.node), EVENT_NAMES[event.kind], event.hops)
+  if event.peer != NO_PEER:
+   line += "  peer %s" % macString(event.peer)
+  if event.kind == TRACE_SENT and event.status != SEND_SUCCESS:
+   line += "  failed"
+  print(line)
+
+
+def parseMessage(text):
+ originator, _, message_id = text.rpartition(":")
+ return bytes(int(part, 16) for part in originator.split(":")), int(message_id)
+
+
+def main():
+ parser = argparse.ArgumentParser(description="Line up NowMesh trace events from many nodes, message by message.")
+ parser.add_argument("files", nargs="*", default=["-"], help="trace files, or - for stdin")
+ parser.add_argument("--messages", type=int, default=0, help="print the timelines of the first n messages")
+ parser.add_argument("--message", action="append", default=[], help="print the timeline of one message, as originator:id")
+ args = parser.parse_args()
+
+ events = load(args.files)
+ offsets, reference = alignClocks(events)
+ messages, hops, queues, ends, unaligned = analyze(events, offsets)
+ nodes = set(event.node for event in events)
+ print("%d events from %d nodes, %d messages" % (len(events), len(nodes), len(messages)))
+ if reference is not None:
+  print("clocks lined up with %s: %d of %d" % (macString(reference[0]), len(offsets), len(set(event.clock for event in events))))
+ if unaligned:
+  print("%d events left out, on clocks that couldn't be lined up" % unaligned)
+ summary("hop", hops)
+ summary("queue", queues)
+ summary("end", ends)
+
+ ordered = sorted(messages.items(), key=lambda item: item[1][0].time)
+ picked = [parseMessage(text) for text in args.message]
+ shown = 0
+ for message, timeline in ordered:
+  if shown < args.messages or (message[1], message[2]) in picked:
+   print()
+   printTimeline(message, timeline)
+   shown += 1
+
+
+if __name__ == "__main__":
+ main()
@@ -0,0 +1,88 @@
+#ifndef NOWMESH_MAILBOX_H
+#define NOWMESH_MAILBOX_H
+
+#include <stdint.h>
+#include <string.h>
+
+// Frames a parent holds for children that are asleep, until they wake up and ask for them.
+// Fixed capacity and shared by all children, so a child can't have more than fit altogether.
+template <int capacity, int frame_len>
+class Mailbox {
+ static_assert(capacity > 0, "Mailbox capacity must be positive");
+
+ struct entry {
+  uint8_t child[6];
+  uint8_t len;
+  bool used;
+  uint32_t stored_at;
+  uint8_t data[frame_len];
+ };
+
+ entry entries[capacity] = {};
+ int count = 0;
+
+public:
+ int size() const {
+  return count;
+ }
+
+ // Number of frames held for child.
+ int held(const uint8_t* child) const {
+  int found = 0;
+  for (int i = 0; i < capacity; i++) {
+   if (entries[i].used && memcmp(entries[i].child, child, 6) == 0) {
+    found++;
+   }
+  }
+  return found;
+ }
+
+ // Hold a frame for child. If the mailbox is full the oldest frame in it is dropped to make room,
+ //  in which case this returns false. len must be no more than frame_len.
+ bool store(const uint8_t* child, const uint8_t* data, uint8_t len, uint32_t now) {
+  int slot = -1;
+  for (int i = 0; i < capacity && slot < 0; i++) {
+   if (!entries[i].used) {
+    slot = i;
+   }
+  }
+  bool room = slot >= 0;
+  if (!room) {
+   slot = 0;
+   for (int i = 1; i < capacity; i++) {
+    if (now - entries[i].stored_at > now - entries[slot].stored_at) {
+     slot = i;
+    }
+   }
+   count--;
+  }
+  entry& held = entries[slot];
+  memcpy(held.child, child, 6);
+  held.len = len;
+  held.used = true;
+  held.stored_at = now;
+  memcpy(held.data, data, len);
+  count++;
+  return room;
+ }
+
+ // Take the oldest frame held for child out of the mailbox. Returns NULL if there's none.
+ // The frame stays where it is until the next call to store, so it must be copied out before then.
+ const uint8_t* take(const uint8_t* child, uint8_t& len, uint32_t now) {
+  int oldest = -1;
+  for (int i = 0; i < capacity; i++) {
+   if (entries[i].used && memcmp(entries[i].child, child, 6) == 0 && (oldest < 0 || now - entries[i].stored_at > now - entries[oldest].stored_at)) {
+    oldest = i;
+   }
+  }
+  if (oldest < 0) {
+   return NULL;
+  }
+  entries[oldest].used = false;
+  count--;
+  len = entries[oldest].len;
+  return entries[oldest].data;
+ }
+};
+
+#endif
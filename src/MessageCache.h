@@ -0,0 +1,130 @@
+#ifndef NOWMESH_MESSAGE_CACHE_H
+#define NOWMESH_MESSAGE_CACHE_H
+
+#include <stdint.h>
+#include <string.h>
+#include <type_traits>
+
+// What we remember about a message we have seen.
+struct message_info {
+ uint8_t originator[6];
+ uint8_t sender[6];
+ uint16_t id;
+ // Which part of the message this was, for messages sent in fragments. 0 otherwise.
+ uint8_t part;
+};
+
+// Fixed capacity store of recently seen messages, used to suppress duplicates.
+// Messages are identified by originator, id and part.
+// Messages are kept in a ring buffer, so once it's full the oldest message is forgotten
+//  to make room for the newest.
+// A hash index (open addressing, linear probing) over the ring makes lookup and insert
+//  constant time no matter how large the capacity is.
+template <int capacity>
+class MessageCache {
+ static_assert(capacity > 0 && capacity < 65535, "MessageCache capacity must be between 1 and 65534");
+
+ // The index is the smallest power of two at least twice the capacity,
+ //  which keeps the load factor at or below one half.
+ static constexpr int indexSize(int size = 1) {
+  return size >= capacity * 2 ? size : indexSize(size * 2);
+ }
+ static constexpr int index_mask = indexSize() - 1;
+
+ message_info ring[capacity];
+ // Each index slot holds a ring position plus one, or 0 if it's empty.
+ // Small stores get byte-wide slots, halving the index.
+ typedef typename std::conditional<capacity < 255, uint8_t, uint16_t>::type slot_type;
+ slot_type index[indexSize()];
+ // Position the next message will be written to.
+ int head = 0;
+ int count = 0;
+
+ static int home(const uint8_t* originator, uint16_t id, uint8_t part) {
+  // FNV-1a over the originator, id and part.
+  uint32_t hash = 2166136261u;
+  for (int i = 0; i < 6; i++) {
+   hash = (hash ^ originator[i]) * 16777619u;
+  }
+  hash = (hash ^ (id & 0xff)) * 16777619u;
+  hash = (hash ^ (id >> 8)) * 16777619u;
+  hash = (hash ^ part) * 16777619u;
+  return hash & index_mask;
+ }
+
+ // Find the index slot pointing at this message, or -1.
+ int find(const uint8_t* originator, uint16_t id, uint8_t part) const {
+  for (int slot = home(originator, id, part); index[slot] != 0; slot = (slot + 1) & index_mask) {
+   const message_info& entry = ring[index[slot] - 1];
+   if (entry.id == id && entry.part == part && memcmp(entry.originator, originator, 6) == 0) {
+    return slot;
+   }
+  }
+  return -1;
+ }
+
+ // Empty an index slot, shifting back any entries that probed past it
+ //  so their probe sequences stay unbroken.
+ void removeSlot(int hole) {
+  int slot = hole;
+  while (true) {
+   slot = (slot + 1) & index_mask;
+   if (index[slot] == 0) {
+    break;
+   }
+   const message_info& entry = ring[index[slot] - 1];
+   int want = home(entry.originator, entry.id, entry.part);
+   // The entry can move into the hole unless its home lies cyclically in (hole, slot].
+   if (((slot - want) & index_mask) >= ((slot - hole) & index_mask)) {
+    index[hole] = index[slot];
+    hole = slot;
+   }
+  }
+  index[hole] = 0;
+ }
+
+public:
+ MessageCache() {
+  memset(index, 0, sizeof(index));
+ }
+
+ bool contains(const uint8_t* originator, uint16_t id, uint8_t part = 0) const {
+  return find(originator, id, part) >= 0;
+ }
+
+ // Remember a message, forgetting the oldest one if we're full.
+ void insert(const uint8_t* originator, const uint8_t* sender, uint16_t id, uint8_t part = 0) {
+  if (count == capacity) {
+   const message_info& oldest = ring[head];
+   int slot = find(oldest.originator, oldest.id, oldest.part);
+   if (slot >= 0) {
+    removeSlot(slot);
+   }
+  }
+  else {
+   count++;
+  }
+  message_info& entry = ring[head];
+  memcpy(entry.originator, originator, 6);
+  memcpy(entry.sender, sender, 6);
+  entry.id = id;
+  entry.part = part;
+  int slot = home(originator, id, part);
+  while (index[slot] != 0) {
+   slot = (slot + 1) & index_mask;
+  }
+  index[slot] = head + 1;
+  head = (head + 1) % capacity;
+ }
+
+ int size() const {
+  return count;
+ }
+
+ // Messages by age, 0 being the newest.
+ const message_info& operator[](int age) const {
+  return ring[(head - 1 - age + capacity) % capacity];
+ }
+};
+
+#endif
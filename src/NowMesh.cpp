@@ -1,130 +1,461 @@
 #include <NowMesh.h>
 
+// Debug output. Takes a level and printf style arguments.
+// Debug level settings are in NowMesh.h
+// If the level is above NOWMESH_DEBUG the whole statement compiles away,
+//  arguments included, so debug calls cost nothing when debugging is off.
+#if NOWMESH_DEBUG > 0
+ #define nowmeshDebug(level, ...) do { if (NOWMESH_DEBUG >= (level)) { Serial.printf(__VA_ARGS__); Serial.println(); } } while (0)
+#else
+ #define nowmeshDebug(level, ...) do {} while (0)
+#endif
+
+// Count something in the stats. Compiles away along with the counters when NOWMESH_STATS is 0.
+#if NOWMESH_STATS
+ #define nowmeshCount(counter) do { stats.counter++; } while (0)
+#else
+ #define nowmeshCount(counter) do {} while (0)
+#endif
+
+// Record a trace event. Compiles away when NOWMESH_TRACE is 0, and is one branch while tracing is off.
+#if NOWMESH_TRACE
+ #define nowmeshTrace(event, header, peer, status) do { if (tracing) { traceEvent(event, header, peer, status); } } while (0)
+#else
+ #define nowmeshTrace(event, header, peer, status) do {} while (0)
+#endif
+
 // A bit of info on how NowMesh works:
 // There are two kinds of messages, broadcast and targeted.
 // Nodes forward broadcast messages to all their peers unless they
-//  have already received the message.
+//  have already received the message or it has used up its TTL.
 //  If you have trouble with messages that won't die, but keep being sent around,
 //  increase STORED_MESSAGES in NowMesh.h
-// When receiving a targeted message, nodes look through their stored messages in
-//  order to find the best route. If they can't find a best route, they broadcast the message.
-// Message format, each field separated by a comma:
-// 1:  [1-2]      Message type. 1 = Broadcast, 2 = Targeted
-// 2:  [0-255]    First byte of MAC address of the node that originated the message.
-// 3:  [0-255]    Second
-// 4:  [0-255]    Third
-// 5:  [0-255]    Fourth
-// 6:  [0-255]    Fifth
-// 7:  [0-255]    Sixth
-// 8:  [0-255]    First byte of MAC addresss of the target node, else 0 if message is broadcast.
-// 9:  [0-255]
-// 10: [0-255]
-// 11: [0-255]
-// 12: [0-255]
-// 13: [0-255]
-// 14: [0-65535]  Message ID. Each Node tracks their message ID, incrementing it every time they send a message.
-// 15: ^[,]*      Message. This can be anything as long as it has no commas
-//                 and the total message length is less than MAX_MSG_LEN, set in NowMesh.h
-
-// This is where we store messages.
-message_info NowMesh::message_store[STORED_MESSAGES];
-
-// User facing callbacks for when we receive a message or a message has been sent.
-// These callbacks won't get the whole message, only the part that was sent with NowMesh::send by the other node.
-std::function<void(String, bool, uint8_t*)> NowMesh::receiveCallback;
-std::function<void(int)> NowMesh::sendCallback; 
-
-NowMesh::NowMesh() {
+// With aggregation on, messages queued for the same next hop within a short window share a frame,
+//  an aggregate. The receiver splits it up and handles each message in it separately.
+// Messages longer than fit in one frame are split into fragments, which share the message's id.
+//  Fragments travel like any other message, and only the destination puts them back together.
+// Targeted messages can be sent reliably. The target sends back an ACK, a bare header routed
+//  back along the way we came, and the originator resends the message until one arrives.
+// A gateway can advertise itself. Each node passes the advertisement on to its neighbors with
+//  its own cost to the gateway, picks the cheapest neighbor as its parent, and sends messages
+//  for the gateway to its parent, so reports travel up a collection tree.
+// Battery powered nodes can be leaves. A leaf sleeps most of the time and sends everything to a parent
+//  when it wakes up, starting with a poll, which the parent answers with the frames it held for it meanwhile.
+// There is also a third kind, beacons. With discovery on, nodes send one to the broadcast address
+//  every so often, so neighbors learn about them without scanning. Beacons are never forwarded.
+// Every received frame from a neighbor adds it to the peer table if there's room.
+// Every received frame updates the routing table, which remembers the neighbor each other node
+//  was last heard through and how many hops away it is.
+// When sending a targeted message, nodes look up the target in the routing table and send
+//  the message only to the next hop. If they don't have a route, they broadcast the message.
+// With route discovery on, the originator floods a bare route request in its place instead. The target
+//  answers with a route reply, routed back the way the request came, which leaves a route behind at
+//  every hop, and the message follows it.
+// A routed frame that fails to reach its next hop is sent once more, through the second best next hop
+//  the routing table knows for the target if there is one. After LINK_FAILURES failures in a row,
+//  routes through that neighbor switch to their second best, or are marked stale.
+// Frame format. Every frame starts with a packed mesh_header (see NowMesh.h):
+// Offset  Size  Field
+// 0       1     Version. Must be NOWMESH_VERSION, otherwise the frame is dropped.
+// 1       1     Message type. 1 = Broadcast, 2 = Targeted, 3 = Beacon, 4 = Aggregate, 5 = ACK, 6 = Stats,
+//                7 = Sink (gateway advertisement), 8 = Poll (a leaf is awake), 9 = Poll reply,
+//                10 = Route request, 11 = Route reply
+// 2       6     MAC address of the node that originated the message.
+// 8       6     MAC address of the target node, all zeroes if the message is broadcast.
+// 14      2     Message ID. Each Node tracks their message ID, incrementing it every time they send a message.
+// 16      1     Hop count. Incremented every time the frame is forwarded.
+// 17      1     TTL. Hops the frame may still travel. Decremented every time the frame is forwarded,
+//                and the frame is not forwarded once it reaches 1.
+// 18      1     Flags. Bit 0 set means the message is a fragment, and starts with a fragment_header.
+//                Bit 1 set means the target should send back an ACK. Bits 2 and 3 are the priority class.
+//                Bits 4 to 7 count retransmissions.
+// 19      ...   Message. Raw bytes, anything at all, running to the end of the frame.
+//                The total frame length must be no more than MAX_MSG_LEN, set in NowMesh.h
+// With a network key set, every frame on the air is followed by an AUTH_TAG_LEN byte tag,
+//  see NowMesh::setNetworkKey. It isn't counted in MAX_MSG_LEN.
+// An aggregate's message is a series of whole frames, each preceded by a length byte.
+
+// The node the SDK callbacks go to, set by begin().
+NowMesh* NowMesh::instance = NULL;
+
+// Beacons are sent here.
+const uint8_t NowMesh::broadcast_mac[6] = {0xff, 0xff, 0xff, 0xff, 0xff, 0xff};
+#if NOWMESH_BRIDGE
+// No radio has this address, so it can stand for the bridge in the route table.
+const uint8_t NowMesh::bridge_mac[6] = {0, 0, 0, 0, 0, 0};
+#endif
+
+NowMesh::NowMesh() : route_table(ROUTE_TIMEOUT)
+#if NOWMESH_FRAGMENTATION
+ , reassembly(REASSEMBLY_TIMEOUT)
+#endif
+{
+}
+
+// SDK callbacks. They're plain functions, so pass them on to the node that called begin().
+void ICACHE_FLASH_ATTR NowMesh::scanDoneCallback(void* arg, STATUS status) {
+ if (instance != NULL) {
+  instance->handleScanDone(arg, status);
+ }
+}
+
+void ICACHE_FLASH_ATTR NowMesh::receiveData(unsigned char* mac, unsigned char* data, uint8_t len) {
+ if (instance != NULL) {
+  instance->handleReceive(mac, data, len);
+ }
+}
+
+void ICACHE_FLASH_ATTR NowMesh::sendData(unsigned char* mac_addr, unsigned char status) {
+ if (instance != NULL) {
+  instance->handleSent(mac_addr, status);
+ }
 }
 
 // Set callbacks
 void ICACHE_FLASH_ATTR NowMesh::setReceiveCallback(std::function<void(String, bool, uint8_t*)> callback) {
- NowMesh::receiveCallback = callback;
+ setMessageCallback([callback](const mesh_message& message) {
+  // String wants a terminator, which the frame doesn't have.
+  // Reassembled messages are too big for the stack, but String is going to allocate anyway.
+  char small[MAX_PAYLOAD_LEN + 1];
+  char* buffer = message.len <= MAX_PAYLOAD_LEN ? small : static_cast<char*>(malloc(message.len + 1));
+  if (buffer == NULL) {
+   return;
+  }
+  memcpy(buffer, message.data, message.len);
+  buffer[message.len] = 0;
+  callback(String(buffer), message.self_is_target, message.originator);
+  if (buffer != small) {
+   free(buffer);
+  }
+ });
+}
+
+// The message callback gets the raw bytes, without a copy.
+void ICACHE_FLASH_ATTR NowMesh::setMessageCallback(std::function<void(const mesh_message&)> callback) {
+ messageFunction = callback;
+ setMessageHandler(callback ? callMessageFunction : NULL, this);
 }
 
 void ICACHE_FLASH_ATTR NowMesh::setSendCallback(std::function<void(int)> callback) {
- NowMesh::sendCallback = callback;
+ setSendStatusCallback([callback](const mesh_handle&, int status) {
+  callback(status);
+ });
+}
+
+// The send status callback also gets the handle of the message the frame belongs to,
+//  the same one send() returned if we originated it.
+void ICACHE_FLASH_ATTR NowMesh::setSendStatusCallback(std::function<void(const mesh_handle&, int)> callback) {
+ sendFunction = callback;
+ setSendStatusHandler(callback ? callSendFunction : NULL, this);
+}
+
+// The handlers are the same callbacks as plain functions, which get context back on every call.
+// They're the cheapest way to hear about every frame: no std::function, and nothing copied.
+// Setting a handler replaces the callback set the other way, and NULL turns it off.
+void ICACHE_FLASH_ATTR NowMesh::setMessageHandler(void (*handler)(void* context, const mesh_message& message), void* context) {
+ messageCallback.function = handler;
+ messageCallback.context = context;
+ if (handler != callMessageFunction) {
+  messageFunction = nullptr;
+ }
+}
+
+void ICACHE_FLASH_ATTR NowMesh::setSendStatusHandler(void (*handler)(void* context, const mesh_handle& handle, int status), void* context) {
+ sendCallback.function = handler;
+ sendCallback.context = context;
+ if (handler != callSendFunction) {
+  sendFunction = nullptr;
+ }
+}
+
+void ICACHE_FLASH_ATTR NowMesh::callMessageFunction(void* context, const mesh_message& message) {
+ static_cast<NowMesh*>(context)->messageFunction(message);
+}
+
+void ICACHE_FLASH_ATTR NowMesh::callSendFunction(void* context, const mesh_handle& handle, int status) {
+ static_cast<NowMesh*>(context)->sendFunction(handle, status);
+}
+
+#if NOWMESH_RELIABLE
+// The delivery callback reports on messages sent with sendReliable:
+//  whether the target acknowledged it, the milliseconds from first sending to the ACK
+//  (or to giving up), and the number of attempts made.
+void ICACHE_FLASH_ATTR NowMesh::setDeliveryCallback(std::function<void(const mesh_handle&, bool, uint32_t, uint8_t)> callback) {
+ NowMesh::deliveryCallback = callback;
+}
+#endif
+
+// Find a peer in the peer table. Returns its index or -1.
+int ICACHE_FLASH_ATTR NowMesh::findPeer(const uint8_t* mac) {
+ for (int i = 0; i < MAX_PEERS; i++) {
+  if (peer_store[i].used && memcmp(peer_store[i].mac, mac, 6) == 0) {
+   return i;
+  }
+ }
+ return -1;
+}
+
+// How much we want a peer.
+// Signal strength is the base, scaled by how many of our frames the peer acknowledges,
+//  plus the bonus for previous contact worked out when the peer was last scanned.
+int16_t ICACHE_FLASH_ATTR NowMesh::peerScore(const peer_info& peer) {
+ int16_t signal = 128 + peer.rssi / 16;
+ return signal * (peer.delivery + 1) / 256 + peer.contact;
+}
+
+// We heard a frame from this neighbor. Add it to the peer table if it isn't there yet,
+//  taking a free spot or one whose peer we haven't heard from in PEER_TIMEOUT.
+// The SDK doesn't tell us the signal strength of received frames, so new peers start at PEER_DEFAULT_RSSI.
+// Returns the peer's index, or -1 if there was no room.
+int ICACHE_FLASH_ATTR NowMesh::learnPeer(const uint8_t* mac, uint32_t now) {
+ int i = findPeer(mac);
+ if (i < 0) {
+  for (int j = 0; j < MAX_PEERS; j++) {
+   if (!peer_store[j].used) {
+    i = j;
+    break;
+   }
+   if (now - peer_store[j].last_seen > PEER_TIMEOUT) {
+    i = j;
+   }
+  }
+  if (i < 0) {
+   return -1;
+  }
+  nowmeshDebug(LEVEL_NORMAL, "Learned peer in position %d", i);
+  if (peer_store[i].used) {
+   esp_now_del_peer(peer_store[i].mac);
+  }
+  peer_store[i] = peer_info();
+  memcpy(peer_store[i].mac, mac, 6);
+  peer_store[i].rssi = PEER_DEFAULT_RSSI * 16;
+  peer_store[i].used = true;
+  uint8_t* peer = peer_store[i].mac;
+  if (!esp_now_is_peer_exist(peer)) {
+   esp_now_add_peer(peer, ESP_NOW_ROLE_SLAVE, channel, NULL, 0);
+  }
+ }
+ peer_store[i].last_seen = now;
+ peer_store[i].missed = 0;
+ return i;
+}
+
+// Number of peers we've heard from, by scan or traffic, within PEER_TIMEOUT.
+int ICACHE_FLASH_ATTR NowMesh::neighborCount(uint32_t now) {
+ int count = 0;
+ for (int i = 0; i < MAX_PEERS; i++) {
+  if (peer_store[i].used && now - peer_store[i].last_seen <= PEER_TIMEOUT) {
+   count++;
+  }
+ }
+ return count;
+}
+
+// Feed a send report into the delivery ratio of the peer it was for.
+void ICACHE_FLASH_ATTR NowMesh::updateDelivery(const uint8_t* mac, bool delivered) {
+ int i = findPeer(mac);
+ if (i >= 0) {
+  int16_t sample = delivered ? 255 : 0;
+  peer_store[i].delivery += (sample - peer_store[i].delivery) / 8;
+ }
+}
+
+// Messages stored from or through a peer are keyed by the last four bytes of its MAC address,
+//  which its station and softAP MACs share, so an originator matches the AP a scan finds.
+// Two MACs sharing those would only mean a stranger gets the other's contact bonus.
+uint32_t ICACHE_FLASH_ATTR NowMesh::contactKey(const uint8_t* mac) {
+ return ((uint32_t)mac[2] << 24) | ((uint32_t)mac[3] << 16) | ((uint32_t)mac[4] << 8) | mac[5];
+}
+
+// Collect the senders and originators of the newest PEER_CONTACT_MESSAGES stored messages,
+//  sorted, so a scan can look each AP up instead of walking the message store for every one.
+// keys must have room for 2 * PEER_CONTACT_MESSAGES. Returns the number of keys.
+int ICACHE_FLASH_ATTR NowMesh::recentContacts(uint32_t* keys) {
+ int count = 0;
+ for (int age = 0; age < message_store.size() && age < PEER_CONTACT_MESSAGES; age++) {
+  const message_info& message = message_store[age];
+  keys[count++] = contactKey(message.originator);
+  // A message only counts once for a peer that both originated and sent it.
+  if (memcmp(message.originator, message.sender, 6) != 0) {
+   keys[count++] = contactKey(message.sender);
+  }
+ }
+ // There are few enough that insertion sort does.
+ for (int i = 1; i < count; i++) {
+  uint32_t key = keys[i];
+  int j = i;
+  for (; j > 0 && keys[j - 1] > key; j--) {
+   keys[j] = keys[j - 1];
+  }
+  keys[j] = key;
+ }
+ return count;
+}
+
+// Score bonus for previous contact with a peer, 20 for every recent message from or through it.
+// This gives peers we have previously been in contact with an advantage.
+int16_t ICACHE_FLASH_ATTR NowMesh::contactBonus(const uint32_t* keys, int count, const uint8_t* mac) {
+ uint32_t key = contactKey(mac);
+ // Find the first key that isn't below ours, then count the matches from there.
+ int low = 0;
+ int high = count;
+ while (low < high) {
+  int middle = (low + high) / 2;
+  if (keys[middle] < key) {
+   low = middle + 1;
+  }
+  else {
+   high = middle;
+  }
+ }
+ int16_t contact = 0;
+ for (int i = low; i < count && keys[i] == key; i++) {
+  contact += 20;
+ }
+ return contact;
 }
 
 // We scan for peers. User code should call NowMesh::scanForPeers every once in a while.
 // scanForPeers is asynchrous, and this is its callback.
-void ICACHE_FLASH_ATTR NowMesh::scanDoneCallback(void* arg, STATUS status) {
+// The peer table persists from scan to scan. Each scan updates the peers it sees,
+//  and a peer has to be missing from PEER_MISSED_SCANS scans in a row, or be beaten by
+//  PEER_HYSTERESIS points, before it's replaced. That keeps peers from churning.
+// A busy site can return dozens of APs, and this runs in the SDK's context, so the work per AP
+//  is kept small: a prefix compare, a lookup in the peer table and one in the recent contacts,
+//  and for new peers an insert into the best MAX_PEERS candidates. Only those few are then
+//  compared against the peer table.
+void ICACHE_FLASH_ATTR NowMesh::handleScanDone(void* arg, STATUS status) {
+ if (probing) {
+  probing = false;
+  if (status == OK) {
+   probeDone((struct bss_info *)arg);
+  }
+  return;
+ }
  // Make sure scan was successful.
- if (status == OK) {
-  nowmeshDebug("Scan Done status OK", LEVEL_NORMAL);
-  // We store found peers temporarily for processing.
-  peer_info peer_store[MAX_PEERS];
-  // Found AP info is in a tail queue; let's loop through it.
-  struct bss_info* ap_link = (struct bss_info *)arg;
-  while (ap_link != NULL) {
-   String ssid = (const char*)ap_link->ssid;
-   nowmeshDebug(String("Found AP: " + ssid), LEVEL_NORMAL);
-   // Check for the default ESP8266 prefix so we don't try to peer with some random router.
-   if (ssid.substring(0, 4) == "ESP_") {
-    // Strategy here is to loop through stored peers and find an empty spot or replace the peer with the worst score.
-    // candidate is the index of the one we want to replace
-    int candidate = -1;
-    int16_t worst_score = 0;
-    // Score is based on signal strength
-    int16_t score = 128 - abs(ap_link->rssi);
-    // Loop through stored messages and add score for every message we have gotten from or through this peer.
-    // This gives peers we have previously been in contact with an advantage.
-    for (int i = 0; i < STORED_MESSAGES; i++) {
-     if (memcmp(ap_link->bssid, message_store[i].originator, 6) == 0 || memcmp(ap_link->bssid, message_store[i].sender, 6) == 0) {
-      score += 20;
-     }
-    }
-    nowmeshDebug(String("AP score: " + String(score, DEC)), LEVEL_NORMAL);
-    // Loop through the stored peers
-    for (int i = 0; i < MAX_PEERS; i++) {
-     // This place is empty, we'll just go ahead and store there.
-     if (!(peer_store[i].score > 0)) {
-      candidate = i;
-      // Break from loop so we don't keep trying to find a place.
-      break;
-     }
-     // If this peer has a worse score than we do and also breaks the record for worst score,
-     //  it's the best candidate for replacement yet.
-     if (peer_store[i].score < score && peer_store[i].score < worst_score) {
-      candidate = i;
-      // Set the record.
-      worst_score = peer_store[i].score;
-     }
-    }
-    // If we didn't find one to replace, candidate will still be -1.
-    if (candidate >= 0) {
-     nowmeshDebug(String("Storing in position " + String(candidate, DEC)), LEVEL_NORMAL);
-     memcpy(peer_store[candidate].mac, ap_link->bssid, 6);
-     peer_store[candidate].score = score;
-    }
-   }
-   // Get the next AP in the tail queue
-   ap_link = STAILQ_NEXT(ap_link, next);
-  }
-  // Now loop through peer storage. If they aren't already our peers, make them so.
-  for (int i = 0; i < MAX_PEERS; i++) {
-   if (peer_store[i].score > 0) {
-    if (!esp_now_is_peer_exist(peer_store[i].mac)) {
-     esp_now_add_peer(peer_store[i].mac, ESP_NOW_ROLE_SLAVE, CHANNEL, NULL, 0);
-    }
-   }
+ if (status != OK) {
+  return;
+ }
+ nowmeshDebug(LEVEL_NORMAL, "Scan Done status OK");
+ // Track which peers this scan saw.
+ bool seen[MAX_PEERS] = {};
+ uint32_t now = millis();
+ uint32_t contacts[2 * PEER_CONTACT_MESSAGES];
+ int contact_count = recentContacts(contacts);
+ // New peers worth having, best first. No more than MAX_PEERS can ever get in.
+ peer_info candidates[MAX_PEERS];
+ int16_t candidate_scores[MAX_PEERS];
+ int candidate_count = 0;
+ // Found AP info is in a tail queue; let's loop through it.
+ struct bss_info* ap_link = (struct bss_info *)arg;
+ for (; ap_link != NULL; ap_link = STAILQ_NEXT(ap_link, next)) {
+  nowmeshDebug(LEVEL_NORMAL, "Found AP: %.32s", (const char*)ap_link->ssid);
+  // Check for the default ESP8266 prefix so we don't try to peer with some random router.
+  if (memcmp(ap_link->ssid, "ESP_", 4) != 0) {
+   continue;
+  }
+  int16_t contact = contactBonus(contacts, contact_count, ap_link->bssid);
+  int i = findPeer(ap_link->bssid);
+  if (i >= 0) {
+   // A peer we already have. Smooth its signal strength in.
+   peer_store[i].rssi += (ap_link->rssi * 16 - peer_store[i].rssi) / 4;
+   peer_store[i].contact = contact;
+   seen[i] = true;
+   peer_store[i].missed = 0;
+   peer_store[i].last_seen = now;
+   continue;
+  }
+  // A new peer. Build its entry and keep it if it's among the best so far.
+  peer_info candidate;
+  memcpy(candidate.mac, ap_link->bssid, 6);
+  candidate.rssi = ap_link->rssi * 16;
+  candidate.contact = contact;
+  int16_t score = peerScore(candidate);
+  if (candidate_count == MAX_PEERS && score <= candidate_scores[MAX_PEERS - 1]) {
+   continue;
   }
-  // Now loop through our peers to purge those we don't want to burden ourselves with.
-  u8* peer = esp_now_fetch_peer(true);
-  while (peer != NULL) {
-   bool found = false;
-   // Loop through peer storage to try to find them.
-   for (int i = 0; i < MAX_PEERS; i++) {
-    if (memcmp(peer, peer_store[i].mac, 6) == 0) {
-     found = true;
-    }
+  int position = candidate_count < MAX_PEERS ? candidate_count++ : MAX_PEERS - 1;
+  for (; position > 0 && candidate_scores[position - 1] < score; position--) {
+   candidates[position] = candidates[position - 1];
+   candidate_scores[position] = candidate_scores[position - 1];
+  }
+  candidates[position] = candidate;
+  candidate_scores[position] = score;
+ }
+ // Give each candidate, best first, an empty spot or the spot of the worst peer this scan didn't see.
+ for (int c = 0; c < candidate_count; c++) {
+  int i = -1;
+  int16_t worst_score = INT16_MAX;
+  for (int j = 0; j < MAX_PEERS; j++) {
+   // This place is empty, we'll just go ahead and store there.
+   if (!peer_store[j].used) {
+    i = j;
+    break;
    }
-   if (!found) {
-    esp_now_del_peer(peer);
+   // Peers seen in this scan are safe.
+   if (seen[j]) {
+    continue;
    }
-   // Get the next peer.
-   peer = esp_now_fetch_peer(false);
+   int16_t peer_score = peerScore(peer_store[j]);
+   if (peer_score < worst_score) {
+    i = j;
+    worst_score = peer_score;
+   }
+  }
+  // Only replace the worst peer if we beat it by a margin.
+  // The candidates after this one score no better, so they won't either.
+  if (i < 0 || (peer_store[i].used && candidate_scores[c] < worst_score + PEER_HYSTERESIS)) {
+   break;
+  }
+  nowmeshDebug(LEVEL_NORMAL, "Storing in position %d, score %d", i, candidate_scores[c]);
+  if (peer_store[i].used) {
+   esp_now_del_peer(peer_store[i].mac);
+  }
+  peer_store[i] = candidates[c];
+  peer_store[i].used = true;
+  seen[i] = true;
+  peer_store[i].last_seen = now;
+ }
+ // Now loop through peer storage. Forget peers that have been gone too long,
+ //  and if the rest aren't already our peers, make them so.
+ // Peers we've heard traffic from recently stay, even if scans don't see them.
+ int stored = 0;
+ for (int i = 0; i < MAX_PEERS; i++) {
+  if (!peer_store[i].used) {
+   continue;
+  }
+  if (!seen[i] && ++peer_store[i].missed >= PEER_MISSED_SCANS && now - peer_store[i].last_seen > PEER_TIMEOUT) {
+   nowmeshDebug(LEVEL_NORMAL, "Dropping peer in position %d", i);
+   peer_store[i].used = false;
+   esp_now_del_peer(peer_store[i].mac);
+   continue;
+  }
+  if (!esp_now_is_peer_exist(peer_store[i].mac)) {
+   esp_now_add_peer(peer_store[i].mac, ESP_NOW_ROLE_SLAVE, channel, NULL, 0);
+  }
+  stored++;
+ }
+ // Every stored peer is an ESP Now peer now, and so is the broadcast address while a beacon is in flight.
+ // Anything beyond that was peered on demand to reach a next hop. Only walk the SDK's list to purge
+ //  those if there are any, since each lookup in it is a walk of its own.
+ uint8_t peers;
+ uint8_t encrypted;
+ esp_now_get_cnt_info(&peers, &encrypted);
+ if (esp_now_is_peer_exist(const_cast<uint8_t*>(broadcast_mac))) {
+  stored++;
+ }
+ if (peers <= stored) {
+  return;
+ }
+ u8* peer = esp_now_fetch_peer(true);
+ while (peer != NULL) {
+  // Look in peer storage to try to find them.
+  // The broadcast address is only ever peered while a beacon is in flight, leave it be.
+  if (findPeer(peer) < 0 && memcmp(peer, broadcast_mac, 6) != 0) {
+   esp_now_del_peer(peer);
   }
+  // Get the next peer.
+  peer = esp_now_fetch_peer(false);
  }
 }
 
@@ -135,253 +466,2323 @@ void ICACHE_FLASH_ATTR NowMesh::scanForPeers() {
  struct scan_config config;
  config.ssid = NULL;
  config.bssid = NULL;
- config.channel = CHANNEL;
+ config.channel = channel;
  wifi_station_scan(&config, scanDoneCallback);
 }
 
-// Send a message, any message...
-// Used by sendBroadcast and sendTargeted
-int ICACHE_FLASH_ATTR NowMesh::sendMessage(uint8_t* target, char* data){
- nowmeshDebug(String("Sending message out: " + String((const char*)data)), LEVEL_NORMAL);
- system_soft_wdt_feed();
- // If target is NULL, esp_now_send will send to all peers.
- return esp_now_send(target, reinterpret_cast<unsigned char*>(data), strlen(data));
+// Move to another channel. Neighbors on the old one can't hear us any more, so the peer table
+//  starts over, and discovery finds the neighbors on the new one.
+// Routes through old neighbors fail over to flooding until they time out.
+void ICACHE_FLASH_ATTR NowMesh::setChannel(uint8_t new_channel) {
+ nowmeshDebug(LEVEL_NORMAL, "Moving to channel %u", new_channel);
+ channel = new_channel;
+ wifi_set_channel(channel);
+ for (int i = 0; i < MAX_PEERS; i++) {
+  if (peer_store[i].used) {
+   esp_now_del_peer(peer_store[i].mac);
+   peer_store[i].used = false;
+  }
+ }
+#if NOWMESH_COLLECTION
+ sink.valid = false;
+#endif
+ // Scan again soon, rather than waiting out SCAN_BACKOFF.
+ last_scan = 0;
 }
 
-// Send a broadcast message.
-int ICACHE_FLASH_ATTR NowMesh::sendBroadcast(String message, uint8_t* originator, uint16_t message_id) {
- char data[MAX_MSG_LEN];
- sprintf(data, "1,%u,%u,%u,%u,%u,%u,0,0,0,0,0,0,%u,%s",
-	 originator[0],
-	 originator[1],
-         originator[2],
-	 originator[3],
-	 originator[4],
-	 originator[5],
-	 message_id,
-	 message.c_str()
- );
- return sendMessage(NULL, data);
+uint8_t ICACHE_FLASH_ATTR NowMesh::getChannel() {
+ return channel;
 }
 
-// Send targeted message.
-int ICACHE_FLASH_ATTR NowMesh::sendTargeted(String message, uint8_t* originator, uint8_t* target, uint16_t message_id) {
- uint8_t self[6];
- wifi_get_macaddr(0, self);
- char data[MAX_MSG_LEN];
- sprintf(data, "2,%u,%u,%u,%u,%u,%u,%u,%u,%u,%u,%u,%u,%u,%s",
-	 originator[0],
-	 originator[1],
-	 originator[2],
-	 originator[3],
-	 originator[4],
-	 originator[5],
-	 target[0],
-	 target[1],
-	 target[2],
-	 target[3],
-	 target[4],
-	 target[5],
-	 message_id,
-	 message.c_str()
- );
- // Loop through stored messages, looking for messages from the target.
- for (int i = 0; message_store[i].id > 0 && i < STORED_MESSAGES; i++) {
-  // If this message originated from our target or was received directly from our target
-  if (memcmp(message_store[i].originator, target, 6) == 0 || memcmp(message_store[i].sender, target, 6) == 0) {
-   nowmeshDebug(String("Found stored message originating from or sent by the target of this message"), LEVEL_NORMAL);
-   // If we are still peered with the sender of the message.
-   if (esp_now_is_peer_exist(message_store[i].sender)) {
-    // Send the message only to the sender.
-    return sendMessage(message_store[i].sender, data);
-   }
-  }
+// Pick a channel from what a scan of every channel finds, and move to it once the scan is done.
+// If other nodes of the mesh are around, we join the channel most of them are on, so nodes started
+//  the same way end up together. If that cluster already has cluster_size nodes we can see,
+//  or no mesh is around, we take the least congested of CHANNEL_CANDIDATES instead.
+// A cluster_size of 0 never splits the mesh. Clusters on different channels can be joined
+//  with bridges, see NowMesh::setBridgeCallback.
+// Scanning every channel takes a couple of seconds, and we hear nothing meanwhile.
+void ICACHE_FLASH_ATTR NowMesh::probeChannel(uint8_t cluster_size) {
+ struct scan_config config;
+ config.ssid = NULL;
+ config.bssid = NULL;
+ // 0 scans every channel.
+ config.channel = 0;
+ // Hidden networks take airtime too.
+ config.show_hidden = 1;
+ probing = true;
+ probe_cluster_size = cluster_size;
+ if (!wifi_station_scan(&config, scanDoneCallback)) {
+  nowmeshDebug(LEVEL_ERROR, "Channel probe scan failed to start");
+  probing = false;
  }
- // If control reaches this point, we didn't find any good route, so just broadcast the message.
- return sendMessage(NULL, data);
 }
 
-// Callback when we have received a message.
-void ICACHE_FLASH_ATTR NowMesh::receiveData(unsigned char* mac, unsigned char* data, uint8_t len) {
- nowmeshDebug(String("Received raw: " + String((const char*)data)), LEVEL_NORMAL);
- nowmeshDebug(String("Receive length: " + String(len, DEC)), LEVEL_NORMAL);
- // If the message is too long, toss it out.
- // We don't wanna hang on a bad actor or transmission error.
+#if NOWMESH_BRIDGE
+// Make us one end of a bridge to another cluster, usually one on another channel.
+// The ESP8266 has one radio, so a bridge is two nodes wired together, over serial for instance:
+//  each sets a callback that hands frames to the other, which passes them to bridgeReceive.
+// Broadcasts and floods cross the bridge as they pass through, and targeted messages cross when
+//  their route leads through it. Routes through the bridge are learned from the frames it brings in,
+//  like routes through any neighbor. Frames are handed over as they are, ready for bridgeReceive.
+void ICACHE_FLASH_ATTR NowMesh::setBridgeCallback(std::function<void(const uint8_t*, size_t)> callback) {
+ bridgeCallback = callback;
+}
+
+// A frame from the other end of the bridge. It's handled as if it came over the air,
+//  from a neighbor only reached through the bridge.
+// Whatever is on the wire may not be a frame, so lengths no frame has are dropped here, before
+//  processFrame would take them modulo 256.
+void ICACHE_FLASH_ATTR NowMesh::bridgeReceive(const uint8_t* frame, size_t len) {
  if (len > MAX_MSG_LEN) {
-  nowmeshDebug("Bad message: too long", LEVEL_UNLIKELY_ERROR);
+  nowmeshDebug(LEVEL_UNLIKELY_ERROR, "Bad bridged message: too long");
+  nowmeshCount(dropped_too_long);
   return;
  }
- // Track field position
- int pos = 0;
- uint8_t message_type;
- uint8_t originator[6];
- uint8_t target[6];
- uint16_t message_id;
- // Each field is stored here
- char* token;
- // Message out.
- String message;
- // Message in. Cut it to length because it's not null terminated and there will be some garbage at the end.
- String received_message = String(reinterpret_cast<char*>(data)).substring(0, len);
- nowmeshDebug(String("Received cut: " + received_message), LEVEL_NORMAL);
- char received_buffer[MAX_MSG_LEN];
- strcpy(received_buffer, received_message.c_str());
- // Loop through one token at a time
- token = strtok(received_buffer, ",");
- while (token != NULL) {
-  switch (pos) {
-  case 0:
-   message_type = String(token).toInt();
-   break;
-  case 1:
-   originator[0] = String(token).toInt();
-   break;
-  case 2:
-   originator[1] = String(token).toInt();
-   break;
-  case 3:
-   originator[2] = String(token).toInt();
-   break;
-  case 4:
-   originator[3] = String(token).toInt();
-   break;
-  case 5:
-   originator[4] = String(token).toInt();
-   break;
-  case 6:
-   originator[5] = String(token).toInt();
-   break;
-  case 7:
-   target[0] = String(token).toInt();
-   break;
-  case 8:
-   target[1] = String(token).toInt();
-   break;
-  case 9:
-   target[2] = String(token).toInt();
-   break;
-  case 10:
-   target[3] = String(token).toInt();
-   break;
-  case 11:
-   target[4] = String(token).toInt();
-   break;
-  case 12:
-   target[5] = String(token).toInt();
-   break;
-  case 13:
-   message_id = String(token).toInt();
-   break;
-  case 14:
-   message = token;
-   break;
-  }
-  pos++;
-  token = strtok(NULL, ",");
+ if (len < sizeof(mesh_header)) {
+  nowmeshDebug(LEVEL_UNLIKELY_ERROR, "Bad bridged message: too short");
+  nowmeshCount(dropped_malformed);
+  return;
  }
- system_soft_wdt_feed();
- // If we had too many positions, give up. This will happen if there is a comma in the message sent!
- if (pos != 15) {
-  nowmeshDebug("Bad Message: too many tokens", LEVEL_UNLIKELY_ERROR);
+ bridge_inbound = true;
+ processFrame(const_cast<uint8_t*>(bridge_mac), frame, len);
+ bridge_inbound = false;
+}
+
+// Hand a frame to the other end of the bridge, unless that's where it came from.
+void ICACHE_FLASH_ATTR NowMesh::bridgeOut(const mesh_header& header, const uint8_t* message, size_t len) {
+ if (!bridgeCallback || bridge_inbound) {
   return;
  }
- uint8_t self[6];
- wifi_get_macaddr(0, self);
- if (memcmp(originator, self, 6) == 0) {
-  nowmeshDebug("We sent this message", LEVEL_NORMAL);
+ uint8_t data[MAX_MSG_LEN];
+ size_t frame_len = buildFrame(data, header, message, len);
+ if (frame_len > 0) {
+  bridgeCallback(data, frame_len);
+ }
+}
+#endif
+
+#if NOWMESH_AUTH
+// Tag every frame we send with a key the whole network shares, and drop received frames whose tag
+//  is missing or wrong before they get near the duplicate store, the routing table or the air,
+//  so a forged flood dies at the first hop. key is 16 bytes, or NULL to stop tagging.
+// ESP Now's own encryption is per peer, and the SDK only takes a few encrypted peers, so it can't
+//  cover a mesh that floods to every peer. This works at the mesh level instead.
+// The tag covers the frame and the softAP MAC of the neighbor sending it, the one the SDK reports it
+//  from, so it's checked and made again at every hop.
+//  It proves a node with the key sent the frame, it doesn't hide what's in it. Replays are only
+//  caught while the duplicate store remembers the message.
+// Nodes with different keys, or one with none, can't hear each other. Frames crossing a bridge
+//  go untagged, as the bridge's link is taken to be trusted.
+void ICACHE_FLASH_ATTR NowMesh::setNetworkKey(const uint8_t* key) {
+ authenticated = key != NULL;
+ if (authenticated) {
+  auth_key.setKey(key);
+ }
+}
+
+// Write the tag of len bytes of data, as sent by mac, after them. data must have room for it.
+void ICACHE_FLASH_ATTR NowMesh::appendTag(const uint8_t* mac, uint8_t* data, size_t len) {
+ uint64_t tag = auth_key.hash(mac, 6, data, len);
+ for (int i = 0; i < AUTH_TAG_LEN; i++) {
+  data[len + i] = tag >> (8 * i);
+ }
+}
+
+// Whether the tag after len bytes of data is right for them as sent by mac.
+// Every byte is compared, so how long this takes doesn't give away how much of a guess was right.
+bool ICACHE_FLASH_ATTR NowMesh::tagMatches(const uint8_t* mac, const uint8_t* data, size_t len) {
+ uint64_t tag = auth_key.hash(mac, 6, data, len);
+ uint8_t difference = 0;
+ for (int i = 0; i < AUTH_TAG_LEN; i++) {
+  difference |= data[len + i] ^ (uint8_t)(tag >> (8 * i));
+ }
+ return difference == 0;
+}
+#endif
+
+// Score the channels from the probe scan and move to the best one.
+// Congestion is the signal of every other AP on or near a channel, weighted by how much its
+//  channel overlaps: a 20 MHz channel spills over four channels either side of its own.
+void ICACHE_FLASH_ATTR NowMesh::probeDone(struct bss_info* ap_link) {
+ uint8_t mesh_nodes[15] = {};
+ uint32_t congestion[15] = {};
+ for (; ap_link != NULL; ap_link = STAILQ_NEXT(ap_link, next)) {
+  uint8_t ap_channel = ap_link->channel;
+  if (ap_channel < 1 || ap_channel > 14) {
+   continue;
+  }
+  if (memcmp(ap_link->ssid, "ESP_", 4) == 0) {
+   if (mesh_nodes[ap_channel] < 255) {
+    mesh_nodes[ap_channel]++;
+   }
+   continue;
+  }
+  int signal = ap_link->rssi + 100;
+  if (signal <= 0) {
+   continue;
+  }
+  for (int c = 1; c <= 14; c++) {
+   int distance = c > ap_channel ? c - ap_channel : ap_channel - c;
+   if (distance < 5) {
+    congestion[c] += (5 - distance) * signal;
+   }
+  }
+ }
+ int best = 0;
+ for (int c = 1; c <= 14; c++) {
+  if (!(CHANNEL_CANDIDATES & (1 << c)) || mesh_nodes[c] == 0) {
+   continue;
+  }
+  if (probe_cluster_size > 0 && mesh_nodes[c] >= probe_cluster_size) {
+   continue;
+  }
+  if (best == 0 || mesh_nodes[c] > mesh_nodes[best]) {
+   best = c;
+  }
+ }
+ if (best == 0) {
+  // Starting a cluster. Stay off channels other clusters are on if there's a choice.
+  for (int c = 1; c <= 14; c++) {
+   if (!(CHANNEL_CANDIDATES & (1 << c))) {
+    continue;
+   }
+   bool taken = mesh_nodes[c] > 0;
+   bool best_taken = best > 0 && mesh_nodes[best] > 0;
+   if (best == 0 || (!taken && best_taken) || (taken == best_taken && congestion[c] < congestion[best])) {
+    best = c;
+   }
+  }
+ }
+ nowmeshDebug(LEVEL_NORMAL, "Channel probe picked %d, %u nodes there, congestion %u", best, best > 0 ? mesh_nodes[best] : 0, best > 0 ? (unsigned)congestion[best] : 0);
+ if (best > 0 && best != channel) {
+  setChannel(best);
+ }
+}
+
+// Get the handles of the messages a queued frame carries.
+// That's one, unless the frame is an aggregate. handles must have room for AGGREGATE_MAX_MESSAGES.
+// Returns the number of handles.
+int ICACHE_FLASH_ATTR NowMesh::frameHandles(const tx_frame<MAX_MSG_LEN>& frame, mesh_handle* handles) {
+ if (!isAggregate(frame)) {
+  const mesh_header* header = reinterpret_cast<const mesh_header*>(frame.data);
+  memcpy(handles[0].originator, header->originator, 6);
+  handles[0].id = header->id;
+  return 1;
+ }
+ int count = 0;
+ // Each message in an aggregate is a length byte followed by a whole frame.
+ for (size_t pos = sizeof(mesh_header); pos < frame.len && count < AGGREGATE_MAX_MESSAGES; pos += 1 + frame.data[pos]) {
+  const mesh_header* header = reinterpret_cast<const mesh_header*>(frame.data + pos + 1);
+  memcpy(handles[count].originator, header->originator, 6);
+  handles[count].id = header->id;
+  count++;
+ }
+ return count;
+}
+
+// Tell the user how sending a frame went, once for each message in it.
+// The user may send from the callback, so the queue must be consistent before calling this.
+void ICACHE_FLASH_ATTR NowMesh::reportSent(const mesh_handle* handles, int count, int status) {
+ if (sendCallback) {
+  for (int i = 0; i < count; i++) {
+   sendCallback(handles[i], status);
+  }
+ }
+}
+
+// Whether a queued frame is an aggregate of several messages.
+bool ICACHE_FLASH_ATTR NowMesh::isAggregate(const tx_frame<MAX_MSG_LEN>& frame) {
+ return reinterpret_cast<const mesh_header*>(frame.data)->type == MESSAGE_AGGREGATE;
+}
+
+// Whether a frame goes to the broadcast address rather than to one peer or all of them.
+bool ICACHE_FLASH_ATTR NowMesh::isBroadcast(const tx_frame<MAX_MSG_LEN>& frame) {
+ return !frame.flood && memcmp(frame.target, broadcast_mac, 6) == 0;
+}
+
+// Priority class of a frame, from its header.
+uint8_t ICACHE_FLASH_ATTR NowMesh::frameClass(const uint8_t* data) {
+ uint8_t cls = (reinterpret_cast<const mesh_header*>(data)->flags & FLAG_PRIORITY_MASK) >> FLAG_PRIORITY_SHIFT;
+ return cls < PRIORITY_CLASSES ? cls : PRIORITY_CLASSES - 1;
+}
+
+// Pick the class whose front frame goes next, or -1 if nothing is queued.
+// That's the highest class with frames waiting, unless a lower one has been passed over
+//  TX_STARVATION_LIMIT times in a row.
+int ICACHE_FLASH_ATTR NowMesh::nextClass() {
+ int chosen = -1;
+ for (int cls = 0; cls < PRIORITY_CLASSES; cls++) {
+  if (tx_queue.size(cls) == 0) {
+   continue;
+  }
+  if (chosen < 0) {
+   chosen = cls;
+  }
+  else if (tx_skipped[cls] >= TX_STARVATION_LIMIT) {
+   return cls;
+  }
+ }
+ return chosen;
+}
+
+// Take the frame in flight off the queue, getting its handles first.
+// If it went to the broadcast address, unpeer that again so floods don't also go there.
+// Returns the number of handles.
+int ICACHE_FLASH_ATTR NowMesh::retireFrame(mesh_handle* handles) {
+ tx_frame<MAX_MSG_LEN>& frame = tx_queue.front(tx_class);
+ int count = frameHandles(frame, handles);
+ if (isBroadcast(frame)) {
+  esp_now_del_peer(const_cast<uint8_t*>(broadcast_mac));
+ }
+ tx_queue.pop(tx_class);
+ return count;
+}
+
+// Hand the next queued frame to the SDK, unless one is already in flight.
+// Called when a frame is queued and when the SDK reports one sent.
+void ICACHE_FLASH_ATTR NowMesh::pumpQueue() {
+#if NOWMESH_LEAF
+ // A sleeping leaf's radio is off, so its frames wait for it to wake up.
+ if (leaf_asleep) {
   return;
  }
- // Loop through stored messages and make sure we haven't seen this message already.
- // If we keep forwarding previously seen messages, the pipes will quickly clog.
- int msg_i = 0;
- while (msg_i < STORED_MESSAGES && message_store[msg_i].id > 0) {
-  if (message_store[msg_i].id == message_id && memcmp(message_store[msg_i].originator, originator, 6) == 0) {
-   nowmeshDebug("Message is already stored", LEVEL_NORMAL);
+#endif
+ if (tx_in_flight) {
+  if (millis() - tx_sent_at < tx_timeout) {
+   return;
+  }
+  // The SDK never reported on this frame. Give up on it so the queue doesn't stall.
+  // Its reports may still come, and mustn't be taken for the next frame's. Any still due from a
+  //  frame given up on before this one have had a whole timeout to come, so aren't counted on.
+  nowmeshDebug(LEVEL_UNLIKELY_ERROR, "Send timed out");
+  nowmeshCount(send_failures);
+  tx_stale = tx_pending;
+  mesh_handle handles[AGGREGATE_MAX_MESSAGES];
+  int count = retireFrame(handles);
+  tx_in_flight = false;
+  reportSent(handles, count, SEND_STATUS_FAIL);
+  // Reporting may have sent something, in which case we're done here.
+  if (tx_in_flight) {
    return;
   }
-  msg_i++;
- }
- nowmeshDebug(String("Stored Messages: " + String(msg_i, DEC)), LEVEL_NORMAL);
- // msg_i will hold the index of the first empty message.
- // If there are no empty messages, it will be the first address past the end of our array,
- //  so we need to store this message at the first index of the array and shift all messages to the back.
- if (msg_i == STORED_MESSAGES) {
-  msg_i--;
- }
- // Loop through message store backwards and store the next message forward here.
- for (; msg_i > 0; msg_i--) {
-  memcpy(message_store[msg_i].originator, message_store[msg_i - 1].originator, 6);
-  memcpy(message_store[msg_i].sender, message_store[msg_i - 1].sender, 6);
-  message_store[msg_i].id = message_store[msg_i - 1].id;
- }
- // Store this message as the first in the array.
- memcpy(message_store[0].originator, originator, 6);
- memcpy(message_store[0].sender, mac, 6);
- message_store[0].id = message_id;
- system_soft_wdt_feed();
- // If we are the target
- if (memcmp(target, self, 6) == 0) {
-  // Call user facing received message callback.
-  receiveCallback(message, false, originator);
  }
- else {
-  // Resend message as necessary
-  if (message_type == 1) {
-   sendBroadcast(message, originator, message_id);
+ while (tx_queue.size() > 0) {
+  int cls = nextClass();
+  tx_frame<MAX_MSG_LEN>& frame = tx_queue.front(cls);
+#if NOWMESH_AGGREGATION
+  // With aggregation on, hold the frame back for the window so more messages can join it,
+  //  unless it's already too full for another.
+  if (aggregate_window > 0 && !isBroadcast(frame) && millis() - frame.queued_at < aggregate_window && frame.len + AGGREGATE_MIN_ROOM <= MAX_MSG_LEN) {
+   return;
+  }
+#endif
+  // A flooded frame goes to every peer, and the SDK reports on each of them.
+  uint8_t peers = 1;
+  if (frame.flood) {
+   uint8_t encrypted;
+   esp_now_get_cnt_info(&peers, &encrypted);
+  }
+  // Beacons go to the broadcast address, which has to be a peer while they're in flight.
+  if (isBroadcast(frame) && !esp_now_is_peer_exist(const_cast<uint8_t*>(broadcast_mac))) {
+   esp_now_add_peer(const_cast<uint8_t*>(broadcast_mac), ESP_NOW_ROLE_SLAVE, channel, NULL, 0);
+  }
+  nowmeshDebug(LEVEL_NORMAL, "Sending message out, length: %u, priority: %u", frame.len, cls);
+  tx_class = cls;
+  for (int other = 0; other < PRIORITY_CLASSES; other++) {
+   if (other != cls && tx_queue.size(other) > 0 && tx_skipped[other] < 255) {
+    tx_skipped[other]++;
+   }
+  }
+  tx_skipped[cls] = 0;
+  uint8_t* air = frame.data;
+  uint8_t air_len = frame.len;
+#if NOWMESH_AUTH
+  // Queued frames only have room for MAX_MSG_LEN bytes, so the tag goes on a copy.
+  uint8_t tagged[MAX_AIR_LEN];
+  if (authenticated) {
+   memcpy(tagged, frame.data, frame.len);
+   // Receivers check it against the MAC the SDK says it came from, which is our softAP one.
+   appendTag(link_mac, tagged, frame.len);
+   air = tagged;
+   air_len += AUTH_TAG_LEN;
   }
-  else if (message_type == 2) {
-   sendTargeted(message, originator, target, message_id);
+#endif
+  // If target is NULL, esp_now_send will send to all peers.
+  if (peers > 0 && esp_now_send(frame.flood ? NULL : frame.target, air, air_len) == 0) {
+   tx_in_flight = true;
+   tx_pending = peers;
+   tx_sent_at = millis();
+   tx_timeout = (uint32_t)TX_TIMEOUT * peers;
+   return;
+  }
+  // We couldn't even get it out. Report it and try the next one.
+  nowmeshDebug(LEVEL_ERROR, "Send failed");
+  nowmeshCount(send_failures);
+  mesh_handle handles[AGGREGATE_MAX_MESSAGES];
+  int count = retireFrame(handles);
+  reportSent(handles, count, SEND_STATUS_FAIL);
+  if (tx_in_flight) {
+   return;
   }
-  // Call user facing received message callback.
-  receiveCallback(message, true, originator);
  }
 }
 
-// Callback for when message has been sent.
-void ICACHE_FLASH_ATTR NowMesh::sendData(unsigned char* mac_addr, unsigned char status) {
- // We don't need to do any processing, just call the user facing callback.
- sendCallback(status);
+#if NOWMESH_AGGREGATION
+// Try to add a frame to one already queued for the same destination and not yet in flight.
+// Only frames of the same priority class are packed together.
+// The queued frame becomes an aggregate if it isn't one already.
+// Returns false if no queued frame has room.
+bool ICACHE_FLASH_ATTR NowMesh::coalesce(uint8_t* target, const uint8_t* data, size_t len) {
+ uint8_t cls = frameClass(data);
+ for (int i = tx_queue.size(cls) - 1; i >= (tx_in_flight && tx_class == cls ? 1 : 0); i--) {
+  tx_frame<MAX_MSG_LEN>& frame = tx_queue.at(cls, i);
+  if (isBroadcast(frame) || frame.flood != (target == NULL) || (target != NULL && memcmp(frame.target, target, 6) != 0)) {
+   continue;
+  }
+  bool aggregate = isAggregate(frame);
+  // Turning a frame into an aggregate costs an outer header and a length byte.
+  size_t needed = 1 + len + (aggregate ? 0 : sizeof(mesh_header) + 1);
+  if (frame.len + needed > MAX_MSG_LEN) {
+   continue;
+  }
+  if (!aggregate) {
+   memmove(frame.data + sizeof(mesh_header) + 1, frame.data, frame.len);
+   frame.data[sizeof(mesh_header)] = frame.len;
+   mesh_header header;
+   header.version = NOWMESH_VERSION;
+   header.type = MESSAGE_AGGREGATE;
+   memcpy(header.originator, self_mac, 6);
+   memset(header.target, 0, 6);
+   header.id = 0;
+   header.hops = 0;
+   // The aggregate itself only goes one hop. Each message in it is forwarded on its own.
+   header.ttl = 1;
+   header.flags = cls << FLAG_PRIORITY_SHIFT;
+   memcpy(frame.data, &header, sizeof(mesh_header));
+   frame.len += sizeof(mesh_header) + 1;
+  }
+  frame.data[frame.len] = len;
+  memcpy(frame.data + frame.len + 1, data, len);
+  frame.len += 1 + len;
+  nowmeshDebug(LEVEL_NORMAL, "Aggregated message, frame length now %u", frame.len);
+#if NOWMESH_REROUTE
+  // A copy sent around a failed neighbor isn't sent again, so neither is what shares its frame.
+  frame.rerouted = frame.rerouted || rerouting;
+#endif
+  return true;
+ }
+ return false;
 }
+#endif
 
-// Debug function.
-// Debug level settings are in NowMesh.h
-void ICACHE_FLASH_ATTR NowMesh::nowmeshDebug(String message, int level) {
- if (NOWMESH_DEBUG >= level) {
-  Serial.println(message);
+// Send a message, any message...
+// Used by sendBroadcast and sendTargeted
+// The frame is queued in the class its header gives, and goes out once higher classes
+//  and the frames ahead of it in its own class have been sent.
+int ICACHE_FLASH_ATTR NowMesh::sendMessage(uint8_t* target, uint8_t* data, size_t len){
+#if NOWMESH_AGGREGATION
+ bool batching = aggregate_window > 0;
+#if NOWMESH_LEAF
+ // Everything a sleeping leaf sends waits for it to wake up anyway, so it may as well share frames.
+ batching = batching || leaf_asleep;
+#endif
+ if (batching && coalesce(target, data, len)) {
+  pumpQueue();
+  return 0;
+ }
+#endif
+ uint8_t cls = frameClass(data);
+ if (tx_queue.full()) {
+  // Make room by dropping the oldest frame that isn't already in flight,
+  //  from the lowest class no higher than this frame's.
+  int victim = -1;
+  for (int lower = PRIORITY_CLASSES - 1; lower >= cls; lower--) {
+   if (tx_queue.size(lower) > (tx_in_flight && tx_class == lower ? 1 : 0)) {
+    victim = lower;
+    break;
+   }
+  }
+  if (victim < 0) {
+   nowmeshDebug(LEVEL_ERROR, "Transmit queue full of higher priority frames");
+   nowmeshCount(tx_dropped);
+   return -1;
+  }
+  nowmeshDebug(LEVEL_ERROR, "Transmit queue full, dropping oldest frame of priority %u", victim);
+  nowmeshCount(tx_dropped);
+  bool in_flight = tx_in_flight && tx_class == victim;
+  mesh_handle handles[AGGREGATE_MAX_MESSAGES];
+  int count = frameHandles(tx_queue.oldest(victim, in_flight), handles);
+  tx_queue.dropOldest(victim, in_flight);
+  reportSent(handles, count, SEND_STATUS_DROPPED);
+  // The callback may have queued frames of its own.
+  if (tx_queue.full()) {
+   return -1;
+  }
+ }
+ tx_frame<MAX_MSG_LEN>& frame = tx_queue.push(cls);
+ // If target is NULL, the frame will be sent to all peers.
+ frame.flood = target == NULL;
+#if NOWMESH_REROUTE
+ frame.rerouted = rerouting;
+#else
+ frame.rerouted = false;
+#endif
+ if (target != NULL) {
+  memcpy(frame.target, target, 6);
  }
+ frame.len = len;
+ memcpy(frame.data, data, len);
+ frame.queued_at = millis();
+ pumpQueue();
+ return 0;
 }
 
-// User facing initialization function
-void ICACHE_FLASH_ATTR NowMesh::begin() {
- nowmeshDebug("Starting NowMesh", LEVEL_NORMAL);
- // Set opmode as access point + station
- wifi_set_opmode(3);
- // Set channel
- wifi_set_channel(CHANNEL);
- // Initialize ESP Now and register callbacks
- if (esp_now_init() == 0) {
-  nowmeshDebug("ESP Now init successful", LEVEL_NORMAL);
-  esp_now_register_send_cb(reinterpret_cast<esp_now_send_cb_t>(&NowMesh::sendData));
-  esp_now_register_recv_cb(reinterpret_cast<esp_now_recv_cb_t>(&NowMesh::receiveData));
-  esp_now_set_self_role(ESP_NOW_ROLE_SLAVE);
+// Write the header and message into data, which must hold MAX_MSG_LEN bytes.
+// Returns the frame length, or 0 if the message doesn't fit.
+size_t ICACHE_FLASH_ATTR NowMesh::buildFrame(uint8_t* data, const mesh_header& header, const uint8_t* message, size_t len) {
+ if (len > MAX_PAYLOAD_LEN) {
+  nowmeshDebug(LEVEL_ERROR, "Message too long");
+  return 0;
  }
- else {
-  nowmeshDebug("ESP Now init failed", LEVEL_ERROR);
+ memcpy(data, &header, sizeof(mesh_header));
+ memcpy(data + sizeof(mesh_header), message, len);
+ return sizeof(mesh_header) + len;
+}
+
+// Send a broadcast message.
+int ICACHE_FLASH_ATTR NowMesh::sendBroadcast(const mesh_header& header, const uint8_t* message, size_t len) {
+ uint8_t data[MAX_MSG_LEN];
+ size_t frame_len = buildFrame(data, header, message, len);
+ if (frame_len == 0) {
+  return -1;
  }
+#if NOWMESH_BRIDGE
+ bridgeOut(header, message, len);
+#endif
+#if NOWMESH_LEAF
+ // A leaf's broadcasts start out at its parent.
+ if (leaf_interval > 0 && leaf_has_parent) {
+  return sendMessage(leaf_parent, data, frame_len);
+ }
+#endif
+ return sendMessage(NULL, data, frame_len);
 }
 
-// User-facing send function for broadcast messages.
-void ICACHE_FLASH_ATTR NowMesh::send(String message) {
- last_message_id++;
- uint8_t self[6];
- wifi_get_macaddr(0, self);
- sendBroadcast(message, self, last_message_id);
+// Pass a broadcast on, as the flooding strategy says.
+// part is the broadcast's dedup part, which FLOOD_COUNTER matches copies by.
+void ICACHE_FLASH_ATTR NowMesh::rebroadcast(const mesh_header& header, const uint8_t* message, size_t len, uint8_t part) {
+#if NOWMESH_FLOOD_CONTROL
+ uint8_t mode = flood_mode;
+#if NOWMESH_BRIDGE
+ // A broadcast from the bridge only reaches this cluster through us, so it always goes on.
+ if (bridge_inbound) {
+  mode = FLOOD_ALL;
+ }
+#endif
+ // Whoever heard the originator itself passes it on, so a broadcast can't die at the first hop.
+ if (mode == FLOOD_GOSSIP && header.hops > 1 && random(100) >= flood_parameter) {
+  nowmeshDebug(LEVEL_NORMAL, "Not passing broadcast on");
+  nowmeshCount(suppressed_broadcast);
+#if NOWMESH_BRIDGE
+  // The other side of the bridge only hears it through us, so it crosses anyway.
+  bridgeOut(header, message, len);
+#endif
+  return;
+ }
+ if (mode == FLOOD_COUNTER && len <= MAX_PAYLOAD_LEN) {
+  for (int i = 0; i < FLOOD_PENDING; i++) {
+   rebroadcast_info& entry = rebroadcasts[i];
+   if (entry.used) {
+    continue;
+   }
+   entry.header = header;
+   memcpy(entry.data, message, len);
+   entry.len = len;
+   entry.part = part;
+   entry.copies = 1;
+   entry.due = millis() + 1 + random(FLOOD_DELAY);
+   entry.used = true;
+   return;
+  }
+  // No room to hold it, so it goes out now.
+ }
+#else
+ (void)part;
+#endif
+ nowmeshCount(forwarded_broadcast);
+ sendBroadcast(header, message, len);
 }
 
-// User-facing send function for targeted messages.
-void ICACHE_FLASH_ATTR NowMesh::send(String message, uint8_t* target) {
- last_message_id++;
- uint8_t self[6];
- wifi_get_macaddr(0, self);
- sendTargeted(message, self, target, last_message_id);
+#if NOWMESH_FLOOD_CONTROL
+// Choose how broadcasts are passed on. Every node rebroadcasting every broadcast to every peer costs
+//  airtime in proportion to the number of nodes, and in a dense cluster most of those copies
+//  reach nodes that already have the message.
+// FLOOD_ALL: every node rebroadcasts. The default.
+// FLOOD_GOSSIP: nodes rebroadcast with a chance of parameter percent, except those that heard
+//  the originator itself. Around 65 to 75 keeps reach high in dense meshes.
+// FLOOD_COUNTER: nodes hold a new broadcast for up to FLOOD_DELAY milliseconds and drop it if they
+//  heard it parameter times by then, counting the first. 3 is a usual choice.
+// Sparse meshes and long lines need FLOOD_ALL, since there every rebroadcast counts.
+void ICACHE_FLASH_ATTR NowMesh::setFlooding(uint8_t mode, uint8_t parameter) {
+ flood_mode = mode;
+ // Any less and FLOOD_COUNTER would drop every broadcast.
+ flood_parameter = mode == FLOOD_COUNTER && parameter < 2 ? 2 : parameter;
+}
+
+// A neighbor passed on a broadcast we are holding for FLOOD_COUNTER.
+void ICACHE_FLASH_ATTR NowMesh::copyHeard(const uint8_t* originator, uint16_t id, uint8_t part) {
+ for (int i = 0; i < FLOOD_PENDING; i++) {
+  rebroadcast_info& entry = rebroadcasts[i];
+  if (entry.used && entry.header.id == id && entry.part == part && memcmp(entry.header.originator, originator, 6) == 0) {
+   if (entry.copies < 255) {
+    entry.copies++;
+   }
+   return;
+  }
+ }
+}
+
+// Rebroadcast, or drop, the broadcasts whose delay is up.
+void ICACHE_FLASH_ATTR NowMesh::flushRebroadcasts(uint32_t now) {
+ for (int i = 0; i < FLOOD_PENDING; i++) {
+  rebroadcast_info& entry = rebroadcasts[i];
+  if (!entry.used || (int32_t)(now - entry.due) < 0) {
+   continue;
+  }
+  entry.used = false;
+  if (flood_mode == FLOOD_COUNTER && entry.copies >= flood_parameter) {
+   nowmeshDebug(LEVEL_NORMAL, "Broadcast heard %u times, not passing it on", entry.copies);
+   nowmeshCount(suppressed_broadcast);
+#if NOWMESH_BRIDGE
+   bridgeOut(entry.header, entry.data, entry.len);
+#endif
+   continue;
+  }
+  nowmeshCount(forwarded_broadcast);
+  sendBroadcast(entry.header, entry.data, entry.len);
+ }
+}
+#endif
+
+// Send targeted message.
+int ICACHE_FLASH_ATTR NowMesh::sendTargeted(const mesh_header& header, const uint8_t* message, size_t len) {
+ uint8_t data[MAX_MSG_LEN];
+ size_t frame_len = buildFrame(data, header, message, len);
+ if (frame_len == 0) {
+  return -1;
+ }
+ uint8_t* next_hop = NULL;
+#if NOWMESH_LEAF
+ // A leaf sends everything to its parent.
+ if (leaf_interval > 0 && leaf_has_parent) {
+  nowmeshCount(sent_routed);
+  return sendMessage(leaf_parent, data, frame_len);
+ }
+ // Messages for a sleeping child wait in the mailbox until it polls.
+ if (holdForChild(header.target, data, frame_len)) {
+  return 0;
+ }
+#endif
+#if NOWMESH_COLLECTION
+ // Messages for the gateway go up the collection tree.
+ if (sink.valid && memcmp(header.target, sink.sink, 6) == 0 && millis() - sink.last_heard <= SINK_TIMEOUT) {
+  nowmeshDebug(LEVEL_NORMAL, "Sending to gateway through parent, cost %u", sink.cost);
+  next_hop = sink.parent;
+ }
+#endif
+ // Otherwise look up the route to the target.
+ if (next_hop == NULL) {
+  const route_info* route = route_table.lookup(header.target, millis());
+#if NOWMESH_BRIDGE
+  // The target is on the other side of the bridge. If that's where this came from, the route is
+  //  out of date, so flood it here instead.
+  if (route != NULL && memcmp(route->next_hop, bridge_mac, 6) == 0) {
+   if (!bridge_inbound && bridgeCallback) {
+    nowmeshDebug(LEVEL_NORMAL, "Sending over the bridge, %u hops", route->hops);
+    nowmeshCount(sent_routed);
+    bridgeOut(header, message, len);
+    return 0;
+   }
+   route = NULL;
+  }
+#endif
+  if (route != NULL) {
+   nowmeshDebug(LEVEL_NORMAL, "Found route to target, %u hops", route->hops);
+   next_hop = const_cast<uint8_t*>(route->next_hop);
+  }
+ }
+ if (next_hop != NULL) {
+  // We may have heard from the next hop without peering with it. Peer with it now if we can.
+  if (esp_now_is_peer_exist(next_hop) || esp_now_add_peer(next_hop, ESP_NOW_ROLE_SLAVE, channel, NULL, 0) == 0) {
+   // Send the message only to the next hop.
+   nowmeshCount(sent_routed);
+   return sendMessage(next_hop, data, frame_len);
+  }
+ }
+#if NOWMESH_ROUTE_DISCOVERY
+ // A message of ours waits while we look for a route, rather than flooding.
+ if (next_hop == NULL && holdForRoute(header, data, frame_len)) {
+  return 0;
+ }
+#endif
+ // If control reaches this point, we didn't find any good route, so just broadcast the message.
+ nowmeshCount(sent_flooded);
+#if NOWMESH_BRIDGE
+ bridgeOut(header, message, len);
+#endif
+ return sendMessage(NULL, data, frame_len);
+}
+
+// Decode a received frame in place.
+// frame.payload points into data, nothing is copied but the header.
+// Returns false if the frame is malformed.
+bool ICACHE_FLASH_ATTR NowMesh::parseFrame(const uint8_t* data, size_t len, mesh_frame& frame) {
+ // If the message is too long, toss it out.
+ // We don't wanna hang on a bad actor or transmission error.
+ if (len > MAX_MSG_LEN) {
+  nowmeshDebug(LEVEL_UNLIKELY_ERROR, "Bad message: too long");
+  return false;
+ }
+ // Too short to even hold a header.
+ if (len < sizeof(mesh_header)) {
+  nowmeshDebug(LEVEL_UNLIKELY_ERROR, "Bad message: too short");
+  return false;
+ }
+ // The header is packed, so copying it out of the frame is all the decoding it needs.
+ memcpy(&frame.header, data, sizeof(mesh_header));
+ if (frame.header.version != NOWMESH_VERSION) {
+  nowmeshDebug(LEVEL_UNLIKELY_ERROR, "Bad message: unknown version");
+  return false;
+ }
+ if (frame.header.type < MESSAGE_BROADCAST || frame.header.type > MESSAGE_TRACE) {
+  nowmeshDebug(LEVEL_UNLIKELY_ERROR, "Bad message: unknown type");
+  return false;
+ }
+ // The message is everything after the header.
+ frame.payload = data + sizeof(mesh_header);
+ frame.len = len - sizeof(mesh_header);
+ return true;
+}
+
+// Callback when we have received a message.
+// This runs in the WiFi task, so all it does is copy the frame into the receive queue.
+// NowMesh::loop does the rest.
+void ICACHE_FLASH_ATTR NowMesh::handleReceive(unsigned char* mac, unsigned char* data, uint8_t len) {
+#if NOWMESH_STATS
+ uint32_t started = micros();
+#endif
+ nowmeshCount(frames_received);
+ // If the message is too long, toss it out now, it wouldn't fit in the queue anyway.
+ if (len > MAX_AIR_LEN) {
+  nowmeshDebug(LEVEL_UNLIKELY_ERROR, "Bad message: too long");
+  nowmeshCount(dropped_too_long);
+ }
+ else if (!rx_queue.push(mac, data, len)) {
+  nowmeshDebug(LEVEL_ERROR, "Receive queue full, dropping frame");
+  nowmeshCount(dropped_rx_full);
+ }
+#if NOWMESH_STATS
+ stats.receive_time += micros() - started;
+#endif
+}
+
+// Check a received frame's tag, if we have a network key, and handle it if it's good.
+void ICACHE_FLASH_ATTR NowMesh::receiveFrame(uint8_t* mac, const uint8_t* data, uint8_t len) {
+#if NOWMESH_AUTH
+ if (authenticated) {
+  if (len < sizeof(mesh_header) + AUTH_TAG_LEN || !tagMatches(mac, data, len - AUTH_TAG_LEN)) {
+   nowmeshDebug(LEVEL_ERROR, "Bad message: missing or wrong tag");
+   nowmeshCount(dropped_unauthenticated);
+   return;
+  }
+  len -= AUTH_TAG_LEN;
+ }
+#endif
+ processFrame(mac, data, len);
+}
+
+// Handle a received frame: remember it, forward it and hand it to the user.
+// Called from NowMesh::loop. Nothing in here allocates.
+// (A String receive callback still builds its String, use setMessageCallback to avoid that.)
+void ICACHE_FLASH_ATTR NowMesh::processFrame(uint8_t* mac, const uint8_t* data, uint8_t len) {
+ nowmeshDebug(LEVEL_NORMAL, "Receive length: %u", len);
+ mesh_frame frame;
+ if (!parseFrame(data, len, frame)) {
+  nowmeshCount(dropped_malformed);
+  return;
+ }
+ nowmeshCount(frames_parsed);
+ mesh_header& header = frame.header;
+ if (memcmp(header.originator, self_mac, 6) == 0) {
+  nowmeshDebug(LEVEL_NORMAL, "We sent this message");
+  nowmeshCount(dropped_self);
+#if NOWMESH_FRAGMENTATION
+  // A neighbor passing on the broadcast fragment we last sent, so its flood hasn't died down yet.
+  if (tx_fragments_left > 0 && (header.flags & FLAG_FRAGMENT) && header.id == tx_fragment_header.id) {
+   tx_fragment_at = millis();
+  }
+#endif
+  return;
+ }
+ // Every frame tells us the neighbor that sent it is there and how to reach its originator,
+ //  even if we've seen the message before.
+ uint32_t now = millis();
+#if NOWMESH_BRIDGE
+ // Frames from the bridge teach us routes through it, but it's no neighbor.
+ if (bridge_inbound) {
+  route_table.update(header.originator, mac, header.hops + 1, now);
+ }
+ else
+#endif
+ {
+  learnPeer(mac, now);
+  // mac is the neighbor's softAP MAC, which nothing is addressed to, so only the originator gets a route.
+  route_table.update(header.originator, mac, header.hops + 1, now);
+#if NOWMESH_ROUTE_DISCOVERY
+  routeLearned(header.originator, now);
+#endif
+ }
+#if NOWMESH_LEAF
+ // A leaf stays up while its parent has things for it.
+ if (leaf_interval > 0 && memcmp(mac, leaf_parent, 6) == 0) {
+  leaf_heard_at = now;
+ }
+#endif
+ // That's all a beacon is for.
+ if (header.type == MESSAGE_BEACON) {
+  return;
+ }
+ // A child of ours woke up, or our parent answered. Polls and replies only ever go one hop, and a
+ //  leaf only knows its parent as a peer, so they're addressed to the softAP MAC.
+ if (header.type == MESSAGE_POLL || header.type == MESSAGE_POLL_REPLY) {
+#if NOWMESH_LEAF
+  bool for_us = memcmp(header.target, link_mac, 6) == 0;
+  // Leaves take no children, so a leaf that polls one never hears back and moves on.
+  if (header.type == MESSAGE_POLL && for_us && leaf_interval == 0 && frame.len >= sizeof(leaf_poll)) {
+   leaf_poll poll;
+   memcpy(&poll, frame.payload, sizeof(leaf_poll));
+   childPolled(mac, header.originator, poll, now);
+  }
+  if (header.type == MESSAGE_POLL_REPLY && for_us && leaf_interval > 0 && frame.len >= sizeof(poll_reply)) {
+   leaf_answered = true;
+   leaf_held = frame.payload[0];
+  }
+#endif
+  return;
+ }
+ // A neighbor telling us its way to a gateway. These only ever go one hop.
+ if (header.type == MESSAGE_SINK) {
+#if NOWMESH_COLLECTION
+  if (frame.len >= sizeof(sink_advert)) {
+   sink_advert advert;
+   memcpy(&advert, frame.payload, sizeof(sink_advert));
+   sinkAdvertReceived(mac, advert, now);
+  }
+#endif
+  return;
+ }
+ // Split an aggregate up and handle each message in it as if it came in its own frame.
+ if (header.type == MESSAGE_AGGREGATE) {
+  size_t pos = 0;
+  while (pos < frame.len) {
+   uint8_t sub_len = frame.payload[pos];
+   if (pos + 1 + sub_len > frame.len) {
+    nowmeshDebug(LEVEL_UNLIKELY_ERROR, "Bad message: aggregate overruns frame");
+    nowmeshCount(dropped_malformed);
+    return;
+   }
+   const uint8_t* sub = frame.payload + pos + 1;
+   // Aggregates don't nest.
+   if (sub_len >= sizeof(mesh_header) && reinterpret_cast<const mesh_header*>(sub)->type != MESSAGE_AGGREGATE) {
+    processFrame(mac, sub, sub_len);
+   }
+   pos += 1 + sub_len;
+  }
+  return;
+ }
+ // Fragments of one message share its id, so tell them apart by index.
+ // Retransmissions of a reliable message share its id too, so tell those apart by attempt,
+ //  and so do the ACKs for them, which take the id of the message they acknowledge.
+ const fragment_header* fragment = NULL;
+ uint8_t part = 0;
+ if (header.flags & FLAG_FRAGMENT) {
+  if (frame.len < sizeof(fragment_header)) {
+   nowmeshDebug(LEVEL_UNLIKELY_ERROR, "Bad message: fragment too short");
+   nowmeshCount(dropped_malformed);
+   return;
+  }
+  fragment = reinterpret_cast<const fragment_header*>(frame.payload);
+  part = fragment->index;
+ }
+ else if (header.type == MESSAGE_ACK) {
+  part = PART_ACK | (header.flags >> FLAG_ATTEMPT_SHIFT);
+ }
+ else if (header.flags & FLAG_ACK_REQUEST) {
+  part = PART_RELIABLE | (header.flags >> FLAG_ATTEMPT_SHIFT);
+ }
+ // Make sure we haven't seen this message already.
+ // If we keep forwarding previously seen messages, the pipes will quickly clog.
+ if (message_store.contains(header.originator, header.id, part)) {
+  nowmeshDebug(LEVEL_NORMAL, "Message is already stored");
+  nowmeshCount(dropped_duplicate);
+  nowmeshTrace(TRACE_DUPLICATE, header, mac, 0);
+#if NOWMESH_FLOOD_CONTROL
+  copyHeard(header.originator, header.id, part);
+#endif
+  return;
+ }
+ // Remember it. Once the store is full this forgets the oldest message.
+ message_store.insert(header.originator, mac, header.id, part);
+ nowmeshDebug(LEVEL_NORMAL, "Stored Messages: %d", message_store.size());
+ nowmeshTrace(TRACE_RECEIVE, header, mac, 0);
+ bool self_is_target = memcmp(header.target, self_mac, 6) == 0;
+ // Resend message as necessary. The payload is forwarded straight out of the received frame.
+ // A ttl of 1 means this was the last hop it was allowed.
+ bool forward = !self_is_target && header.ttl > 1;
+#if NOWMESH_LEAF
+ // Leaves are asleep most of the time, so they forward nothing.
+ forward = forward && leaf_interval == 0;
+ // For the same reason, parents answer route requests for their children instead of passing them on.
+ bool answer_for_child = header.type == MESSAGE_ROUTE_REQUEST && leaf_interval == 0 && isChild(header.target);
+ forward = forward && !answer_for_child;
+#endif
+ if (forward) {
+  mesh_header forward = header;
+  forward.hops++;
+  forward.ttl--;
+  nowmeshTrace(TRACE_FORWARD, header, NULL, 0);
+  if (header.type == MESSAGE_BROADCAST) {
+   rebroadcast(forward, frame.payload, frame.len, part);
+  }
+  else if (header.type == MESSAGE_ROUTE_REQUEST) {
+   floodRouteRequest(forward);
+  }
+  else {
+   nowmeshCount(forwarded_targeted);
+   sendTargeted(forward, frame.payload, frame.len);
+  }
+ }
+ // Route requests and replies have done most of their job by getting here.
+ if (header.type == MESSAGE_ROUTE_REQUEST || header.type == MESSAGE_ROUTE_REPLY) {
+  if (header.type == MESSAGE_ROUTE_REQUEST && self_is_target) {
+   sendRouteReply(header);
+  }
+#if NOWMESH_LEAF
+  if (answer_for_child) {
+   sendRouteReply(header);
+  }
+#endif
+  // A parent's reply for its child is a route to the child too, one hop past the parent.
+  if (header.type == MESSAGE_ROUTE_REPLY && frame.len >= sizeof(route_reply)) {
+   route_reply reply;
+   memcpy(&reply, frame.payload, sizeof(route_reply));
+   if (memcmp(reply.target, header.originator, 6) != 0) {
+    route_table.update(reply.target, mac, header.hops + 2, now);
+#if NOWMESH_ROUTE_DISCOVERY
+    routeLearned(reply.target, now);
+#endif
+   }
+  }
+  return;
+ }
+ if (header.type == MESSAGE_ACK) {
+#if NOWMESH_RELIABLE
+  if (self_is_target) {
+   ackReceived(header.originator, header.id, now);
+  }
+#endif
+  return;
+ }
+ if (header.type == MESSAGE_TRACE) {
+#if NOWMESH_TRACE
+  if (self_is_target && traceCallback && frame.len >= sizeof(trace_batch)) {
+   traceCallback(frame.payload, frame.len);
+  }
+#endif
+  return;
+ }
+ if (header.type == MESSAGE_STATS) {
+#if NOWMESH_STATS
+  if (self_is_target && statsCallback && frame.len >= sizeof(mesh_stats)) {
+   mesh_stats report;
+   memcpy(&report, frame.payload, sizeof(mesh_stats));
+   statsCallback(header.originator, report);
+  }
+#endif
+  return;
+ }
+ // The originator wants to know this reached us. Acknowledge every attempt that does,
+ //  since the ACK for an earlier one may have been lost, but only deliver it once.
+ if ((header.flags & FLAG_ACK_REQUEST) && self_is_target) {
+  sendAck(header);
+  if (message_store.contains(header.originator, header.id, PART_DELIVERED)) {
+   nowmeshDebug(LEVEL_NORMAL, "Reliable message already delivered");
+   return;
+  }
+  message_store.insert(header.originator, mac, header.id, PART_DELIVERED);
+ }
+ mesh_message message;
+ message.data = frame.payload;
+ message.len = frame.len;
+ // Fragments are forwarded as they are. Only their destination puts them back together,
+ //  and the user only hears about the message once it's complete.
+ if (fragment != NULL) {
+  if (!self_is_target && header.type != MESSAGE_BROADCAST) {
+   return;
+  }
+#if NOWMESH_FRAGMENTATION
+  size_t message_len;
+  message.data = reassembly.add(header.originator, header.id, fragment->index, fragment->count, frame.payload + sizeof(fragment_header), frame.len - sizeof(fragment_header), now, message_len);
+  if (message.data == NULL) {
+   return;
+  }
+  nowmeshDebug(LEVEL_NORMAL, "Reassembled message, length: %u", (unsigned)message_len);
+  message.len = message_len;
+#else
+  nowmeshDebug(LEVEL_ERROR, "Can't reassemble message, fragmentation is off");
+  return;
+#endif
+ }
+ if (self_is_target || header.type == MESSAGE_BROADCAST) {
+  nowmeshTrace(TRACE_DELIVER, header, NULL, 0);
+ }
+ // Call user facing received message callback.
+ // The message points into the received frame or reassembly buffer, so there is no copy.
+ if (messageCallback) {
+  message.self_is_target = self_is_target;
+  message.originator = header.originator;
+  message.id = header.id;
+  message.hops = header.hops + 1;
+  messageCallback(message);
+ }
+#if NOWMESH_FRAGMENTATION
+ if (fragment != NULL) {
+  reassembly.release(message.data);
+ }
+#endif
+}
+
+// Callback for when message has been sent.
+void ICACHE_FLASH_ATTR NowMesh::handleSent(unsigned char* mac_addr, unsigned char status) {
+ updateDelivery(mac_addr, status == SEND_STATUS_OK);
+ // A late report for a frame we already gave up on. It says nothing about the frame in flight, or
+ //  about the routes it took.
+ if (!tx_in_flight || isStaleReport(mac_addr)) {
+  return;
+ }
+#if NOWMESH_REROUTE
+ // A frame for one neighbor that didn't make it, even with the radio's own retries, is copied out
+ //  before it's retired, and sent again around that neighbor. Only once, so a frame nobody can take
+ //  doesn't go round forever.
+ // Floods go to every peer, where collisions are common and the other copies likely got through.
+ uint8_t retry[MAX_MSG_LEN];
+ size_t retry_len = 0;
+ // mac_addr may point into the frame, which is gone by the time we send the copy.
+ uint8_t failed[6];
+ memcpy(failed, mac_addr, 6);
+ if (!tx_queue.front(tx_class).flood && !isBroadcast(tx_queue.front(tx_class))) {
+  tx_frame<MAX_MSG_LEN>& frame = tx_queue.front(tx_class);
+  if (status == SEND_STATUS_OK) {
+   int i = findPeer(mac_addr);
+   if (i >= 0) {
+    peer_store[i].failures = 0;
+   }
+  }
+  else {
+   linkFailed(mac_addr);
+   if (!frame.rerouted) {
+    retry_len = frame.len;
+    memcpy(retry, frame.data, frame.len);
+   }
+  }
+ }
+#elif NOWMESH_ROUTE_DISCOVERY
+ // A routed frame didn't make it to the next hop, even with the radio's own retries, so the link
+ //  is down, at least for now. Don't route anything more that way until we hear from it again.
+ // Floods go to every peer, where collisions are common and the other copies likely got through.
+ if (status != SEND_STATUS_OK && !tx_queue.front(tx_class).flood) {
+#if NOWMESH_STATS
+  stats.routes_broken += route_table.invalidate(mac_addr, millis());
+#else
+  route_table.invalidate(mac_addr, millis());
+#endif
+ }
+#endif
+ mesh_handle handles[AGGREGATE_MAX_MESSAGES];
+ int count;
+#if NOWMESH_TRACE
+ if (tracing) {
+  traceSent(tx_queue.front(tx_class), mac_addr, status);
+ }
+#endif
+ // Once every peer it went to has reported, the frame is done and the next one can go.
+ bool done = --tx_pending == 0;
+ if (done) {
+  count = retireFrame(handles);
+  tx_in_flight = false;
+ }
+ else {
+  count = frameHandles(tx_queue.front(tx_class), handles);
+ }
+#if NOWMESH_REROUTE
+ // The messages in it are reported once the copy has been sent, or has failed too.
+ if (retry_len > 0) {
+  rerouteFrame(retry, retry_len, failed, status);
+ }
+ else
+#endif
+ reportSent(handles, count, status);
+ if (done) {
+#if NOWMESH_FRAGMENTATION
+  feedFragments();
+#endif
+  pumpQueue();
+ }
+}
+
+// Whether a send report is for a frame we gave up on, not the one in flight.
+// The SDK reports in the order frames were sent, so the reports still due for frames we gave up on come
+//  first. A frame for one neighbor can only be reported by that neighbor, which catches the rest.
+bool ICACHE_FLASH_ATTR NowMesh::isStaleReport(const uint8_t* mac) {
+ if (tx_stale > 0) {
+  tx_stale--;
+  return true;
+ }
+ const tx_frame<MAX_MSG_LEN>& frame = tx_queue.front(tx_class);
+ return !frame.flood && memcmp(frame.target, mac, 6) != 0;
+}
+
+#if NOWMESH_REROUTE
+// A routed frame failed to reach this neighbor. A single failure may be a collision, so routes
+//  through it are only given up on after LINK_FAILURES in a row, or if it's no longer a peer at all.
+void ICACHE_FLASH_ATTR NowMesh::linkFailed(const uint8_t* mac) {
+ int i = findPeer(mac);
+ if (i >= 0 && peer_store[i].failures < 255) {
+  peer_store[i].failures++;
+ }
+ if (i < 0 || peer_store[i].failures >= LINK_FAILURES) {
+  nowmeshDebug(LEVEL_NORMAL, "Link failed, dropping routes through it");
+#if NOWMESH_STATS
+  stats.routes_broken += route_table.invalidate(mac, millis());
+#else
+  route_table.invalidate(mac, millis());
+#endif
+ }
+}
+
+// Send the messages in a frame that failed to reach failed again, each on its own.
+// status is what the failure is reported with for messages that can't be sent again.
+void ICACHE_FLASH_ATTR NowMesh::rerouteFrame(uint8_t* data, size_t len, const uint8_t* failed, int status) {
+ if (reinterpret_cast<const mesh_header*>(data)->type != MESSAGE_AGGREGATE) {
+  rerouteMessage(data, len, failed, status);
+  return;
+ }
+ // Each message in an aggregate is a length byte followed by a whole frame.
+ for (size_t pos = sizeof(mesh_header); pos + 1 + sizeof(mesh_header) <= len && pos + 1 + data[pos] <= len; pos += 1 + data[pos]) {
+  rerouteMessage(data + pos + 1, data[pos], failed, status);
+ }
+}
+
+// Send a message that failed to reach failed again. Through the route's alternate next hop if it has
+//  one, otherwise as sendTargeted would now, which once the link is given up on means looking for
+//  another route, or flooding.
+// Only routed messages are sent again. Others are for that neighbor alone, and are reported failed.
+void ICACHE_FLASH_ATTR NowMesh::rerouteMessage(uint8_t* data, size_t len, const uint8_t* failed, int status) {
+ mesh_header header;
+ memcpy(&header, data, sizeof(mesh_header));
+ mesh_handle handle;
+ memcpy(handle.originator, header.originator, 6);
+ handle.id = header.id;
+ bool routed = header.type == MESSAGE_TARGETED || header.type == MESSAGE_ACK || header.type == MESSAGE_STATS || header.type == MESSAGE_ROUTE_REPLY || header.type == MESSAGE_TRACE;
+ if (!routed) {
+  reportSent(&handle, 1, status);
+  return;
+ }
+ nowmeshDebug(LEVEL_NORMAL, "Sending failed message again");
+ nowmeshCount(rerouted);
+ rerouting = true;
+ int result;
+ uint8_t around[6];
+ const uint8_t* next_hop = route_table.nextHopAvoiding(header.target, failed, millis());
+ if (next_hop != NULL) {
+  memcpy(around, next_hop, 6);
+ }
+ if (next_hop != NULL && (esp_now_is_peer_exist(around) || esp_now_add_peer(around, ESP_NOW_ROLE_SLAVE, channel, NULL, 0) == 0)) {
+  nowmeshCount(sent_routed);
+  result = sendMessage(around, data, len);
+ }
+ else {
+  result = sendTargeted(header, data + sizeof(mesh_header), len - sizeof(mesh_header));
+ }
+ rerouting = false;
+ // There was no room to send it again, so it failed after all.
+ if (result < 0) {
+  reportSent(&handle, 1, status);
+ }
+}
+#endif
+
+// User facing pump, which must be called from the sketch's loop().
+// Processes up to RX_BUDGET received frames, so a burst can't hold up the sketch for long,
+//  and retires a frame in flight if the SDK never reported on it.
+void ICACHE_FLASH_ATTR NowMesh::loop() {
+#if NOWMESH_LEAF
+ // Nothing to do while we're a sleeping leaf.
+ if (leaf_interval > 0 && !leafAwake(millis())) {
+  return;
+ }
+ serviceChildren(millis());
+#endif
+ for (int i = 0; i < RX_BUDGET && rx_queue.size() > 0; i++) {
+  rx_frame<MAX_AIR_LEN>& frame = rx_queue.front();
+  // The frame stays in the queue while it's processed, since the message callback gets a pointer into it.
+#if NOWMESH_STATS
+  uint32_t started = micros();
+  receiveFrame(frame.mac, frame.data, frame.len);
+  stats.process_time += micros() - started;
+#else
+  receiveFrame(frame.mac, frame.data, frame.len);
+#endif
+  rx_queue.pop();
+ }
+#if NOWMESH_COLLECTION
+ if (gateway && (int32_t)(millis() - last_sink_advert) >= SINK_INTERVAL) {
+  sendSinkAdvert(self_mac, ++sink_sequence, 0);
+  // Jitter the interval, so advertisements don't keep landing on top of beacons sent on the same schedule.
+  last_sink_advert = millis() + random(SINK_JITTER);
+ }
+ if (sink_advert_due && (int32_t)(millis() - sink_advert_at) >= 0) {
+  sink_advert_due = false;
+  sendSinkAdvert(sink.sink, sink.sequence, sink.cost);
+ }
+#endif
+#if NOWMESH_TRACE
+ if (trace_interval > 0 && trace_buffer.size() > 0 && millis() - last_trace >= trace_interval) {
+  sendTrace();
+  last_trace = millis();
+ }
+#endif
+#if NOWMESH_STATS
+ if (stats_interval > 0 && millis() - last_stats >= stats_interval) {
+  sendStats();
+  last_stats = millis();
+ }
+#endif
+#if NOWMESH_RELIABLE
+ retryPending(millis());
+#endif
+#if NOWMESH_ROUTE_DISCOVERY
+ serviceDiscoveries(millis());
+#endif
+#if NOWMESH_PERSIST
+ if (persistent && (int32_t)(millis() - state_due) >= 0) {
+  saveState(false);
+  state_due = millis() + STATE_SAVE_INTERVAL;
+ }
+#endif
+#if NOWMESH_FLOOD_CONTROL
+ flushRebroadcasts(millis());
+#endif
+#if NOWMESH_FRAGMENTATION
+ feedFragments();
+#endif
+ pumpQueue();
+ if (discovery) {
+  uint32_t now = millis();
+  if (now - last_beacon >= BEACON_INTERVAL) {
+   sendBeacon();
+   last_beacon = now;
+  }
+  // Scanning takes the radio off channel for a while, so only do it when traffic and beacons
+  //  haven't found us enough neighbors.
+  if (!probing && neighborCount(now) < MIN_NEIGHBORS && (last_scan == 0 || now - last_scan >= SCAN_BACKOFF)) {
+   nowmeshDebug(LEVEL_NORMAL, "Too few neighbors, scanning");
+   scanForPeers();
+   last_scan = now;
+  }
+ }
+}
+
+// Turn passive neighbor discovery on or off.
+// When it's on, NowMesh::loop sends a beacon every BEACON_INTERVAL and only scans
+//  when fewer than MIN_NEIGHBORS neighbors have been heard from, so there's no need to call scanForPeers.
+void ICACHE_FLASH_ATTR NowMesh::setDiscovery(bool enabled) {
+ discovery = enabled;
+}
+
+#if NOWMESH_AGGREGATION
+// Turn message aggregation on or off.
+// When window is more than 0, frames wait in the transmit queue for up to window milliseconds,
+//  and messages queued meanwhile for the same next hop are packed into the same frame.
+// This trades a little latency for far fewer frames when sending lots of small messages.
+void ICACHE_FLASH_ATTR NowMesh::setAggregation(uint16_t window) {
+ aggregate_window = window;
+}
+#endif
+
+#if NOWMESH_STATS
+// A snapshot of the counters.
+mesh_stats ICACHE_FLASH_ATTR NowMesh::getStats() {
+ stats.tx_high_water = tx_queue.highWater();
+ return stats;
+}
+
+// Send our stats to collector every interval milliseconds, as a targeted message.
+// Pass 0 to stop. The collector gets them through its stats callback rather than its message callback.
+void ICACHE_FLASH_ATTR NowMesh::setStatsReporting(uint8_t* collector, uint32_t interval) {
+ memcpy(stats_collector, collector, 6);
+ stats_interval = interval;
+}
+
+// The stats callback gets the originator's MAC address and its stats.
+void ICACHE_FLASH_ATTR NowMesh::setStatsCallback(std::function<void(const uint8_t*, const mesh_stats&)> callback) {
+ statsCallback = callback;
+}
+
+// Send our stats to the collector. They're only telemetry, so they go at PRIORITY_BULK.
+void ICACHE_FLASH_ATTR NowMesh::sendStats() {
+ mesh_header header;
+ newHeader(header, stats_collector, DEFAULT_MAX_HOPS, PRIORITY_BULK);
+ header.type = MESSAGE_STATS;
+ mesh_stats report = getStats();
+ sendTargeted(header, reinterpret_cast<const uint8_t*>(&report), sizeof(report));
+}
+#endif
+
+#if NOWMESH_TRACE
+// Start or stop recording trace events: messages we originate, receive, get copies of, forward,
+//  hand the SDK and deliver, each with micros(), the message's originator, id and hops, and the neighbor
+//  involved. Recording one copies 22 bytes into a buffer, nothing is formatted or written,
+//  so it hardly changes the timing it measures. Beacons and other one hop frames aren't recorded.
+// Get the events out with readTrace, or send them to a collector with setTraceReporting.
+//  extras/trace/nowmesh_trace.py puts the events of many nodes together, message by message.
+void ICACHE_FLASH_ATTR NowMesh::setTracing(bool enabled) {
+ tracing = enabled;
+}
+
+// Move as many of the oldest events as fit into buffer, after a trace_batch saying whose they are.
+// Returns the bytes written, 0 if there were no events or buffer couldn't hold one.
+// Writing the result somewhere that doesn't block keeps tracing asynchronous, for instance
+//  mesh.readTrace(buffer, min(sizeof(buffer), Serial.availableForWrite())) each time round the loop.
+size_t ICACHE_FLASH_ATTR NowMesh::readTrace(uint8_t* buffer, size_t len) {
+ if (len < sizeof(trace_batch) + sizeof(trace_event) || trace_buffer.size() == 0) {
+  return 0;
+ }
+ size_t room = (len - sizeof(trace_batch)) / sizeof(trace_event);
+ trace_batch batch;
+ batch.sync = TRACE_SYNC;
+ memcpy(batch.node, self_mac, 6);
+ memcpy(batch.link, link_mac, 6);
+ batch.sequence = trace_sequence++;
+ batch.count = trace_buffer.pop(reinterpret_cast<trace_event*>(buffer + sizeof(trace_batch)), room < 255 ? room : 255);
+ memcpy(buffer, &batch, sizeof(trace_batch));
+ return sizeof(trace_batch) + batch.count * sizeof(trace_event);
+}
+
+// Send recorded events to a collector every interval milliseconds, up to TRACE_FRAME_EVENTS of them
+//  a frame, or stop with an interval of 0. The collector can be us.
+// Those frames share the air with everything else, so on a big or busy mesh use a long interval,
+//  or readTrace where there's a wire.
+void ICACHE_FLASH_ATTR NowMesh::setTraceReporting(uint8_t* collector, uint32_t interval) {
+ memcpy(trace_collector, collector, 6);
+ trace_interval = interval;
+}
+
+// The trace callback gets each batch of events sent to us as collector, a trace_batch followed by its
+//  events, the same as readTrace gives. Write it out as is for nowmesh_trace.py.
+void ICACHE_FLASH_ATTR NowMesh::setTraceCallback(std::function<void(const uint8_t*, size_t)> callback) {
+ traceCallback = callback;
+}
+
+void ICACHE_FLASH_ATTR NowMesh::traceEvent(uint8_t event, const mesh_header& header, const uint8_t* peer, uint8_t status) {
+ // Trace frames would trace themselves, and the rest only ever go one hop.
+ if (header.type == MESSAGE_BEACON || header.type == MESSAGE_SINK || header.type == MESSAGE_POLL || header.type == MESSAGE_POLL_REPLY || header.type == MESSAGE_TRACE || header.type == MESSAGE_AGGREGATE) {
+  return;
+ }
+ trace_event entry;
+ entry.time = micros();
+ entry.event = event;
+ entry.type = header.type;
+ memcpy(entry.originator, header.originator, 6);
+ entry.id = header.id;
+ entry.hops = header.hops;
+ if (peer != NULL) {
+  memcpy(entry.peer, peer, 6);
+ }
+ else {
+  memset(entry.peer, 0, 6);
+ }
+ entry.status = status;
+ if (!trace_buffer.push(entry)) {
+  nowmeshCount(trace_dropped);
+ }
+}
+
+// Record a send report for every message in the frame.
+void ICACHE_FLASH_ATTR NowMesh::traceSent(const tx_frame<MAX_MSG_LEN>& frame, const uint8_t* peer, uint8_t status) {
+ if (!isAggregate(frame)) {
+  traceEvent(TRACE_SENT, *reinterpret_cast<const mesh_header*>(frame.data), peer, status);
+  return;
+ }
+ // Each message in an aggregate is a length byte followed by a whole frame.
+ for (size_t pos = sizeof(mesh_header); pos + 1 + sizeof(mesh_header) <= frame.len; pos += 1 + frame.data[pos]) {
+  mesh_header header;
+  memcpy(&header, frame.data + pos + 1, sizeof(mesh_header));
+  traceEvent(TRACE_SENT, header, peer, status);
+ }
+}
+
+// Send the collector a frame of the oldest events. They're only telemetry, so they go at PRIORITY_BULK.
+void ICACHE_FLASH_ATTR NowMesh::sendTrace() {
+ uint8_t payload[sizeof(trace_batch) + TRACE_FRAME_EVENTS * sizeof(trace_event)];
+ size_t len = readTrace(payload, sizeof(payload));
+ if (len == 0) {
+  return;
+ }
+ if (memcmp(trace_collector, self_mac, 6) == 0) {
+  if (traceCallback) {
+   traceCallback(payload, len);
+  }
+  return;
+ }
+ mesh_header header;
+ newHeader(header, trace_collector, DEFAULT_MAX_HOPS, PRIORITY_BULK);
+ header.type = MESSAGE_TRACE;
+ sendTargeted(header, payload, len);
+}
+#endif
+
+#if NOWMESH_COLLECTION
+// Make us the gateway, or stop being it.
+// A gateway advertises itself every SINK_INTERVAL. Every other node keeps a parent, the neighbor with
+//  the cheapest way to the gateway, and messages for the gateway go to the parent, one unicast per hop.
+// That makes many-to-one traffic cost about one frame per hop, instead of a flood per message.
+void ICACHE_FLASH_ATTR NowMesh::setGateway(bool enabled) {
+ gateway = enabled;
+ sink.valid = false;
+ sink_advert_due = false;
+ // Advertise right away.
+ last_sink_advert = millis() - SINK_INTERVAL;
+}
+
+// Get the MAC address of the gateway we send to, which is our own if we're the gateway.
+// Returns false if we don't know of one.
+bool ICACHE_FLASH_ATTR NowMesh::getGateway(uint8_t* mac) {
+ if (gateway) {
+  memcpy(mac, self_mac, 6);
+  return true;
+ }
+ if (!sink.valid || millis() - sink.last_heard > SINK_TIMEOUT) {
+  return false;
+ }
+ memcpy(mac, sink.sink, 6);
+ return true;
+}
+
+// User-facing send function for reports to the gateway.
+// Returns a handle with id 0 if we don't know of a gateway, or are it.
+mesh_handle ICACHE_FLASH_ATTR NowMesh::sendToGateway(const uint8_t* message, size_t len, uint8_t priority) {
+ uint8_t target[6];
+ if (gateway || !getGateway(target)) {
+  nowmeshDebug(LEVEL_ERROR, "No gateway to send to");
+  mesh_handle handle;
+  memcpy(handle.originator, self_mac, 6);
+  handle.id = 0;
+  return handle;
+ }
+ return send(message, len, target, DEFAULT_MAX_HOPS, priority);
+}
+
+// What a hop to this neighbor costs. SINK_HOP_COST, plus up to 7 more the fewer of our frames it
+//  acknowledges, plus one for every dB its signal is below -60 dBm.
+uint16_t ICACHE_FLASH_ATTR NowMesh::linkCost(const uint8_t* mac) {
+ int i = findPeer(mac);
+ if (i < 0) {
+  return 2 * SINK_HOP_COST;
+ }
+ const peer_info& peer = peer_store[i];
+ int16_t weak = -60 * 16 - peer.rssi;
+ return SINK_HOP_COST + (255 - peer.delivery) / 32 + (weak > 0 ? weak / 16 : 0);
+}
+
+// A neighbor advertised its way to a gateway.
+// A newer advertisement from our gateway always gets adopted, so the tree is rebuilt from the
+//  gateway outwards every round, and we pass it on after a little jitter, with our own cost.
+// Within a round, and between gateways, we only switch to a parent that is clearly cheaper.
+void ICACHE_FLASH_ATTR NowMesh::sinkAdvertReceived(const uint8_t* mac, const sink_advert& advert, uint32_t now) {
+ if (gateway) {
+  return;
+ }
+ uint16_t cost = advert.cost + linkCost(mac);
+ bool known = sink.valid && now - sink.last_heard <= SINK_TIMEOUT;
+ bool same_sink = known && memcmp(sink.sink, advert.sink, 6) == 0;
+ int16_t newer = (int16_t)(advert.sequence - sink.sequence);
+ bool cheaper = cost + SINK_HYSTERESIS < sink.cost;
+ if (!known || (same_sink && newer > 0) || (!same_sink && cheaper)) {
+  nowmeshDebug(LEVEL_NORMAL, "Gateway advertisement %u adopted, cost %u", advert.sequence, cost);
+  memcpy(sink.sink, advert.sink, 6);
+  memcpy(sink.parent, mac, 6);
+  sink.cost = cost;
+  sink.sequence = advert.sequence;
+  sink.last_heard = now;
+  sink.valid = true;
+  sink_advert_due = true;
+#if NOWMESH_LEAF
+  // Leaves mustn't offer themselves as parents.
+  sink_advert_due = leaf_interval == 0;
+#endif
+  sink_advert_at = now + random(SINK_JITTER);
+ }
+ else if (same_sink && newer == 0 && cheaper) {
+  nowmeshDebug(LEVEL_NORMAL, "Cheaper parent found, cost %u", cost);
+  memcpy(sink.parent, mac, 6);
+  sink.cost = cost;
+ }
+}
+
+// Advertise our way to a gateway to the broadcast address.
+void ICACHE_FLASH_ATTR NowMesh::sendSinkAdvert(const uint8_t* sink_mac, uint16_t sequence, uint16_t cost) {
+ mesh_header header;
+ header.version = NOWMESH_VERSION;
+ header.type = MESSAGE_SINK;
+ memcpy(header.originator, self_mac, 6);
+ memset(header.target, 0, 6);
+ header.id = 0;
+ header.hops = 0;
+ header.ttl = 1;
+ header.flags = PRIORITY_HIGH << FLAG_PRIORITY_SHIFT;
+ sink_advert advert;
+ memcpy(advert.sink, sink_mac, 6);
+ advert.sequence = sequence;
+ advert.cost = cost;
+ uint8_t data[sizeof(mesh_header) + sizeof(sink_advert)];
+ size_t frame_len = buildFrame(data, header, reinterpret_cast<const uint8_t*>(&advert), sizeof(advert));
+ sendMessage(const_cast<uint8_t*>(broadcast_mac), data, frame_len);
+}
+#endif
+
+#if NOWMESH_LEAF
+// Make us a leaf, which sleeps and wakes up every interval milliseconds, or stop being one with 0.
+// Each time it wakes up, a leaf polls its parent, sends it everything queued while it slept, and
+//  gets back whatever the parent held for it meanwhile. Once that's done, and the parent has gone
+//  quiet for LEAF_LISTEN_TIME if it had anything, or LEAF_MAX_AWAKE has passed, it goes back to sleep. Wake ups keep to the
+//  schedule, so the radio is on for a few tens of milliseconds every interval.
+// Send as usual while asleep. Messages wait for the next wake up, sharing frames where they fit.
+// The parent is the given neighbor, by its softAP MAC as scans find it, or if that's NULL, the collection tree parent if we have one and
+//  otherwise the peer we rate best, picked again at every wake up. A leaf with no peers scans for one.
+// Leaves forward nothing and don't send beacons, and they only get the broadcasts they happen to hear
+//  while awake. Any always on node can be a parent: it holds up to MAILBOX_LEN frames for up to
+//  MAILBOX_CHILDREN sleeping children. Reliable messages can take an interval per leaf to be
+//  acknowledged, so ACK_TIMEOUT needs to be longer than that.
+void ICACHE_FLASH_ATTR NowMesh::setLeaf(uint32_t interval, const uint8_t* parent) {
+ if (leaf_asleep) {
+  wifi_fpm_do_wakeup();
+  wifi_fpm_close();
+  leaf_asleep = false;
+ }
+ leaf_interval = interval;
+ leaf_fixed_parent = parent != NULL;
+ leaf_has_parent = leaf_fixed_parent;
+ if (leaf_fixed_parent) {
+  memcpy(leaf_parent, parent, 6);
+ }
+ leaf_scanning = false;
+ if (interval > 0) {
+  discovery = false;
+  leafWake(millis());
+ }
+}
+
+// The sleep callback gets the milliseconds until the next wake up each time a leaf goes to sleep.
+// It can put the chip in deep sleep for that long, in which case it restarts and should call
+//  setLeaf again. If it returns, the modem sleeps until the next wake up.
+void ICACHE_FLASH_ATTR NowMesh::setSleepCallback(std::function<void(uint32_t)> callback) {
+ sleepCallback = callback;
+}
+
+// Run a leaf's schedule. Returns whether we're awake.
+bool ICACHE_FLASH_ATTR NowMesh::leafAwake(uint32_t now) {
+ if (leaf_asleep) {
+  if ((int32_t)(now - leaf_wake_at) < 0) {
+   return false;
+  }
+  leafWake(now);
+  return true;
+ }
+ if (leaf_scanning) {
+  // The scan fills the peer table, and so may traffic we hear meanwhile.
+  if (chooseParent()) {
+   leaf_scanning = false;
+   leafPoll();
+   return true;
+  }
+  if (now - leaf_scan_at < LEAF_SCAN_TIME) {
+   return true;
+  }
+  nowmeshDebug(LEVEL_ERROR, "Leaf found no parent");
+  leaf_scanning = false;
+ }
+ bool busy = tx_in_flight || tx_queue.size() > 0 || rx_queue.size() > 0;
+ // If the parent said it held nothing for us, there's nothing to wait for.
+ bool done = leaf_answered && leaf_held == 0;
+ bool quiet = now - leaf_heard_at >= LEAF_LISTEN_TIME;
+ // A frame in flight is let finish even past LEAF_MAX_AWAKE, as the SDK still has to report on it.
+ if (((done || quiet) && !busy) || (now - leaf_woke_at >= LEAF_MAX_AWAKE && !tx_in_flight)) {
+  // A parent that doesn't answer may be busy, gone, or no parent at all, like another leaf.
+  // Count it against the parent like a failed send, so one that keeps not answering gets replaced.
+  if (leaf_has_parent && !leaf_answered) {
+   nowmeshDebug(LEVEL_ERROR, "Parent didn't answer");
+   updateDelivery(leaf_parent, false);
+  }
+  leafSleep(now);
+  return false;
+ }
+ return true;
+}
+
+// Turn the radio back on, and poll our parent, or look for one if we have none.
+void ICACHE_FLASH_ATTR NowMesh::leafWake(uint32_t now) {
+ if (leaf_asleep) {
+  wifi_fpm_do_wakeup();
+  wifi_fpm_close();
+  leaf_asleep = false;
+ }
+ leaf_woke_at = now;
+ leaf_heard_at = now;
+ if (chooseParent()) {
+  leafPoll();
+  return;
+ }
+ nowmeshDebug(LEVEL_NORMAL, "Leaf has no parent, scanning");
+ leaf_scanning = true;
+ leaf_scan_at = now;
+ scanForPeers();
+}
+
+// Turn the radio off until the next wake up.
+void ICACHE_FLASH_ATTR NowMesh::leafSleep(uint32_t now) {
+ // Keep to the schedule however long we were up, unless we're already past the next wake up.
+ leaf_wake_at = leaf_woke_at + leaf_interval + random(LEAF_JITTER);
+ if ((int32_t)(leaf_wake_at - now) <= 0) {
+  leaf_wake_at = now + leaf_interval;
+ }
+#if NOWMESH_STATS
+ stats.awake_time += now - leaf_woke_at;
+#endif
+ nowmeshDebug(LEVEL_NORMAL, "Leaf sleeping for %u ms", (unsigned)(leaf_wake_at - now));
+ leaf_asleep = true;
+ if (sleepCallback) {
+  sleepCallback(leaf_wake_at - now);
+ }
+ // Forced modem sleep keeps the CPU going, so loop() can wake the radio back up on time.
+ wifi_fpm_set_sleep_type(MODEM_SLEEP_T);
+ wifi_fpm_open();
+ wifi_fpm_do_sleep(0xFFFFFFF);
+}
+
+// Pick the parent for this wake up, and make sure it's a peer. Returns false if we have none.
+bool ICACHE_FLASH_ATTR NowMesh::chooseParent() {
+ if (!leaf_fixed_parent) {
+  bool found = false;
+#if NOWMESH_COLLECTION
+  if (sink.valid && millis() - sink.last_heard <= SINK_TIMEOUT) {
+   memcpy(leaf_parent, sink.parent, 6);
+   found = true;
+  }
+#endif
+  // Keep the parent we have unless another peer is clearly better, as that's where our mail goes.
+  int current = leaf_has_parent ? findPeer(leaf_parent) : -1;
+  int best = current;
+  for (int i = 0; i < MAX_PEERS && !found; i++) {
+   int16_t margin = best == current ? PEER_HYSTERESIS : 0;
+   if (peer_store[i].used && (best < 0 || peerScore(peer_store[i]) > peerScore(peer_store[best]) + margin)) {
+    best = i;
+   }
+  }
+  if (!found && best >= 0) {
+   memcpy(leaf_parent, peer_store[best].mac, 6);
+   found = true;
+  }
+  leaf_has_parent = found;
+ }
+ if (!leaf_has_parent) {
+  return false;
+ }
+ if (!esp_now_is_peer_exist(leaf_parent)) {
+  esp_now_add_peer(leaf_parent, ESP_NOW_ROLE_SLAVE, channel, NULL, 0);
+ }
+ return true;
+}
+
+// Tell our parent we're awake, and for how long we'll sleep after.
+// It goes ahead of the messages we queued while asleep, so the parent's reply overlaps them.
+void ICACHE_FLASH_ATTR NowMesh::leafPoll() {
+ leaf_answered = false;
+ mesh_header header;
+ newHeader(header, leaf_parent, 1, PRIORITY_HIGH);
+ header.type = MESSAGE_POLL;
+ leaf_poll poll;
+ poll.interval = leaf_interval;
+ uint8_t data[sizeof(mesh_header) + sizeof(leaf_poll)];
+ size_t frame_len = buildFrame(data, header, reinterpret_cast<const uint8_t*>(&poll), sizeof(poll));
+ sendMessage(leaf_parent, data, frame_len);
+}
+
+// A child woke up, polling from mac. Remember it, and hand over what we held for it.
+void ICACHE_FLASH_ATTR NowMesh::childPolled(const uint8_t* mac, const uint8_t* station, const leaf_poll& poll, uint32_t now) {
+ int slot = -1;
+ for (int i = 0; i < MAILBOX_CHILDREN; i++) {
+  if (children[i].used && memcmp(children[i].mac, mac, 6) == 0) {
+   slot = i;
+   break;
+  }
+  if (!children[i].used && slot < 0) {
+   slot = i;
+  }
+ }
+ if (slot < 0) {
+  nowmeshDebug(LEVEL_ERROR, "No room for another child");
+  return;
+ }
+ child_info& child = children[slot];
+ memcpy(child.mac, mac, 6);
+ memcpy(child.station, station, 6);
+ child.interval = poll.interval;
+ child.last_poll = now;
+ child.awake = true;
+ child.peered = true;
+ child.used = true;
+ if (!esp_now_is_peer_exist(child.mac)) {
+  esp_now_add_peer(child.mac, ESP_NOW_ROLE_SLAVE, channel, NULL, 0);
+ }
+ // Answer first, so the child knows whether to wait for more.
+ mesh_header header;
+ newHeader(header, child.mac, 1, PRIORITY_HIGH);
+ header.type = MESSAGE_POLL_REPLY;
+ poll_reply reply;
+ reply.held = mailbox.held(child.station);
+ uint8_t answer[sizeof(mesh_header) + sizeof(poll_reply)];
+ size_t answer_len = buildFrame(answer, header, reinterpret_cast<const uint8_t*>(&reply), sizeof(reply));
+ sendMessage(child.mac, answer, answer_len);
+ uint8_t len;
+ const uint8_t* held;
+ while ((held = mailbox.take(child.station, len, now)) != NULL) {
+  // Copied out first, as a send callback could put something else in the mailbox.
+  uint8_t data[MAX_MSG_LEN];
+  memcpy(data, held, len);
+  nowmeshCount(mail_delivered);
+  sendMessage(child.mac, data, len);
+ }
+}
+
+// Whether station is the station MAC of one of our children, awake or not.
+bool ICACHE_FLASH_ATTR NowMesh::isChild(const uint8_t* station) {
+ for (int i = 0; i < MAILBOX_CHILDREN; i++) {
+  if (children[i].used && memcmp(children[i].station, station, 6) == 0) {
+   return true;
+  }
+ }
+ return false;
+}
+
+// Put a frame for a sleeping child in the mailbox. Returns false if target isn't one.
+bool ICACHE_FLASH_ATTR NowMesh::holdForChild(const uint8_t* target, const uint8_t* data, size_t len) {
+ for (int i = 0; i < MAILBOX_CHILDREN; i++) {
+  child_info& child = children[i];
+  if (child.used && !child.awake && memcmp(child.station, target, 6) == 0) {
+   nowmeshDebug(LEVEL_NORMAL, "Holding message for sleeping child");
+   nowmeshCount(mail_held);
+   if (!mailbox.store(target, data, len, millis())) {
+    nowmeshCount(mail_dropped);
+   }
+   return true;
+  }
+ }
+ return false;
+}
+
+// Keep track of our children's sleep. A child is taken to be asleep LEAF_LISTEN_TIME after it polls,
+//  and stops being a peer once it's surely asleep, so floods don't spend the MAC's retries on it.
+// One that misses LEAF_MISSED_POLLS polls is forgotten.
+void ICACHE_FLASH_ATTR NowMesh::serviceChildren(uint32_t now) {
+ for (int i = 0; i < MAILBOX_CHILDREN; i++) {
+  child_info& child = children[i];
+  if (!child.used) {
+   continue;
+  }
+  uint32_t since = now - child.last_poll;
+  if (child.awake && since >= LEAF_LISTEN_TIME) {
+   child.awake = false;
+  }
+  if (child.peered && since >= LEAF_MAX_AWAKE) {
+   child.peered = false;
+   esp_now_del_peer(child.mac);
+  }
+  if (since > LEAF_MISSED_POLLS * child.interval + LEAF_MAX_AWAKE) {
+   // It may have moved to another parent, so its mail is flooded for that one to pick up.
+   nowmeshDebug(LEVEL_NORMAL, "Child stopped polling, flooding its mail");
+   child.used = false;
+   uint8_t len;
+   const uint8_t* held;
+   while ((held = mailbox.take(child.station, len, now)) != NULL) {
+    uint8_t data[MAX_MSG_LEN];
+    memcpy(data, held, len);
+    nowmeshCount(sent_flooded);
+    sendMessage(NULL, data, len);
+   }
+  }
+ }
+}
+#endif
+
+#if NOWMESH_ROUTE_DISCOVERY
+// Hold a targeted message of ours for a target we have no route to, and look for one.
+// Returns false if it should be flooded after all: someone else's message is passed on as it came,
+//  and there may be no room to hold it.
+bool ICACHE_FLASH_ATTR NowMesh::holdForRoute(const mesh_header& header, const uint8_t* data, size_t len) {
+ if (header.type != MESSAGE_TARGETED || memcmp(header.originator, self_mac, 6) != 0 || route_pending.size() >= ROUTE_PENDING_LEN) {
+  return false;
+ }
+ route_discovery* discovery = NULL;
+ route_discovery* free_slot = NULL;
+ for (int i = 0; i < ROUTE_DISCOVERIES && discovery == NULL; i++) {
+  if (discoveries[i].used && memcmp(discoveries[i].target, header.target, 6) == 0) {
+   discovery = &discoveries[i];
+  }
+  else if (!discoveries[i].used && free_slot == NULL) {
+   free_slot = &discoveries[i];
+  }
+ }
+ // Already looking, so this one waits with the rest.
+ if (discovery != NULL) {
+  route_pending.store(header.target, data, len, millis());
+  return true;
+ }
+ if (free_slot == NULL) {
+  return false;
+ }
+ memcpy(free_slot->target, header.target, 6);
+ free_slot->attempts = 0;
+ free_slot->ttl = header.ttl;
+ free_slot->priority = (header.flags & FLAG_PRIORITY_MASK) >> FLAG_PRIORITY_SHIFT;
+ free_slot->used = true;
+ route_pending.store(header.target, data, len, millis());
+ sendRouteRequest(*free_slot);
+ return true;
+}
+
+// Start looking for a route to the discovery's target.
+void ICACHE_FLASH_ATTR NowMesh::sendRouteRequest(route_discovery& discovery) {
+ discovery.attempts++;
+ discovery.sent_at = millis();
+ nowmeshDebug(LEVEL_NORMAL, "Looking for a route, attempt %u", discovery.attempts);
+ nowmeshCount(route_requests);
+ mesh_header header;
+ newHeader(header, discovery.target, discovery.ttl, discovery.priority);
+ header.type = MESSAGE_ROUTE_REQUEST;
+ floodRouteRequest(header);
+}
+
+// A frame from target may have given us a route to it. If we were looking for one, send what waited.
+void ICACHE_FLASH_ATTR NowMesh::routeLearned(const uint8_t* target, uint32_t now) {
+ for (int i = 0; i < ROUTE_DISCOVERIES; i++) {
+  route_discovery& discovery = discoveries[i];
+  if (!discovery.used || memcmp(discovery.target, target, 6) != 0) {
+   continue;
+  }
+  if (route_table.lookup(target, now) == NULL) {
+   return;
+  }
+  nowmeshDebug(LEVEL_NORMAL, "Found route, sending %d waiting frames", route_pending.held(target));
+  discovery.used = false;
+  // Each frame is copied out first, as sending could hold another one.
+  // Only the frames waiting now are sent, so that can't go on forever.
+  uint8_t frame[MAX_MSG_LEN];
+  for (int waiting = route_pending.held(target); waiting > 0; waiting--) {
+   uint8_t len = 0;
+   const uint8_t* held = route_pending.take(target, len, now);
+   memcpy(frame, held, len);
+   mesh_header header;
+   memcpy(&header, frame, sizeof(mesh_header));
+   sendTargeted(header, frame + sizeof(mesh_header), len - sizeof(mesh_header));
+  }
+  return;
+ }
+}
+
+// Ask again for routes that haven't turned up, and flood what waited for the ones that never do.
+void ICACHE_FLASH_ATTR NowMesh::serviceDiscoveries(uint32_t now) {
+ for (int i = 0; i < ROUTE_DISCOVERIES; i++) {
+  route_discovery& discovery = discoveries[i];
+  if (!discovery.used || now - discovery.sent_at < ROUTE_REQUEST_TIMEOUT) {
+   continue;
+  }
+  if (discovery.attempts < ROUTE_REQUEST_ATTEMPTS) {
+   sendRouteRequest(discovery);
+   continue;
+  }
+  nowmeshDebug(LEVEL_ERROR, "No route found, flooding %d frames", route_pending.held(discovery.target));
+  nowmeshCount(routes_not_found);
+  discovery.used = false;
+  uint8_t frame[MAX_MSG_LEN];
+  uint8_t len;
+  const uint8_t* held;
+  while ((held = route_pending.take(discovery.target, len, now)) != NULL) {
+   memcpy(frame, held, len);
+   nowmeshCount(sent_flooded);
+#if NOWMESH_BRIDGE
+   mesh_header header;
+   memcpy(&header, frame, sizeof(mesh_header));
+   bridgeOut(header, frame + sizeof(mesh_header), len - sizeof(mesh_header));
+#endif
+   sendMessage(NULL, frame, len);
+  }
+ }
+}
+#endif
+
+// Send a beacon, a bare header, to the broadcast address.
+// Anyone in range learns about us from it, peer or not. It is never forwarded.
+void ICACHE_FLASH_ATTR NowMesh::sendBeacon() {
+ mesh_header header;
+ header.version = NOWMESH_VERSION;
+ header.type = MESSAGE_BEACON;
+ memcpy(header.originator, self_mac, 6);
+ memset(header.target, 0, 6);
+ header.id = 0;
+ header.hops = 0;
+ header.ttl = 1;
+ header.flags = PRIORITY_HIGH << FLAG_PRIORITY_SHIFT;
+ uint8_t data[sizeof(mesh_header)];
+ size_t frame_len = buildFrame(data, header, NULL, 0);
+ sendMessage(const_cast<uint8_t*>(broadcast_mac), data, frame_len);
+}
+
+// User facing initialization function
+void ICACHE_FLASH_ATTR NowMesh::begin() {
+ nowmeshDebug(LEVEL_NORMAL, "Starting NowMesh");
+ // From now on the SDK's callbacks come to us.
+ instance = this;
+ // Set opmode as access point + station
+ wifi_set_opmode(3);
+ // Our MAC addresses won't change, so fetch them once rather than for every frame we send or receive.
+ wifi_get_macaddr(STATION_IF, self_mac);
+ wifi_get_macaddr(SOFTAP_IF, link_mac);
+ // Set channel
+ wifi_set_channel(channel);
+ // Initialize ESP Now and register callbacks
+ if (esp_now_init() == 0) {
+  nowmeshDebug(LEVEL_NORMAL, "ESP Now init successful");
+  esp_now_register_send_cb(reinterpret_cast<esp_now_send_cb_t>(&NowMesh::sendData));
+  esp_now_register_recv_cb(reinterpret_cast<esp_now_recv_cb_t>(&NowMesh::receiveData));
+  esp_now_set_self_role(ESP_NOW_ROLE_SLAVE);
+ }
+ else {
+  nowmeshDebug(LEVEL_ERROR, "ESP Now init failed");
+ }
+#if NOWMESH_PERSIST
+ // Restored peers are added to ESP Now, so this comes after it's up.
+ if (persistent) {
+  restoreState();
+ }
+#endif
+}
+
+#if NOWMESH_PERSIST
+// Keep the peer table, the freshest routes and where message ids are up to across reboots, so a node
+//  is routing again as soon as begin() returns instead of after scans and floods, and neighbors don't
+//  drop its new messages as duplicates of old ones with the same ids. Call it before begin().
+// The state goes in RTC memory, from block STATE_RTC_BLOCK, unless setStateStore gives somewhere else.
+//  RTC memory survives resets and deep sleep but not losing power.
+// It's saved STATE_FIRST_SAVE after boot, then every STATE_SAVE_INTERVAL if it changed, and every
+//  STATE_ID_BLOCK messages. Restored peers and routes count as just heard from, and are dropped
+//  in the usual way if they don't turn out to be there anymore.
+void ICACHE_FLASH_ATTR NowMesh::setPersistence(bool enabled) {
+ persistent = enabled;
+}
+
+// Keep the state somewhere else than RTC memory, flash for instance, so it survives losing power.
+// save gets the state to write and load a buffer to read it into, both sizeof(mesh_state) bytes,
+//  and each returns whether it worked. Turns persistence on. Call it before begin().
+void ICACHE_FLASH_ATTR NowMesh::setStateStore(std::function<bool(const uint8_t*, size_t)> save, std::function<bool(uint8_t*, size_t)> load) {
+ stateSaveCallback = save;
+ stateLoadCallback = load;
+ persistent = true;
+}
+
+// Times this node has booted with persistence on, this time included. 0 if it's off.
+uint32_t ICACHE_FLASH_ATTR NowMesh::getBootCount() {
+ return boots;
+}
+
+uint32_t ICACHE_FLASH_ATTR NowMesh::stateChecksum(const mesh_state& state) {
+ const uint8_t* data = reinterpret_cast<const uint8_t*>(&state);
+ uint32_t hash = 2166136261u;
+ for (size_t i = offsetof(mesh_state, boots); i < sizeof(mesh_state); i++) {
+  hash = (hash ^ data[i]) * 16777619u;
+ }
+ return hash;
+}
+
+// Load the saved state, if there's one and it's from a build like this one, and save it straight back
+//  with the boot counted and a new block of message ids reserved.
+void ICACHE_FLASH_ATTR NowMesh::restoreState() {
+ // RTC memory is read and written in whole, aligned, 4 byte blocks.
+ uint32_t words[(sizeof(mesh_state) + 3) / 4];
+ bool loaded;
+ if (stateLoadCallback) {
+  loaded = stateLoadCallback(reinterpret_cast<uint8_t*>(words), sizeof(mesh_state));
+ }
+ else {
+  loaded = system_rtc_mem_read(STATE_RTC_BLOCK, words, sizeof(words));
+ }
+ mesh_state state;
+ memcpy(&state, words, sizeof(mesh_state));
+ uint32_t now = millis();
+ if (loaded && state.magic == STATE_MAGIC && state.len == sizeof(mesh_state) && state.checksum == stateChecksum(state) && state.peer_count <= MAX_PEERS && state.route_count <= STATE_ROUTES) {
+  nowmeshDebug(LEVEL_NORMAL, "Restoring %u peers and %u routes", state.peer_count, state.route_count);
+  boots = state.boots;
+  last_message_id = state.id_limit;
+  for (int i = 0; i < state.peer_count; i++) {
+   learnPeer(state.peers[i], now);
+  }
+  for (int i = 0; i < state.route_count; i++) {
+   route_table.update(state.routes[i].destination, state.routes[i].next_hop, state.routes[i].hops, now);
+  }
+ }
+ else {
+  // Nothing saved yet. Start ids at random, so they're unlikely to be ones neighbors still remember
+  //  from before we lost our state.
+  nowmeshDebug(LEVEL_NORMAL, "No saved state");
+  boots = 0;
+  last_message_id = random(65536);
+ }
+ boots++;
+ id_limit = last_message_id + STATE_ID_BLOCK;
+ saveState(true);
+ state_due = now + STATE_FIRST_SAVE;
+}
+
+// Save the state, unless it's the same as last time and force is false. Returns whether it was saved.
+bool ICACHE_FLASH_ATTR NowMesh::saveState(bool force) {
+ uint32_t now = millis();
+ mesh_state state;
+ memset(&state, 0, sizeof(state));
+ state.magic = STATE_MAGIC;
+ state.len = sizeof(mesh_state);
+ state.boots = boots;
+ state.id_limit = id_limit;
+ for (int i = 0; i < MAX_PEERS; i++) {
+  if (peer_store[i].used && now - peer_store[i].last_seen <= PEER_TIMEOUT) {
+   memcpy(state.peers[state.peer_count++], peer_store[i].mac, 6);
+  }
+ }
+ for (int slot = 0; slot < route_table.size && state.route_count < STATE_ROUTES; slot++) {
+  const route_info* route = route_table.at(slot, now);
+#if NOWMESH_BRIDGE
+  // Routes over a bridge only hold while the bridge is up.
+  if (route != NULL && memcmp(route->next_hop, bridge_mac, 6) == 0) {
+   continue;
+  }
+#endif
+  if (route != NULL) {
+   saved_route& saved = state.routes[state.route_count++];
+   memcpy(saved.destination, route->destination, 6);
+   memcpy(saved.next_hop, route->next_hop, 6);
+   saved.hops = route->hops;
+  }
+ }
+ state.checksum = stateChecksum(state);
+ if (!force && state.checksum == state_checksum) {
+  return false;
+ }
+ uint32_t words[(sizeof(mesh_state) + 3) / 4] = {};
+ memcpy(words, &state, sizeof(mesh_state));
+ bool saved;
+ if (stateSaveCallback) {
+  saved = stateSaveCallback(reinterpret_cast<const uint8_t*>(words), sizeof(mesh_state));
+ }
+ else {
+  saved = system_rtc_mem_write(STATE_RTC_BLOCK, words, sizeof(words));
+ }
+ if (saved) {
+  nowmeshDebug(LEVEL_NORMAL, "Saved state");
+  nowmeshCount(state_saves);
+  state_checksum = state.checksum;
+ }
+ else {
+  nowmeshDebug(LEVEL_ERROR, "Saving state failed");
+ }
+ return saved;
+}
+#endif
+
+#if NOWMESH_FRAGMENTATION
+// Queue fragments of the message being fragmented, as long as there's room.
+// One slot is left free so other traffic isn't shut out while a long message goes out.
+// A broadcast's are spaced out instead, see FRAGMENT_GAP.
+void ICACHE_FLASH_ATTR NowMesh::feedFragments() {
+ while (tx_fragments_left > 0 && tx_queue.size() < TX_QUEUE_LEN - 1) {
+  bool broadcast = tx_fragment_header.type == MESSAGE_BROADCAST;
+  if (broadcast && (fragmentQueued() || millis() - tx_fragment_at < FRAGMENT_GAP)) {
+   return;
+  }
+  uint8_t index = tx_fragment_count - tx_fragments_left;
+  size_t offset = index * FRAGMENT_PAYLOAD_LEN;
+  size_t chunk = tx_fragmented_len - offset < FRAGMENT_PAYLOAD_LEN ? tx_fragmented_len - offset : FRAGMENT_PAYLOAD_LEN;
+  uint8_t payload[MAX_PAYLOAD_LEN];
+  fragment_header* fragment = reinterpret_cast<fragment_header*>(payload);
+  fragment->index = index;
+  fragment->count = tx_fragment_count;
+  memcpy(payload + sizeof(fragment_header), tx_fragmented + offset, chunk);
+  tx_fragments_left--;
+  if (broadcast) {
+   tx_fragment_at = millis();
+   sendBroadcast(tx_fragment_header, payload, sizeof(fragment_header) + chunk);
+  }
+  else {
+   sendTargeted(tx_fragment_header, payload, sizeof(fragment_header) + chunk);
+  }
+ }
+}
+
+// Whether a fragment of the message being fragmented is still in the transmit queue, in flight or not.
+// All its fragments share its header, so any of ours with its id is one. FRAGMENT_GAP counts from
+//  when it leaves, so until then it counts as just queued.
+bool ICACHE_FLASH_ATTR NowMesh::fragmentQueued() {
+ for (int cls = 0; cls < PRIORITY_CLASSES; cls++) {
+  for (int i = 0; i < tx_queue.size(cls); i++) {
+   const mesh_header* header = reinterpret_cast<const mesh_header*>(tx_queue.at(cls, i).data);
+   if (header->id == tx_fragment_header.id && (header->flags & FLAG_FRAGMENT) && memcmp(header->originator, self_mac, 6) == 0) {
+    tx_fragment_at = millis();
+    return true;
+   }
+  }
+ }
+ return false;
+}
+#endif
+
+// Send a route request on, or send our own. It's a bare header, sent once to the broadcast address
+//  for everyone in range rather than to each peer in turn, so a flood of them costs one frame a node.
+void ICACHE_FLASH_ATTR NowMesh::floodRouteRequest(const mesh_header& header) {
+ uint8_t data[sizeof(mesh_header)];
+ size_t frame_len = buildFrame(data, header, NULL, 0);
+ sendMessage(const_cast<uint8_t*>(broadcast_mac), data, frame_len);
+}
+
+// Answer a route request, for us or for a child of ours. The reply is routed back to whoever asked,
+//  and every node it passes learns the way to us from it, like from any other frame, the asker included.
+void ICACHE_FLASH_ATTR NowMesh::sendRouteReply(const mesh_header& request) {
+ nowmeshDebug(LEVEL_NORMAL, "Answering route request, %u hops", request.hops + 1);
+ nowmeshCount(route_replies);
+ mesh_header header;
+ newHeader(header, const_cast<uint8_t*>(request.originator), DEFAULT_MAX_HOPS, PRIORITY_HIGH);
+ header.type = MESSAGE_ROUTE_REPLY;
+ route_reply reply;
+ memcpy(reply.target, request.target, 6);
+ sendTargeted(header, reinterpret_cast<const uint8_t*>(&reply), sizeof(reply));
+}
+
+// Acknowledge a reliable message that reached us.
+// The ACK is a bare header, with the message's id, routed back to its originator.
+void ICACHE_FLASH_ATTR NowMesh::sendAck(const mesh_header& message) {
+ mesh_header header;
+ header.version = NOWMESH_VERSION;
+ header.type = MESSAGE_ACK;
+ memcpy(header.originator, self_mac, 6);
+ memcpy(header.target, message.originator, 6);
+ header.id = message.id;
+ header.hops = 0;
+ header.ttl = DEFAULT_MAX_HOPS;
+ // Carry the attempt over, so ACKs for different attempts aren't taken for duplicates.
+ header.flags = (message.flags & (0x0f << FLAG_ATTEMPT_SHIFT)) | (PRIORITY_HIGH << FLAG_PRIORITY_SHIFT);
+ uint8_t none = 0;
+ sendTargeted(header, &none, 0);
+}
+
+#if NOWMESH_RELIABLE
+// An ACK from acker for our message id came in.
+void ICACHE_FLASH_ATTR NowMesh::ackReceived(const uint8_t* acker, uint16_t id, uint32_t now) {
+ for (int i = 0; i < PENDING_ACKS; i++) {
+  pending_info& entry = pending[i];
+  if (entry.used && entry.header.id == id && memcmp(entry.header.target, acker, 6) == 0) {
+   nowmeshDebug(LEVEL_NORMAL, "Message %u acknowledged after %u attempts", id, entry.attempts);
+   entry.used = false;
+   reportDelivery(entry, true, now);
+   return;
+  }
+ }
+}
+
+// Tell the user whether a reliable message made it.
+void ICACHE_FLASH_ATTR NowMesh::reportDelivery(const pending_info& entry, bool delivered, uint32_t now) {
+ if (deliveryCallback) {
+  mesh_handle handle;
+  memcpy(handle.originator, entry.header.originator, 6);
+  handle.id = entry.header.id;
+  deliveryCallback(handle, delivered, now - entry.first_sent, entry.attempts);
+ }
+}
+
+// Resend reliable messages whose ACK is overdue, backing off exponentially,
+//  and give up on those that have had ACK_MAX_ATTEMPTS attempts.
+void ICACHE_FLASH_ATTR NowMesh::retryPending(uint32_t now) {
+ for (int i = 0; i < PENDING_ACKS; i++) {
+  pending_info& entry = pending[i];
+  if (!entry.used || (int32_t)(now - entry.next_retry) < 0) {
+   continue;
+  }
+  if (entry.attempts >= ACK_MAX_ATTEMPTS) {
+   nowmeshDebug(LEVEL_ERROR, "Message %u never acknowledged", entry.header.id);
+   entry.used = false;
+   reportDelivery(entry, false, now);
+   continue;
+  }
+  entry.header.flags = (entry.header.flags & ~(0x0f << FLAG_ATTEMPT_SHIFT)) | (entry.attempts << FLAG_ATTEMPT_SHIFT);
+  entry.attempts++;
+  // Jitter keeps nodes that lost frames to the same collision from retrying in step.
+  entry.next_retry = now + (ACK_TIMEOUT << (entry.attempts - 1)) + random(ACK_TIMEOUT / 4);
+  sendTargeted(entry.header, entry.data, entry.len);
+ }
+}
+
+// User-facing send function for reliable messages.
+// The target acknowledges the message, and unless an ACK comes back it is resent, up to
+//  ACK_MAX_ATTEMPTS times in all. The delivery callback reports how it went.
+// The message must fit in one frame, and up to PENDING_ACKS may be awaiting ACKs at a time.
+// Returns a handle with id 0 if the message couldn't be sent.
+mesh_handle ICACHE_FLASH_ATTR NowMesh::sendReliable(const uint8_t* message, size_t len, uint8_t* target, uint8_t max_hops, uint8_t priority) {
+ mesh_handle handle;
+ memcpy(handle.originator, self_mac, 6);
+ handle.id = 0;
+ if (target == NULL || len > MAX_PAYLOAD_LEN) {
+  nowmeshDebug(LEVEL_ERROR, "Can't send message reliably");
+  return handle;
+ }
+ pending_info* entry = NULL;
+ for (int i = 0; i < PENDING_ACKS; i++) {
+  if (!pending[i].used) {
+   entry = &pending[i];
+   break;
+  }
+ }
+ if (entry == NULL) {
+  nowmeshDebug(LEVEL_ERROR, "Too many messages awaiting ACKs");
+  return handle;
+ }
+ newHeader(entry->header, target, max_hops, priority);
+ entry->header.flags |= FLAG_ACK_REQUEST;
+ nowmeshTrace(TRACE_ORIGINATE, entry->header, target, 0);
+ memcpy(entry->data, message, len);
+ entry->len = len;
+ uint32_t now = millis();
+ entry->first_sent = now;
+ entry->next_retry = now + ACK_TIMEOUT;
+ entry->attempts = 1;
+ if (sendTargeted(entry->header, entry->data, entry->len) < 0) {
+  return handle;
+ }
+ entry->used = true;
+ handle.id = entry->header.id;
+ return handle;
+}
+#endif
+
+// Fill in the header for a new message from us.
+// target may be NULL, in which case the message is broadcast.
+void ICACHE_FLASH_ATTR NowMesh::newHeader(mesh_header& header, uint8_t* target, uint8_t max_hops, uint8_t priority) {
+#if NOWMESH_PERSIST
+ // Out of reserved ids, or skipped past the last one on the way round from 65535. Reserve more,
+ //  and save that before using any of them.
+ uint16_t reserved = id_limit - last_message_id;
+ if (persistent && (reserved == 0 || reserved > STATE_ID_BLOCK)) {
+  id_limit = last_message_id + STATE_ID_BLOCK;
+  saveState(true);
+ }
+#endif
+ last_message_id++;
+ // 0 is the id of a message that couldn't be sent.
+ if (last_message_id == 0) {
+  last_message_id++;
+ }
+ header.version = NOWMESH_VERSION;
+ header.type = target == NULL ? MESSAGE_BROADCAST : MESSAGE_TARGETED;
+ memcpy(header.originator, self_mac, 6);
+ if (target != NULL) {
+  memcpy(header.target, target, 6);
+ }
+ else {
+  memset(header.target, 0, 6);
+ }
+ header.id = last_message_id;
+ header.hops = 0;
+ header.ttl = max_hops;
+ if (priority >= PRIORITY_CLASSES) {
+  priority = PRIORITY_CLASSES - 1;
+ }
+ header.flags = priority << FLAG_PRIORITY_SHIFT;
+}
+
+// User-facing send function for broadcast messages.
+// Returns the handle the send callback will report the message's frames by.
+mesh_handle ICACHE_FLASH_ATTR NowMesh::send(String message) {
+ return send(reinterpret_cast<const uint8_t*>(message.c_str()), message.length(), NULL, DEFAULT_MAX_HOPS, PRIORITY_NORMAL);
+}
+
+// User-facing send function for targeted messages.
+// If target is NULL the message is broadcast.
+// The message travels at most max_hops hops, and is queued in priority class priority,
+//  by us and by every node forwarding it.
+mesh_handle ICACHE_FLASH_ATTR NowMesh::send(String message, uint8_t* target, uint8_t max_hops, uint8_t priority) {
+ return send(reinterpret_cast<const uint8_t*>(message.c_str()), message.length(), target, max_hops, priority);
+}
+
+// User-facing send function for broadcast binary messages.
+// len can be up to MAX_PAYLOAD_LEN.
+mesh_handle ICACHE_FLASH_ATTR NowMesh::send(const uint8_t* message, size_t len) {
+ return send(message, len, NULL, DEFAULT_MAX_HOPS, PRIORITY_NORMAL);
+}
+
+// User-facing send function for targeted binary messages.
+// If target is NULL the message is broadcast.
+// Messages longer than MAX_PAYLOAD_LEN, up to MAX_FRAGMENTED_LEN, are sent in fragments,
+//  unless fragmentation is off, in which case they can't be sent.
+// Only one fragmented message is sent at a time. Until it has all been queued,
+//  sending another fails, returning a handle with id 0.
+mesh_handle ICACHE_FLASH_ATTR NowMesh::send(const uint8_t* message, size_t len, uint8_t* target, uint8_t max_hops, uint8_t priority) {
+ mesh_header header;
+ newHeader(header, target, max_hops, priority);
+ nowmeshTrace(TRACE_ORIGINATE, header, target, 0);
+#if NOWMESH_FRAGMENTATION
+ if (len > MAX_PAYLOAD_LEN) {
+  mesh_handle handle;
+  memcpy(handle.originator, header.originator, 6);
+  handle.id = 0;
+  if (len > MAX_FRAGMENTED_LEN || tx_fragments_left > 0) {
+   nowmeshDebug(LEVEL_ERROR, "Can't fragment message");
+   return handle;
+  }
+  header.flags |= FLAG_FRAGMENT;
+  tx_fragment_header = header;
+  memcpy(tx_fragmented, message, len);
+  tx_fragmented_len = len;
+  tx_fragment_count = (len + FRAGMENT_PAYLOAD_LEN - 1) / FRAGMENT_PAYLOAD_LEN;
+  tx_fragments_left = tx_fragment_count;
+  feedFragments();
+  handle.id = header.id;
+  return handle;
+ }
+#endif
+ int result;
+ if (target == NULL) {
+  result = sendBroadcast(header, message, len);
+ }
+ else {
+  result = sendTargeted(header, message, len);
+ }
+ mesh_handle handle;
+ memcpy(handle.originator, header.originator, 6);
+ handle.id = result < 0 ? 0 : header.id;
+ return handle;
 }
@@ -1,76 +1,1115 @@
 #include <Arduino.h>
 #include <functional>
+#include "MessageCache.h"
+#include "RouteTable.h"
+#include "TxQueue.h"
+#include "RxQueue.h"
+#include "Reassembly.h"
+#include "SipHash.h"
+#include "Mailbox.h"
+#include "TraceBuffer.h"
 
 extern "C" {
  #include <espnow.h>
  #include <user_interface.h>
 }
 
-// WiFi channel
-#define CHANNEL 1
+// Settings. Each can be overridden for a build by defining it first, from build flags for instance,
+//  so leaf nodes and gateways built from the same tree can size their tables differently.
+
+// Features. Set any to 0 to leave it out of the build, along with the code and RAM it needs.
+// Reliable sending, see NowMesh::sendReliable. Nodes without it still acknowledge reliable messages.
+#ifndef NOWMESH_RELIABLE
+ #define NOWMESH_RELIABLE 1
+#endif
+// Aggregation, see NowMesh::setAggregation. Nodes without it still accept aggregates.
+#ifndef NOWMESH_AGGREGATION
+ #define NOWMESH_AGGREGATION 1
+#endif
+// Sending and reassembling messages longer than one frame. Nodes without it still forward fragments.
+// This is the big one, at MAX_FRAGMENTED_LEN bytes times REASSEMBLY_BUFFERS plus one.
+#ifndef NOWMESH_FRAGMENTATION
+ #define NOWMESH_FRAGMENTATION 1
+#endif
+// Counters, see NowMesh::getStats.
+#ifndef NOWMESH_STATS
+ #define NOWMESH_STATS 1
+#endif
+// Collection tree routing towards a gateway, see NowMesh::setGateway.
+#ifndef NOWMESH_COLLECTION
+ #define NOWMESH_COLLECTION 1
+#endif
+// Rebroadcast suppression, see NowMesh::setFlooding.
+#ifndef NOWMESH_FLOOD_CONTROL
+ #define NOWMESH_FLOOD_CONTROL 1
+#endif
+// Bridging clusters on different channels, see NowMesh::setBridgeCallback.
+#ifndef NOWMESH_BRIDGE
+ #define NOWMESH_BRIDGE 1
+#endif
+// Frames tagged with a shared network key, see NowMesh::setNetworkKey.
+// Takes AUTH_TAG_LEN bytes off MAX_MSG_LEN even while no key is set.
+#ifndef NOWMESH_AUTH
+ #define NOWMESH_AUTH 1
+#endif
+// Duty cycled leaf nodes, and the mailboxes their parents keep for them, see NowMesh::setLeaf.
+#ifndef NOWMESH_LEAF
+ #define NOWMESH_LEAF 1
+#endif
+// Finding routes on demand with small route requests, rather than flooding targeted messages.
+// Nodes without it still forward requests and replies, and answer requests for themselves.
+#ifndef NOWMESH_ROUTE_DISCOVERY
+ #define NOWMESH_ROUTE_DISCOVERY 1
+#endif
+// Sending routed frames that fail around the neighbor that didn't take them, see LINK_FAILURES.
+#ifndef NOWMESH_REROUTE
+ #define NOWMESH_REROUTE 1
+#endif
+// Keeping peers, routes and message ids across reboots, see NowMesh::setPersistence.
+#ifndef NOWMESH_PERSIST
+ #define NOWMESH_PERSIST 1
+#endif
+// Recording what happens to messages as they cross the mesh, see NowMesh::setTracing.
+// Off by default like NOWMESH_DEBUG, it's for finding out where latency goes. Nodes without it
+//  still forward trace frames to the collector.
+#ifndef NOWMESH_TRACE
+ #define NOWMESH_TRACE 0
+#endif
+
+// WiFi channel to start on. See NowMesh::setChannel and NowMesh::probeChannel to change it at runtime.
+#ifndef CHANNEL
+ #define CHANNEL 1
+#endif
+// Channels NowMesh::probeChannel may pick, as a bit mask. 1, 6 and 11 don't overlap each other.
+#ifndef CHANNEL_CANDIDATES
+ #define CHANNEL_CANDIDATES ((1 << 1) | (1 << 6) | (1 << 11))
+#endif
 
 // Number of messages to remember
 // If you have a very large mesh and/or very high message quantity,
 //  you may want to increase STORED_MESSAGES.
-#define STORED_MESSAGES 10
+// Lookups are constant time, so raising it costs RAM (about 20 bytes per message) but no speed.
+// Each fragment of a message takes its own entry, so with fragmentation on this has to cover at least
+//  MAX_FRAGMENTS, and more to leave room for other traffic while one goes by. See MAX_FRAGMENTED_LEN.
+#ifndef STORED_MESSAGES
+ #if NOWMESH_FRAGMENTATION
+  #define STORED_MESSAGES 48
+ #else
+  #define STORED_MESSAGES 10
+ #endif
+#endif
+// Number of destinations to keep routes to.
+// Routes are learned from every received frame, so this should be at least the number of nodes
+//  we send targeted messages to.
+#ifndef MAX_ROUTES
+ #define MAX_ROUTES 32
+#endif
+// Milliseconds a route is trusted for after we last heard from its destination through it.
+#ifndef ROUTE_TIMEOUT
+ #define ROUTE_TIMEOUT 60000
+#endif
+// Route discovery. A targeted message we send with no route to its target waits while a bare route
+//  request floods in its place, and goes out once the target's reply has set up the route.
+// Milliseconds to wait for a reply, and requests to send before giving up and flooding the messages.
+#ifndef ROUTE_REQUEST_TIMEOUT
+ #define ROUTE_REQUEST_TIMEOUT 500
+#endif
+#ifndef ROUTE_REQUEST_ATTEMPTS
+ #define ROUTE_REQUEST_ATTEMPTS 2
+#endif
+// Targets we can look for at once, and frames that can wait for routes, for all targets together.
+// Frames beyond that are flooded straight away.
+#ifndef ROUTE_DISCOVERIES
+ #define ROUTE_DISCOVERIES 4
+#endif
+#ifndef ROUTE_PENDING_LEN
+ #define ROUTE_PENDING_LEN 4
+#endif
+// A routed frame that fails to reach its next hop, even after the radio's own retries, is sent again
+//  at once, through the route's alternate next hop if it has one. After this many failures in a row
+//  routes through that neighbor switch to their alternates, or are dropped, until it's heard from again.
+#ifndef LINK_FAILURES
+ #define LINK_FAILURES 2
+#endif
+
 // Number of peers to be connected to.
 // Any number can be connected to us.
 // If you have trouble with messages not reaching their destination,
 //  try increasing MAX_PEERS
-#define MAX_PEERS 10
+#ifndef MAX_PEERS
+ #define MAX_PEERS 10
+#endif
+// A peer is forgotten once it's been missing from this many scans in a row.
+#ifndef PEER_MISSED_SCANS
+ #define PEER_MISSED_SCANS 3
+#endif
+// A new peer only replaces our worst peer if it scores this much better.
+#ifndef PEER_HYSTERESIS
+ #define PEER_HYSTERESIS 10
+#endif
+// Milliseconds a peer we've heard from is kept even if scans don't see it.
+#ifndef PEER_TIMEOUT
+ #define PEER_TIMEOUT 30000
+#endif
+// Signal strength, in dBm, assumed for peers learned from traffic rather than scans.
+#ifndef PEER_DEFAULT_RSSI
+ #define PEER_DEFAULT_RSSI -70
+#endif
+// Scans give peers a bonus for every one of this many newest stored messages they sent or originated.
+// Bounds the work and stack each scan takes, however large STORED_MESSAGES is.
+#ifndef PEER_CONTACT_MESSAGES
+ #define PEER_CONTACT_MESSAGES 32
+#endif
+
+// Passive discovery, see NowMesh::setDiscovery.
+// Milliseconds between beacons.
+#ifndef BEACON_INTERVAL
+ #define BEACON_INTERVAL 2000
+#endif
+// Scan only if we've heard from fewer neighbors than this.
+#ifndef MIN_NEIGHBORS
+ #define MIN_NEIGHBORS 3
+#endif
+// Milliseconds to wait between scans while neighbors are scarce.
+#ifndef SCAN_BACKOFF
+ #define SCAN_BACKOFF 30000
+#endif
+
+// Collection tree, see NowMesh::setGateway.
+// Milliseconds between the gateway's advertisements.
+#ifndef SINK_INTERVAL
+ #define SINK_INTERVAL 10000
+#endif
+// Milliseconds without an advertisement before we forget the gateway.
+#ifndef SINK_TIMEOUT
+ #define SINK_TIMEOUT (3 * SINK_INTERVAL)
+#endif
+// Most milliseconds a node waits before passing an advertisement on, so neighbors don't all collide.
+#ifndef SINK_JITTER
+ #define SINK_JITTER 100
+#endif
+// Cost of one perfect hop. Lossy and weak links cost more.
+#ifndef SINK_HOP_COST
+ #define SINK_HOP_COST 16
+#endif
+// A new parent has to be this much cheaper than the one we have.
+#ifndef SINK_HYSTERESIS
+ #define SINK_HYSTERESIS 8
+#endif
+
+// Leaf nodes, see NowMesh::setLeaf.
+// Milliseconds a leaf stays awake after its parent last sent it something, once its own frames are out.
+#ifndef LEAF_LISTEN_TIME
+ #define LEAF_LISTEN_TIME 30
+#endif
+// Most milliseconds a leaf stays awake per wake up, however much is still going on.
+#ifndef LEAF_MAX_AWAKE
+ #define LEAF_MAX_AWAKE 500
+#endif
+// Up to this many milliseconds are added at random to each sleep, so leaves that started together
+//  don't keep waking up together and polling over each other.
+#ifndef LEAF_JITTER
+ #define LEAF_JITTER 200
+#endif
+// Most milliseconds a leaf without a parent stays awake scanning for one.
+#ifndef LEAF_SCAN_TIME
+ #define LEAF_SCAN_TIME 4000
+#endif
+// A parent forgets a child that has missed this many polls in a row, and floods the mail it held
+//  for it, in case the child has moved to another parent.
+#ifndef LEAF_MISSED_POLLS
+ #define LEAF_MISSED_POLLS 2
+#endif
+// Frames a parent can hold for its sleeping children, all told. Each one costs about MAX_MSG_LEN bytes of RAM.
+#ifndef MAILBOX_LEN
+ #define MAILBOX_LEN 4
+#endif
+// Sleeping children a parent keeps mail for.
+#ifndef MAILBOX_CHILDREN
+ #define MAILBOX_CHILDREN 4
+#endif
+
+// Persistent state, see NowMesh::setPersistence.
+// Milliseconds after boot the tables are first saved, by when they've filled up again, and between saves after that.
+// A save is skipped if nothing changed. Flash wears out after around 100000 writes, so keep the interval long
+//  if the state is kept there. RTC memory doesn't wear.
+#ifndef STATE_FIRST_SAVE
+ #define STATE_FIRST_SAVE 15000
+#endif
+#ifndef STATE_SAVE_INTERVAL
+ #define STATE_SAVE_INTERVAL 600000
+#endif
+// Routes saved, at 13 bytes each. Any more are learned again from traffic.
+#ifndef STATE_ROUTES
+ #define STATE_ROUTES 24
+#endif
+// Message ids are reserved this many at a time, and the state is saved each time, so after a reboot
+//  a node carries on past every id it may have used, whenever the tables were last saved.
+#ifndef STATE_ID_BLOCK
+ #define STATE_ID_BLOCK 1024
+#endif
+// The first 4 byte block of RTC memory the state is kept in, unless the sketch sets a store of its own.
+// The SDK leaves blocks 64 to 191 to the user.
+#ifndef STATE_RTC_BLOCK
+ #define STATE_RTC_BLOCK 64
+#endif
+
+// Tracing, see NowMesh::setTracing.
+// Events held until they're read or sent to the collector, at 22 bytes each. Any more are dropped.
+#ifndef TRACE_LEN
+ #define TRACE_LEN 64
+#endif
 
 // Set NOWMESH_DEBUG to get debugging messages on Serial.
 // Each level includes those below it.
-#define NOWMESH_DEBUG 0
+#ifndef NOWMESH_DEBUG
+ #define NOWMESH_DEBUG 0
+#endif
 #define LEVEL_UNLIKELY_ERROR 1
 #define LEVEL_ERROR 2
 #define LEVEL_NORMAL 3
 
-// Maximum message length
-//
-// Message lengths. Add 1 for each character of message sent.
-//            Minimum    Typical     Maximum
-// broadcast: 28         36          44          
-// targeted:  28         44          56
-#define MAX_MSG_LEN 65
+// Bytes of tag frames carry while a network key is set, at most 8.
+// A forged frame gets past a 4 byte tag once in four billion tries.
+#ifndef AUTH_TAG_LEN
+ #define AUTH_TAG_LEN 4
+#endif
+#if NOWMESH_AUTH
+ #define AUTH_TRAILER_LEN AUTH_TAG_LEN
+#else
+ #define AUTH_TRAILER_LEN 0
+#endif
+
+// Maximum frame length, header included, tag not.
+// 250 bytes is the most ESP Now will send in one frame, and the tag has to fit too.
+#ifndef MAX_MSG_LEN
+ #define MAX_MSG_LEN (250 - AUTH_TRAILER_LEN)
+#endif
+// Maximum length of a frame on the air.
+#define MAX_AIR_LEN (MAX_MSG_LEN + AUTH_TRAILER_LEN)
+
+// Number of frames waiting to be sent, including the one in flight, across all priority classes.
+// Once the queue is full the oldest frame waiting in the lowest class is dropped to make room.
+// Each one costs about MAX_MSG_LEN bytes of RAM.
+#ifndef TX_QUEUE_LEN
+ #define TX_QUEUE_LEN 8
+#endif
+// Milliseconds to wait for each report the SDK owes on a frame before giving up on it.
+// A flooded frame gets a report per peer, each after the radio's retries, so it gets as many times this.
+#ifndef TX_TIMEOUT
+ #define TX_TIMEOUT 100
+#endif
+
+// Number of received frames waiting for NowMesh::loop to process them.
+// Frames arriving while the queue is full are dropped.
+// Each one costs about MAX_MSG_LEN bytes of RAM.
+#ifndef RX_QUEUE_LEN
+ #define RX_QUEUE_LEN 8
+#endif
+// Most received frames NowMesh::loop will process in one call.
+#ifndef RX_BUDGET
+ #define RX_BUDGET 4
+#endif
+
+// Priority classes, highest first. Pass one to send().
+// Queued frames of a higher class are sent first, and frames of a lower class are dropped first.
+// Beacons and ACKs are sent at PRIORITY_HIGH.
+#define PRIORITY_HIGH 0
+#define PRIORITY_NORMAL 1
+#define PRIORITY_BULK 2
+#define PRIORITY_CLASSES 3
+// A class passed over this many times in a row is sent next anyway, so bulk traffic isn't starved.
+#ifndef TX_STARVATION_LIMIT
+ #define TX_STARVATION_LIMIT 8
+#endif
+
+// Send statuses reported to the send callback.
+// 0 and 1 come from ESP Now, DROPPED means the frame was pushed out of a full queue.
+#define SEND_STATUS_OK 0
+#define SEND_STATUS_FAIL 1
+#define SEND_STATUS_DROPPED 2
+
+// How broadcasts are passed on, see NowMesh::setFlooding.
+// FLOOD_ALL rebroadcasts every new broadcast.
+// FLOOD_GOSSIP rebroadcasts with a probability, except straight from the originator.
+// FLOOD_COUNTER waits a random delay and rebroadcasts only if too few neighbors did meanwhile.
+#define FLOOD_ALL 0
+#define FLOOD_GOSSIP 1
+#define FLOOD_COUNTER 2
+// Most milliseconds FLOOD_COUNTER holds a broadcast, listening for neighbors' copies.
+// Each hop adds up to this much latency. Shorter delays hear fewer copies and suppress less,
+//  since a neighbor flooding its peers takes a frame per peer.
+#ifndef FLOOD_DELAY
+ #define FLOOD_DELAY 100
+#endif
+// Broadcasts FLOOD_COUNTER can hold at once. Any more are rebroadcast right away.
+#ifndef FLOOD_PENDING
+ #define FLOOD_PENDING 4
+#endif
+
+// Number of hops a message may travel unless the sender says otherwise.
+// This bounds how far a broadcast floods even if duplicate suppression fails.
+#ifndef DEFAULT_MAX_HOPS
+ #define DEFAULT_MAX_HOPS 16
+#endif
+
+// Version of the wire format. Frames with any other version are dropped.
+#define NOWMESH_VERSION 2
+
+// Message types
+#define MESSAGE_BROADCAST 1
+#define MESSAGE_TARGETED 2
+#define MESSAGE_BEACON 3
+#define MESSAGE_AGGREGATE 4
+#define MESSAGE_ACK 5
+#define MESSAGE_STATS 6
+#define MESSAGE_SINK 7
+#define MESSAGE_POLL 8
+#define MESSAGE_POLL_REPLY 9
+#define MESSAGE_ROUTE_REQUEST 10
+#define MESSAGE_ROUTE_REPLY 11
+#define MESSAGE_TRACE 12
+
+// Every frame starts with this header. The message follows it as raw bytes.
+// Multi-byte fields are little-endian, which is what the ESP8266 uses natively.
+struct __attribute__((packed)) mesh_header {
+ uint8_t version;
+ uint8_t type;
+ uint8_t originator[6];
+ // All zeroes if the message is broadcast.
+ uint8_t target[6];
+ uint16_t id;
+ // Number of times the frame has been forwarded.
+ uint8_t hops;
+ // Number of hops the frame may still travel, counting the one it's on.
+ uint8_t ttl;
+ // FLAG_ bits.
+ uint8_t flags;
+};
+
+// Header flags
+// The message is one fragment of a longer one, and starts with a fragment_header.
+#define FLAG_FRAGMENT 0x01
+// The target should acknowledge the message.
+#define FLAG_ACK_REQUEST 0x02
+// Bits 2 and 3 hold the priority class, which forwarders keep.
+#define FLAG_PRIORITY_SHIFT 2
+#define FLAG_PRIORITY_MASK 0x0c
+// The top four bits count how many times a reliable message has been resent.
+#define FLAG_ATTEMPT_SHIFT 4
+
+// How the duplicate store tells apart frames that share an originator and id.
+// Fragments use their index, which is below 32.
+#define PART_RELIABLE 0x40
+#define PART_ACK 0x80
+// Marks a reliable message as delivered to the user, however many attempts arrive.
+#define PART_DELIVERED 0xff
+
+// Starts the message of every fragment.
+struct __attribute__((packed)) fragment_header {
+ uint8_t index;
+ uint8_t count;
+};
+
+// The longest message that fits in one frame.
+#define MAX_PAYLOAD_LEN (MAX_MSG_LEN - sizeof(mesh_header))
+
+// Reliable messages, see NowMesh::sendReliable.
+// Number of messages that can be waiting for an ACK at once. Each keeps a copy of the message.
+#ifndef PENDING_ACKS
+ #define PENDING_ACKS 4
+#endif
+// Milliseconds to wait for an ACK before the first retransmission. Doubles with every attempt.
+#ifndef ACK_TIMEOUT
+ #define ACK_TIMEOUT 250
+#endif
+// Attempts, including the first, before giving up on a message. No more than 16.
+#ifndef ACK_MAX_ATTEMPTS
+ #define ACK_MAX_ATTEMPTS 5
+#endif
 
-struct message_info {
+// Longest message that can be sent in fragments, and the most data each fragment carries.
+// Fragmented messages are reassembled in REASSEMBLY_BUFFERS buffers of MAX_FRAGMENTED_LEN bytes,
+//  and sent from one more, so lower this if you don't need long messages and RAM is tight.
+// Every node remembers each fragment it has seen separately, so raising it may mean raising
+//  STORED_MESSAGES too, which has to be at least MAX_FRAGMENTS.
+#ifndef MAX_FRAGMENTED_LEN
+ #define MAX_FRAGMENTED_LEN 4096
+#endif
+#define FRAGMENT_PAYLOAD_LEN (MAX_PAYLOAD_LEN - sizeof(fragment_header))
+#define MAX_FRAGMENTS ((MAX_FRAGMENTED_LEN + FRAGMENT_PAYLOAD_LEN - 1) / FRAGMENT_PAYLOAD_LEN)
+// Number of fragmented messages that can be reassembled at once.
+#ifndef REASSEMBLY_BUFFERS
+ #define REASSEMBLY_BUFFERS 2
+#endif
+// Milliseconds a message being reassembled waits for its next fragment before it's abandoned.
+#ifndef REASSEMBLY_TIMEOUT
+ #define REASSEMBLY_TIMEOUT 5000
+#endif
+// A broadcast floods every fragment, and nodes still passing one on can't take the next.
+// So a broadcast's fragments go one at a time, each once the one before has left the queue and
+//  no neighbor has been heard passing it on for this many milliseconds. That has to cover the
+//  flood getting another hop or two out, which in a busy mesh takes a neighbor a peer list's worth
+//  of frames each. A small mesh can send long broadcasts faster with less.
+#ifndef FRAGMENT_GAP
+ #define FRAGMENT_GAP 200
+#endif
+
+// Most messages that fit in one aggregate frame: an outer header, then a length byte and a header each.
+#define AGGREGATE_MAX_MESSAGES ((int)((MAX_MSG_LEN - sizeof(mesh_header)) / (1 + sizeof(mesh_header))))
+// A frame with less room than this left is sent without waiting for more messages.
+#define AGGREGATE_MIN_ROOM (1 + sizeof(mesh_header) + 8)
+
+// A received frame, decoded in place.
+// payload points into the receive buffer and is only valid inside the receive callback.
+struct mesh_frame {
+ mesh_header header;
+ const uint8_t* payload;
+ size_t len;
+};
+
+// What the user facing message callback gets.
+// data points straight into the received frame. It is only valid for the duration of the callback,
+//  so copy anything you want to keep.
+struct mesh_message {
+ const uint8_t* data;
+ size_t len;
+ // true if the message was targeted and we are the intended recipient
+ bool self_is_target;
+ // MAC address of the node which originally sent the message
+ uint8_t* originator;
+ uint16_t id;
+ // Number of hops the message took to reach us, 1 if it came straight from the originator.
+ uint8_t hops;
+};
+
+// Identifies a message, and every frame carrying it, across the mesh.
+// send() returns one, and the send callback reports frames by it.
+struct mesh_handle {
  uint8_t originator[6];
- uint8_t sender[6];
+ // 0 if the message could not be sent at all.
  uint16_t id;
 };
 
+// A plain function and a context pointer it gets back on every call. Unlike std::function this never
+//  allocates and calling it is one indirect call, which matters for callbacks made for every frame.
+template <typename... Args>
+struct mesh_callback {
+ void (*function)(void* context, Args... args) = NULL;
+ void* context = NULL;
+
+ explicit operator bool() const {
+  return function != NULL;
+ }
+
+ void operator()(Args... args) const {
+  function(context, args...);
+ }
+};
+
+// A reliable message waiting for its ACK.
+struct pending_info {
+ mesh_header header;
+ uint8_t data[MAX_PAYLOAD_LEN];
+ uint8_t len;
+ // millis() when the message was first sent.
+ uint32_t first_sent;
+ // millis() when it will be resent unless an ACK arrives.
+ uint32_t next_retry;
+ uint8_t attempts;
+ bool used = false;
+};
+
+// A broadcast FLOOD_COUNTER is holding, see NowMesh::setFlooding.
+struct rebroadcast_info {
+ // The header to forward it with, hops and ttl already updated.
+ mesh_header header;
+ uint8_t data[MAX_PAYLOAD_LEN];
+ uint8_t len;
+ // Dedup part of the frame, so copies of other fragments don't count.
+ uint8_t part;
+ // Copies heard, the first one included.
+ uint8_t copies;
+ // millis() when it is rebroadcast, or dropped.
+ uint32_t due;
+ bool used = false;
+};
+
+// Counters of what the mesh has been doing, see NowMesh::getStats.
+// They only ever count up, wrapping around eventually.
+// Sent as is in stats messages, so it's packed like the header.
+struct __attribute__((packed)) mesh_stats {
+ // Frames the radio handed us.
+ uint32_t frames_received;
+ // Frames, and messages in aggregates, that got past parsing.
+ uint32_t frames_parsed;
+ // Frames dropped, by reason.
+ uint32_t dropped_too_long;
+ uint32_t dropped_malformed;
+ uint32_t dropped_duplicate;
+ uint32_t dropped_self;
+ uint32_t dropped_rx_full;
+ // Messages we passed on for others.
+ uint32_t forwarded_broadcast;
+ uint32_t forwarded_targeted;
+ // Targeted messages sent to the next hop of a route, and flooded for lack of one.
+ uint32_t sent_routed;
+ uint32_t sent_flooded;
+ // Frames the SDK failed to send or never reported on, once for each peer that failed.
+ uint32_t send_failures;
+ // Frames pushed out of, or refused by, a full transmit queue.
+ uint32_t tx_dropped;
+ // Most frames ever in the transmit queue at once.
+ uint16_t tx_high_water;
+ // Microseconds spent in the receive callback, and processing frames in NowMesh::loop.
+ uint32_t receive_time;
+ uint32_t process_time;
+ // Broadcasts the flooding strategy kept us from passing on.
+ uint32_t suppressed_broadcast;
+ // Frames dropped for a missing or wrong tag, see NowMesh::setNetworkKey.
+ uint32_t dropped_unauthenticated;
+ // Milliseconds we spent awake as a leaf, counted each time we go to sleep.
+ uint32_t awake_time;
+ // Frames we held for sleeping children, handed over when they polled, and dropped for lack of room.
+ uint32_t mail_held;
+ uint32_t mail_delivered;
+ uint32_t mail_dropped;
+ // Route requests we sent, replies we sent to requests for us, and discoveries that got no reply.
+ uint32_t route_requests;
+ uint32_t route_replies;
+ uint32_t routes_not_found;
+ // Routes switched to their alternate, or dropped, because frames to their next hop kept failing.
+ uint32_t routes_broken;
+ // Routed frames sent again after failing to reach their next hop.
+ uint32_t rerouted;
+ // Times the state was saved, see NowMesh::setPersistence.
+ uint32_t state_saves;
+ // Trace events dropped because the buffer was full, see NowMesh::setTracing.
+ uint32_t trace_dropped;
+};
+
+// The message of a MESSAGE_SINK frame, advertising a gateway.
+// Each node passes it on with its own cost, so it only ever travels one hop.
+struct __attribute__((packed)) sink_advert {
+ uint8_t sink[6];
+ // Goes up with every advertisement the gateway sends.
+ uint16_t sequence;
+ // Cost of getting to the gateway from the node that sent this. 0 at the gateway itself.
+ uint16_t cost;
+};
+
+// The message of a MESSAGE_POLL frame, which a leaf sends its parent each time it wakes up.
+struct __attribute__((packed)) leaf_poll {
+ // Milliseconds until the leaf next wakes up.
+ uint32_t interval;
+};
+
+// The message of a MESSAGE_POLL_REPLY frame, a parent's answer to a poll.
+struct __attribute__((packed)) poll_reply {
+ // Frames the parent held for the leaf, which follow the reply.
+ uint8_t held;
+};
+
+// The message of a MESSAGE_ROUTE_REPLY frame.
+struct __attribute__((packed)) route_reply {
+ // The node the request was for. That's the node replying, unless it's a parent replying for its child.
+ uint8_t target[6];
+};
+
+// A target we're looking for a route to, see ROUTE_REQUEST_TIMEOUT.
+struct route_discovery {
+ uint8_t target[6];
+ // millis() when we last sent a request, and how many we've sent.
+ uint32_t sent_at;
+ uint8_t attempts;
+ // The ttl and priority class of the message that started it, which the requests get too.
+ uint8_t ttl;
+ uint8_t priority;
+ bool used = false;
+};
+
+// Trace event kinds, see NowMesh::setTracing.
+// We sent a message of our own. peer is the target, if it has one.
+#define TRACE_ORIGINATE 1
+// A message reached us for the first time, and a copy of one we already had. peer sent it.
+#define TRACE_RECEIVE 2
+#define TRACE_DUPLICATE 3
+// We queued a message to pass on.
+#define TRACE_FORWARD 4
+// The SDK reported a frame with the message in it sent to peer, or not, as status says.
+#define TRACE_SENT 5
+// We handed a message for us, or a broadcast, to the sketch.
+#define TRACE_DELIVER 6
+
+// The start of every run of trace events, from NowMesh::readTrace and in MESSAGE_TRACE frames.
+// count events of the node follow it.
+#define TRACE_SYNC 0x544e
+struct __attribute__((packed)) trace_batch {
+ // TRACE_SYNC, so a reader can find batches in a stream of bytes.
+ uint16_t sync;
+ // The node's station MAC, which messages name it by, and its softAP MAC, which neighbors' events
+ //  name it by as their peer.
+ uint8_t node[6];
+ uint8_t link[6];
+ // Counts the node's batches from 0 at boot, so batches that arrive out of order, or from a node
+ //  that rebooted, can be told apart.
+ uint16_t sequence;
+ uint8_t count;
+};
+// Most events a MESSAGE_TRACE frame carries.
+#define TRACE_FRAME_EVENTS ((int)((MAX_PAYLOAD_LEN - sizeof(trace_batch)) / sizeof(trace_event)))
+
+// A route in the saved state.
+struct __attribute__((packed)) saved_route {
+ uint8_t destination[6];
+ uint8_t next_hop[6];
+ uint8_t hops;
+};
+
+// What's kept across reboots, see NowMesh::setPersistence.
+// Restored only if magic, len and checksum all match, so a build with other table sizes starts afresh.
+#define STATE_MAGIC 0x534d4e01
+struct __attribute__((packed)) mesh_state {
+ uint32_t magic;
+ uint16_t len;
+ // FNV-1a over everything after it.
+ uint32_t checksum;
+ // Times the node has booted, this time included.
+ uint32_t boots;
+ // The last message id reserved. Ids up to it may have been used.
+ uint16_t id_limit;
+ uint8_t peer_count;
+ uint8_t route_count;
+ uint8_t peers[MAX_PEERS][6];
+ saved_route routes[STATE_ROUTES];
+};
+
+// A sleeping child we keep mail for.
+struct child_info {
+ // Its softAP MAC, which it polls from and we send to, and its station MAC, which messages for it
+ //  are addressed to.
+ uint8_t mac[6];
+ uint8_t station[6];
+ uint32_t interval;
+ // millis() when it last polled.
+ uint32_t last_poll;
+ // Whether it may still be awake from that poll, and whether it's still a peer.
+ bool awake;
+ bool peered;
+ bool used = false;
+};
+
+// Where we stand in the collection tree.
+struct sink_info {
+ uint8_t sink[6];
+ // Neighbor we send to for the gateway.
+ uint8_t parent[6];
+ uint16_t cost;
+ uint16_t sequence;
+ // millis() when we last heard an advertisement.
+ uint32_t last_heard;
+ bool valid = false;
+};
+
+// The settings this build was compiled with, as typed constants.
+struct nowmesh_config {
+ static constexpr uint8_t channel = CHANNEL;
+ static constexpr uint16_t channel_candidates = CHANNEL_CANDIDATES;
+ static constexpr int stored_messages = STORED_MESSAGES;
+ static constexpr int max_routes = MAX_ROUTES;
+ static constexpr int max_peers = MAX_PEERS;
+ static constexpr int max_msg_len = MAX_MSG_LEN;
+ static constexpr int tx_queue_len = TX_QUEUE_LEN;
+ static constexpr int rx_queue_len = RX_QUEUE_LEN;
+ static constexpr int pending_acks = NOWMESH_RELIABLE ? PENDING_ACKS : 0;
+ static constexpr int max_fragmented_len = NOWMESH_FRAGMENTATION ? MAX_FRAGMENTED_LEN : (int)MAX_PAYLOAD_LEN;
+ static constexpr bool reliable = NOWMESH_RELIABLE;
+ static constexpr bool aggregation = NOWMESH_AGGREGATION;
+ static constexpr bool fragmentation = NOWMESH_FRAGMENTATION;
+ static constexpr bool stats = NOWMESH_STATS;
+ static constexpr bool collection = NOWMESH_COLLECTION;
+ static constexpr bool flood_control = NOWMESH_FLOOD_CONTROL;
+ static constexpr bool bridge = NOWMESH_BRIDGE;
+ static constexpr bool auth = NOWMESH_AUTH;
+ static constexpr int auth_tag_len = AUTH_TRAILER_LEN;
+ static constexpr bool leaf = NOWMESH_LEAF;
+ static constexpr int mailbox_len = NOWMESH_LEAF ? MAILBOX_LEN : 0;
+ static constexpr bool route_discovery = NOWMESH_ROUTE_DISCOVERY;
+ static constexpr int route_pending_len = NOWMESH_ROUTE_DISCOVERY ? ROUTE_PENDING_LEN : 0;
+ static constexpr bool reroute = NOWMESH_REROUTE;
+ static constexpr bool persist = NOWMESH_PERSIST;
+ static constexpr bool trace = NOWMESH_TRACE;
+ static constexpr int trace_len = NOWMESH_TRACE ? TRACE_LEN : 0;
+};
+
+static_assert(MAX_AIR_LEN <= 250, "ESP Now frames are at most 250 bytes, tag included");
+static_assert(AUTH_TAG_LEN >= 1 && AUTH_TAG_LEN <= 8, "Tags are 1 to 8 bytes of a 64 bit hash");
+static_assert(MAX_PAYLOAD_LEN > sizeof(fragment_header) + sizeof(mesh_header), "MAX_MSG_LEN leaves no room for messages");
+static_assert(!NOWMESH_FRAGMENTATION || MAX_FRAGMENTS <= 255, "Fragments are counted in a byte");
+static_assert(!NOWMESH_FRAGMENTATION || STORED_MESSAGES >= MAX_FRAGMENTS, "STORED_MESSAGES must cover every fragment of the longest message, or its first fragments are forgotten before its last arrive");
+static_assert(ACK_MAX_ATTEMPTS >= 1 && ACK_MAX_ATTEMPTS <= 16, "The attempt count has four bits");
+static_assert(PRIORITY_CLASSES <= 4, "The priority class has two bits");
+static_assert(CHANNEL >= 1 && CHANNEL <= 14, "WiFi channels go from 1 to 14");
+static_assert(ROUTE_REQUEST_ATTEMPTS >= 1, "Route discovery needs to send at least one request");
+static_assert(LINK_FAILURES >= 1 && LINK_FAILURES <= 255, "The failure count is one byte");
+static_assert(TRACE_FRAME_EVENTS >= 1 && TRACE_FRAME_EVENTS <= 255, "Trace frames must hold at least one event");
+static_assert(STATE_ROUTES >= 0 && STATE_ROUTES <= 255 && MAX_PEERS <= 255, "The saved state counts peers and routes in a byte");
+static_assert(STATE_ID_BLOCK >= 1 && STATE_ID_BLOCK < 32768, "Reserve less than half the message ids at a time");
+static_assert(!NOWMESH_PERSIST || (STATE_RTC_BLOCK >= 64 && STATE_RTC_BLOCK * 4 + sizeof(mesh_state) <= 192 * 4), "The saved state doesn't fit in the RTC user memory");
+
+// What we know about a peer. Kept from scan to scan.
 struct peer_info {
  uint8_t mac[6] = {0, 0, 0, 0, 0, 0};
- int16_t score = 0;
+ // Smoothed signal strength, in 1/16 dBm.
+ int16_t rssi = 0;
+ // Bonus for previous contact, from the messages we've stored.
+ int16_t contact = 0;
+ // Smoothed share of our frames the peer acknowledged, 0 to 255.
+ // Starts out optimistic, as we haven't sent it anything yet.
+ int16_t delivery = 255;
+ // Number of scans in a row the peer has been missing from.
+ uint8_t missed = 0;
+ // millis() when a scan last saw the peer.
+ uint32_t last_seen = 0;
+ // Routed frames in a row that didn't reach the peer.
+ uint8_t failures = 0;
+ bool used = false;
 };
 
+// One mesh node. All of its state lives in the object, so a host program can run many of them
+//  side by side. On the ESP8266 there is one radio, and the node that last called begin() gets its callbacks.
+// The object holds all the node's buffers, several KB of them, so make it a global rather than a local.
 class NowMesh {
 protected:
- static message_info message_store[STORED_MESSAGES];
+ // The node the SDK callbacks go to.
+ static NowMesh* instance;
+
+ // This is where we store messages.
+ MessageCache<STORED_MESSAGES> message_store;
+ // This is where we keep track of how to reach other nodes.
+ RouteTable<MAX_ROUTES> route_table;
+
+ // User facing callbacks for when we receive a message or a message has been sent.
+ // These callbacks won't get the whole message, only the part that was sent with NowMesh::send by the other node.
+ // Both are called for every frame, so they're plain function pointers. The std::function setters
+ //  keep the function here and point the callback at a static member that calls it.
+ // A String receive callback is wrapped into a message function, so there is only one to call.
+ mesh_callback<const mesh_message&> messageCallback;
+ mesh_callback<const mesh_handle&, int> sendCallback;
+ std::function<void(const mesh_message&)> messageFunction;
+ std::function<void(const mesh_handle&, int)> sendFunction;
+ static void ICACHE_FLASH_ATTR callMessageFunction(void* context, const mesh_message& message);
+ static void ICACHE_FLASH_ATTR callSendFunction(void* context, const mesh_handle& handle, int status);
+#if NOWMESH_RELIABLE
+ // And for when a reliable message has been acknowledged, or given up on.
+ std::function<void(const mesh_handle&, bool, uint32_t, uint8_t)> deliveryCallback;
+ // Reliable messages we've sent and are waiting for ACKs for.
+ pending_info pending[PENDING_ACKS];
+#endif
+#if NOWMESH_STATS
+ // And for stats messages from other nodes.
+ std::function<void(const uint8_t*, const mesh_stats&)> statsCallback;
+ mesh_stats stats = {};
+#endif
+
+ // Frames waiting to be sent, by priority class.
+ // Frames go out one at a time, the next one when the SDK reports the last one sent.
+ // Only one frame is ever in flight, at the front of class tx_class.
+ TxQueue<TX_QUEUE_LEN, MAX_MSG_LEN, PRIORITY_CLASSES> tx_queue;
+ bool tx_in_flight = false;
+ uint8_t tx_class = 0;
+ // Number of frames sent in a row while each class had frames waiting.
+ uint8_t tx_skipped[PRIORITY_CLASSES] = {};
+ // Number of send reports still due for the frame in flight. A flooded frame gets one per peer.
+ uint8_t tx_pending = 0;
+ uint32_t tx_sent_at = 0;
+ uint32_t tx_timeout = 0;
+ // Reports still due for a frame we gave up on. They come before the next frame's, and are dropped.
+ uint8_t tx_stale = 0;
+#if NOWMESH_AGGREGATION
+ // Milliseconds frames wait for others to join them, 0 if aggregation is off.
+ uint16_t aggregate_window = 0;
+#endif
+#if NOWMESH_FLOOD_CONTROL
+ uint8_t flood_mode = FLOOD_ALL;
+ // Percent chance of passing a broadcast on for FLOOD_GOSSIP, copies that silence us for FLOOD_COUNTER.
+ uint8_t flood_parameter = 0;
+ rebroadcast_info rebroadcasts[FLOOD_PENDING];
+ void ICACHE_FLASH_ATTR copyHeard(const uint8_t* originator, uint16_t id, uint8_t part);
+ void ICACHE_FLASH_ATTR flushRebroadcasts(uint32_t now);
+#endif
+
+#if NOWMESH_FRAGMENTATION
+ // The message being sent in fragments. tx_fragments_left is 0 when there isn't one.
+ uint8_t tx_fragmented[MAX_FRAGMENTED_LEN];
+ size_t tx_fragmented_len = 0;
+ mesh_header tx_fragment_header;
+ uint8_t tx_fragment_count = 0;
+ uint8_t tx_fragments_left = 0;
+ // millis() when the last broadcast fragment was last queued, or heard back from a neighbor.
+ uint32_t tx_fragment_at = 0;
+ // Fragmented messages being put back together.
+ ReassemblyPool<REASSEMBLY_BUFFERS, MAX_FRAGMENTED_LEN, FRAGMENT_PAYLOAD_LEN> reassembly;
+#endif
+
+ // Our station MAC address, which every frame we originate carries. Set in begin().
+ uint8_t self_mac[6] = {0, 0, 0, 0, 0, 0};
+ // Our softAP MAC address, which neighbors find in scans and add us as a peer by, so it's the one
+ //  the SDK gives them as where our frames came from. Set in begin().
+ uint8_t link_mac[6] = {0, 0, 0, 0, 0, 0};
+ // Channel we and our peers are on.
+ uint8_t channel = CHANNEL;
+ // The scan in progress is NowMesh::probeChannel's, not one for peers.
+ bool probing = false;
+ uint8_t probe_cluster_size = 0;
+ void ICACHE_FLASH_ATTR probeDone(struct bss_info* ap_link);
+#if NOWMESH_BRIDGE
+ std::function<void(const uint8_t*, size_t)> bridgeCallback;
+ // The frame being processed came in over the bridge, so it mustn't go back out over it.
+ bool bridge_inbound = false;
+ // Next hop of routes through the bridge.
+ static const uint8_t bridge_mac[6];
+ void ICACHE_FLASH_ATTR bridgeOut(const mesh_header& header, const uint8_t* message, size_t len);
+#endif
+#if NOWMESH_AUTH
+ // Set by NowMesh::setNetworkKey, which works out the key's hash state once for every frame after.
+ SipHash auth_key;
+ bool authenticated = false;
+ void ICACHE_FLASH_ATTR appendTag(const uint8_t* mac, uint8_t* data, size_t len);
+ bool ICACHE_FLASH_ATTR tagMatches(const uint8_t* mac, const uint8_t* data, size_t len);
+#endif
+ // Peers we know about, kept from scan to scan.
+ peer_info peer_store[MAX_PEERS];
+ // Beacons are sent here.
+ static const uint8_t broadcast_mac[6];
+
+ // Receive queue. The receive callback only copies frames in here, NowMesh::loop processes them.
+ RxQueue<RX_QUEUE_LEN, MAX_AIR_LEN> rx_queue;
 
- static std::function<void(String, bool, uint8_t*)> receiveCallback;
- static std::function<void(int)> sendCallback; 
- 
+ // The SDK takes plain function pointers, so these pass its callbacks on to instance.
  static void ICACHE_FLASH_ATTR scanDoneCallback(void* arg, STATUS status);
  static void ICACHE_FLASH_ATTR receiveData(unsigned char* mac, unsigned char* data, uint8_t len);
- static void ICACHE_FLASH_ATTR sendData(unsigned char* mac_addr, unsigned char status); 
+ static void ICACHE_FLASH_ATTR sendData(unsigned char* mac_addr, unsigned char status);
 
- static void ICACHE_FLASH_ATTR nowmeshDebug(String message, int level);
- 
- static int ICACHE_FLASH_ATTR sendMessage(uint8_t* target, char* data);
- static int ICACHE_FLASH_ATTR sendBroadcast(String message, uint8_t* originator, uint16_t message_id);
- static int ICACHE_FLASH_ATTR sendTargeted(String message, uint8_t* originator, uint8_t* target, uint16_t message_id);
+ int ICACHE_FLASH_ATTR findPeer(const uint8_t* mac);
+ static int16_t ICACHE_FLASH_ATTR peerScore(const peer_info& peer);
+ static uint32_t ICACHE_FLASH_ATTR contactKey(const uint8_t* mac);
+ int ICACHE_FLASH_ATTR recentContacts(uint32_t* keys);
+ static int16_t ICACHE_FLASH_ATTR contactBonus(const uint32_t* keys, int count, const uint8_t* mac);
+ int ICACHE_FLASH_ATTR learnPeer(const uint8_t* mac, uint32_t now);
+ int ICACHE_FLASH_ATTR neighborCount(uint32_t now);
+ void ICACHE_FLASH_ATTR updateDelivery(const uint8_t* mac, bool delivered);
+ void ICACHE_FLASH_ATTR receiveFrame(uint8_t* mac, const uint8_t* data, uint8_t len);
+ void ICACHE_FLASH_ATTR processFrame(uint8_t* mac, const uint8_t* data, uint8_t len);
+
+ static bool ICACHE_FLASH_ATTR parseFrame(const uint8_t* data, size_t len, mesh_frame& frame);
+ static size_t ICACHE_FLASH_ATTR buildFrame(uint8_t* data, const mesh_header& header, const uint8_t* message, size_t len);
+ static int ICACHE_FLASH_ATTR frameHandles(const tx_frame<MAX_MSG_LEN>& frame, mesh_handle* handles);
+ void ICACHE_FLASH_ATTR reportSent(const mesh_handle* handles, int count, int status);
+ static bool ICACHE_FLASH_ATTR isAggregate(const tx_frame<MAX_MSG_LEN>& frame);
+#if NOWMESH_AGGREGATION
+ bool ICACHE_FLASH_ATTR coalesce(uint8_t* target, const uint8_t* data, size_t len);
+#endif
+ static bool ICACHE_FLASH_ATTR isBroadcast(const tx_frame<MAX_MSG_LEN>& frame);
+ static uint8_t ICACHE_FLASH_ATTR frameClass(const uint8_t* data);
+ int ICACHE_FLASH_ATTR nextClass();
+ int ICACHE_FLASH_ATTR retireFrame(mesh_handle* handles);
+ void ICACHE_FLASH_ATTR pumpQueue();
+ bool ICACHE_FLASH_ATTR isStaleReport(const uint8_t* mac);
+#if NOWMESH_FRAGMENTATION
+ void ICACHE_FLASH_ATTR feedFragments();
+ bool ICACHE_FLASH_ATTR fragmentQueued();
+#endif
+ void ICACHE_FLASH_ATTR sendAck(const mesh_header& message);
+#if NOWMESH_RELIABLE
+ void ICACHE_FLASH_ATTR ackReceived(const uint8_t* acker, uint16_t id, uint32_t now);
+ void ICACHE_FLASH_ATTR reportDelivery(const pending_info& entry, bool delivered, uint32_t now);
+ void ICACHE_FLASH_ATTR retryPending(uint32_t now);
+#endif
+ int ICACHE_FLASH_ATTR sendMessage(uint8_t* target, uint8_t* data, size_t len);
+ int ICACHE_FLASH_ATTR sendBroadcast(const mesh_header& header, const uint8_t* message, size_t len);
+ int ICACHE_FLASH_ATTR sendTargeted(const mesh_header& header, const uint8_t* message, size_t len);
+ void ICACHE_FLASH_ATTR rebroadcast(const mesh_header& header, const uint8_t* message, size_t len, uint8_t part);
 
 private:
  uint16_t last_message_id = 0;
+ bool discovery = false;
+ uint32_t last_beacon = 0;
+ uint32_t last_scan = 0;
+
+#if NOWMESH_COLLECTION
+ // Whether we're the gateway, and the advertisements we've sent as one.
+ bool gateway = false;
+ uint16_t sink_sequence = 0;
+ uint32_t last_sink_advert = 0;
+ sink_info sink;
+ // When to pass on the advertisement we last adopted, if one is waiting.
+ bool sink_advert_due = false;
+ uint32_t sink_advert_at = 0;
+ uint16_t ICACHE_FLASH_ATTR linkCost(const uint8_t* mac);
+ void ICACHE_FLASH_ATTR sinkAdvertReceived(const uint8_t* mac, const sink_advert& advert, uint32_t now);
+ void ICACHE_FLASH_ATTR sendSinkAdvert(const uint8_t* sink_mac, uint16_t sequence, uint16_t cost);
+#endif
+
+#if NOWMESH_LEAF
+ // While we're a leaf, milliseconds between wake ups. 0 if we're not one.
+ uint32_t leaf_interval = 0;
+ // The parent we send everything through, and whether the sketch chose it or we pick it each wake up.
+ uint8_t leaf_parent[6];
+ bool leaf_fixed_parent = false;
+ bool leaf_has_parent = false;
+ bool leaf_asleep = false;
+ // millis() when we last woke up, last heard from the parent, are due to wake up, and started
+ //  scanning for a parent, if we are.
+ uint32_t leaf_woke_at = 0;
+ uint32_t leaf_heard_at = 0;
+ uint32_t leaf_wake_at = 0;
+ uint32_t leaf_scan_at = 0;
+ bool leaf_scanning = false;
+ // Whether the parent answered this wake up's poll, and how many frames it said it held for us.
+ bool leaf_answered = false;
+ uint8_t leaf_held = 0;
+ std::function<void(uint32_t)> sleepCallback;
+ // Our sleeping children, and the frames we hold for them.
+ child_info children[MAILBOX_CHILDREN];
+ Mailbox<MAILBOX_LEN, MAX_MSG_LEN> mailbox;
+ bool ICACHE_FLASH_ATTR leafAwake(uint32_t now);
+ void ICACHE_FLASH_ATTR leafWake(uint32_t now);
+ void ICACHE_FLASH_ATTR leafSleep(uint32_t now);
+ bool ICACHE_FLASH_ATTR chooseParent();
+ void ICACHE_FLASH_ATTR leafPoll();
+ void ICACHE_FLASH_ATTR childPolled(const uint8_t* mac, const uint8_t* station, const leaf_poll& poll, uint32_t now);
+ bool ICACHE_FLASH_ATTR isChild(const uint8_t* station);
+ bool ICACHE_FLASH_ATTR holdForChild(const uint8_t* target, const uint8_t* data, size_t len);
+ void ICACHE_FLASH_ATTR serviceChildren(uint32_t now);
+#endif
+
+#if NOWMESH_ROUTE_DISCOVERY
+ // Targets we're looking for routes to, and the frames waiting for them.
+ route_discovery discoveries[ROUTE_DISCOVERIES];
+ Mailbox<ROUTE_PENDING_LEN, MAX_MSG_LEN> route_pending;
+ bool ICACHE_FLASH_ATTR holdForRoute(const mesh_header& header, const uint8_t* data, size_t len);
+ void ICACHE_FLASH_ATTR sendRouteRequest(route_discovery& discovery);
+ void ICACHE_FLASH_ATTR routeLearned(const uint8_t* target, uint32_t now);
+ void ICACHE_FLASH_ATTR serviceDiscoveries(uint32_t now);
+#endif
+
+#if NOWMESH_REROUTE
+ // Set while we send a failed frame again, so the copy isn't sent again if it fails too.
+ bool rerouting = false;
+ void ICACHE_FLASH_ATTR linkFailed(const uint8_t* mac);
+ void ICACHE_FLASH_ATTR rerouteFrame(uint8_t* data, size_t len, const uint8_t* failed, int status);
+ void ICACHE_FLASH_ATTR rerouteMessage(uint8_t* data, size_t len, const uint8_t* failed, int status);
+#endif
+
+#if NOWMESH_PERSIST
+ // Whether the state is saved, and where to if not RTC memory.
+ bool persistent = false;
+ std::function<bool(const uint8_t*, size_t)> stateSaveCallback;
+ std::function<bool(uint8_t*, size_t)> stateLoadCallback;
+ uint32_t boots = 0;
+ uint16_t id_limit = 0;
+ // Checksum of the state last saved, and millis() when it's next saved if it changed.
+ uint32_t state_checksum = 0;
+ uint32_t state_due = 0;
+ static uint32_t ICACHE_FLASH_ATTR stateChecksum(const mesh_state& state);
+ void ICACHE_FLASH_ATTR restoreState();
+ bool ICACHE_FLASH_ATTR saveState(bool force);
+#endif
+
+#if NOWMESH_TRACE
+ // Whether events are recorded, and where they go every trace_interval milliseconds, if it isn't 0.
+ bool tracing = false;
+ TraceBuffer<TRACE_LEN> trace_buffer;
+ uint8_t trace_collector[6];
+ uint32_t trace_interval = 0;
+ uint32_t last_trace = 0;
+ uint16_t trace_sequence = 0;
+ std::function<void(const uint8_t*, size_t)> traceCallback;
+ void ICACHE_FLASH_ATTR traceEvent(uint8_t event, const mesh_header& header, const uint8_t* peer, uint8_t status);
+ void ICACHE_FLASH_ATTR traceSent(const tx_frame<MAX_MSG_LEN>& frame, const uint8_t* peer, uint8_t status);
+ void ICACHE_FLASH_ATTR sendTrace();
+#endif
+
+#if NOWMESH_STATS
+ // Where stats messages go every stats_interval milliseconds, if stats_interval isn't 0.
+ uint8_t stats_collector[6];
+ uint32_t stats_interval = 0;
+ uint32_t last_stats = 0;
+ void ICACHE_FLASH_ATTR sendStats();
+#endif
+
+ void ICACHE_FLASH_ATTR sendBeacon();
+ void ICACHE_FLASH_ATTR floodRouteRequest(const mesh_header& header);
+ void ICACHE_FLASH_ATTR sendRouteReply(const mesh_header& request);
+
+ void ICACHE_FLASH_ATTR newHeader(mesh_header& header, uint8_t* target, uint8_t max_hops, uint8_t priority);
   
 public:
  NowMesh();
  void ICACHE_FLASH_ATTR begin();
+ // What the SDK callbacks end up calling. A simulated radio can call these directly.
+ void ICACHE_FLASH_ATTR handleScanDone(void* arg, STATUS status);
+ void ICACHE_FLASH_ATTR handleReceive(unsigned char* mac, unsigned char* data, uint8_t len);
+ void ICACHE_FLASH_ATTR handleSent(unsigned char* mac_addr, unsigned char status);
+ void ICACHE_FLASH_ATTR loop();
  void ICACHE_FLASH_ATTR setReceiveCallback(std::function<void(String, bool, uint8_t*)> callback);
+ void ICACHE_FLASH_ATTR setMessageCallback(std::function<void(const mesh_message&)> callback);
  void ICACHE_FLASH_ATTR setSendCallback(std::function<void(int)> callback);
+ void ICACHE_FLASH_ATTR setSendStatusCallback(std::function<void(const mesh_handle&, int)> callback);
+ void ICACHE_FLASH_ATTR setMessageHandler(void (*handler)(void* context, const mesh_message& message), void* context = NULL);
+ void ICACHE_FLASH_ATTR setSendStatusHandler(void (*handler)(void* context, const mesh_handle& handle, int status), void* context = NULL);
+#if NOWMESH_RELIABLE
+ void ICACHE_FLASH_ATTR setDeliveryCallback(std::function<void(const mesh_handle&, bool, uint32_t, uint8_t)> callback);
+#endif
  void ICACHE_FLASH_ATTR scanForPeers();
- void ICACHE_FLASH_ATTR send(String message);
- void ICACHE_FLASH_ATTR send(String message, uint8_t* target);
+ void ICACHE_FLASH_ATTR setDiscovery(bool enabled);
+#if NOWMESH_AGGREGATION
+ void ICACHE_FLASH_ATTR setAggregation(uint16_t window);
+#endif
+#if NOWMESH_FLOOD_CONTROL
+ void ICACHE_FLASH_ATTR setFlooding(uint8_t mode, uint8_t parameter = 0);
+#endif
+ void ICACHE_FLASH_ATTR setChannel(uint8_t channel);
+ uint8_t ICACHE_FLASH_ATTR getChannel();
+ void ICACHE_FLASH_ATTR probeChannel(uint8_t cluster_size = 0);
+#if NOWMESH_BRIDGE
+ void ICACHE_FLASH_ATTR setBridgeCallback(std::function<void(const uint8_t*, size_t)> callback);
+ void ICACHE_FLASH_ATTR bridgeReceive(const uint8_t* frame, size_t len);
+#endif
+#if NOWMESH_AUTH
+ void ICACHE_FLASH_ATTR setNetworkKey(const uint8_t* key);
+#endif
+#if NOWMESH_LEAF
+ void ICACHE_FLASH_ATTR setLeaf(uint32_t interval, const uint8_t* parent = NULL);
+ void ICACHE_FLASH_ATTR setSleepCallback(std::function<void(uint32_t)> callback);
+#endif
+#if NOWMESH_PERSIST
+ void ICACHE_FLASH_ATTR setPersistence(bool enabled);
+ void ICACHE_FLASH_ATTR setStateStore(std::function<bool(const uint8_t*, size_t)> save, std::function<bool(uint8_t*, size_t)> load);
+ uint32_t ICACHE_FLASH_ATTR getBootCount();
+#endif
+#if NOWMESH_COLLECTION
+ void ICACHE_FLASH_ATTR setGateway(bool enabled);
+ bool ICACHE_FLASH_ATTR getGateway(uint8_t* mac);
+ mesh_handle ICACHE_FLASH_ATTR sendToGateway(const uint8_t* message, size_t len, uint8_t priority = PRIORITY_NORMAL);
+#endif
+#if NOWMESH_TRACE
+ void ICACHE_FLASH_ATTR setTracing(bool enabled);
+ size_t ICACHE_FLASH_ATTR readTrace(uint8_t* buffer, size_t len);
+ void ICACHE_FLASH_ATTR setTraceReporting(uint8_t* collector, uint32_t interval);
+ void ICACHE_FLASH_ATTR setTraceCallback(std::function<void(const uint8_t*, size_t)> callback);
+#endif
+#if NOWMESH_STATS
+ mesh_stats ICACHE_FLASH_ATTR getStats();
+ void ICACHE_FLASH_ATTR setStatsReporting(uint8_t* collector, uint32_t interval);
+ void ICACHE_FLASH_ATTR setStatsCallback(std::function<void(const uint8_t*, const mesh_stats&)> callback);
+#endif
+ mesh_handle ICACHE_FLASH_ATTR send(String message);
+ mesh_handle ICACHE_FLASH_ATTR send(String message, uint8_t* target, uint8_t max_hops = DEFAULT_MAX_HOPS, uint8_t priority = PRIORITY_NORMAL);
+ mesh_handle ICACHE_FLASH_ATTR send(const uint8_t* message, size_t len);
+ mesh_handle ICACHE_FLASH_ATTR send(const uint8_t* message, size_t len, uint8_t* target, uint8_t max_hops = DEFAULT_MAX_HOPS, uint8_t priority = PRIORITY_NORMAL);
+#if NOWMESH_RELIABLE
+ mesh_handle ICACHE_FLASH_ATTR sendReliable(const uint8_t* message, size_t len, uint8_t* target, uint8_t max_hops = DEFAULT_MAX_HOPS, uint8_t priority = PRIORITY_NORMAL);
+#endif
 };
@@ -0,0 +1,112 @@
+#ifndef NOWMESH_REASSEMBLY_H
+#define NOWMESH_REASSEMBLY_H
+
+#include <stdint.h>
+#include <string.h>
+
+// A message being put back together from its fragments.
+template <int buffer_len>
+struct reassembly_info {
+ uint8_t originator[6];
+ uint16_t id;
+ uint8_t count;
+ // Bit i is set once fragment i has arrived.
+ uint32_t received;
+ // Length of the whole message, known once the last fragment has arrived.
+ uint16_t len;
+ // millis() when its latest fragment arrived.
+ uint32_t updated;
+ bool used;
+ uint8_t data[buffer_len];
+};
+
+// Fixed pool of buffers for reassembling fragmented messages.
+// Every fragment but the last carries exactly fragment_len bytes, so fragment i always
+//  goes at offset i * fragment_len, whatever order fragments arrive in.
+// A message that goes timeout milliseconds without a new fragment is abandoned, so a long one
+//  sent slowly isn't given up on while its fragments are still coming.
+template <int buffers, int buffer_len, int fragment_len>
+class ReassemblyPool {
+ static_assert(buffers > 0, "ReassemblyPool needs at least one buffer");
+ static_assert((buffer_len + fragment_len - 1) / fragment_len <= 32, "ReassemblyPool tracks at most 32 fragments");
+
+ reassembly_info<buffer_len> pool[buffers];
+ uint32_t timeout;
+
+public:
+ // Most fragments a message that fits in a buffer can have.
+ static const int max_fragments = (buffer_len + fragment_len - 1) / fragment_len;
+
+ ReassemblyPool(uint32_t timeout) : timeout(timeout) {
+  memset(pool, 0, sizeof(pool));
+ }
+
+ // Add a fragment. Once it completes its message, returns the reassembled message
+ //  and sets len to its length. The caller must release it when done.
+ // Returns NULL if the message isn't complete yet, or the fragment had to be dropped.
+ const uint8_t* add(const uint8_t* originator, uint16_t id, uint8_t index, uint8_t count, const uint8_t* data, size_t data_len, uint32_t now, size_t& len) {
+  if (count == 0 || count > max_fragments || index >= count) {
+   return NULL;
+  }
+  // Every fragment but the last is full, and the last one has to fit.
+  if (index < count - 1 ? data_len != (size_t)fragment_len : index * fragment_len + data_len > (size_t)buffer_len) {
+   return NULL;
+  }
+  reassembly_info<buffer_len>* entry = NULL;
+  reassembly_info<buffer_len>* spare = NULL;
+  for (int i = 0; i < buffers; i++) {
+   reassembly_info<buffer_len>& candidate = pool[i];
+   if (candidate.used && now - candidate.updated > timeout) {
+    candidate.used = false;
+   }
+   if (!candidate.used) {
+    if (spare == NULL) {
+     spare = &candidate;
+    }
+    continue;
+   }
+   if (candidate.id == id && memcmp(candidate.originator, originator, 6) == 0) {
+    entry = &candidate;
+    break;
+   }
+  }
+  if (entry == NULL) {
+   // All buffers are busy with messages that haven't timed out.
+   if (spare == NULL) {
+    return NULL;
+   }
+   entry = spare;
+   memcpy(entry->originator, originator, 6);
+   entry->id = id;
+   entry->count = count;
+   entry->received = 0;
+   entry->len = 0;
+   entry->used = true;
+  }
+  if (entry->count != count) {
+   return NULL;
+  }
+  entry->updated = now;
+  memcpy(entry->data + index * fragment_len, data, data_len);
+  entry->received |= 1UL << index;
+  if (index == count - 1) {
+   entry->len = index * fragment_len + data_len;
+  }
+  if (entry->received != (count == 32 ? 0xffffffffUL : (1UL << count) - 1)) {
+   return NULL;
+  }
+  len = entry->len;
+  return entry->data;
+ }
+
+ // Free the buffer of a message add returned.
+ void release(const uint8_t* data) {
+  for (int i = 0; i < buffers; i++) {
+   if (pool[i].data == data) {
+    pool[i].used = false;
+   }
+  }
+ }
+};
+
+#endif
@@ -0,0 +1,200 @@
+#ifndef NOWMESH_ROUTE_TABLE_H
+#define NOWMESH_ROUTE_TABLE_H
+
+#include <stdint.h>
+#include <string.h>
+
+// How to reach one destination.
+struct route_info {
+ uint8_t destination[6];
+ // The peer to hand frames for destination to.
+ uint8_t next_hop[6];
+ // Hops from us to destination through next_hop. 1 means destination is next_hop.
+ uint8_t hops;
+ // millis() when the route was last confirmed.
+ uint32_t last_seen;
+ // A second way to destination, through another neighbor, to fall back on if next_hop fails.
+ // alternate_hops is 0 if there is none.
+ uint8_t alternate[6];
+ uint8_t alternate_hops;
+ uint32_t alternate_seen;
+ bool used;
+};
+
+// Fixed capacity routing table keyed by destination MAC address.
+// Each destination hashes to a home slot and may live anywhere in the probe_window slots after it.
+// Lookups and updates look at no more than probe_window slots, so they are constant time.
+// When every slot in the window is taken the stalest route there is replaced.
+template <int capacity, int probe_window = 8>
+class RouteTable {
+ static_assert(capacity >= probe_window, "RouteTable capacity must be at least probe_window");
+
+ route_info routes[capacity];
+ uint32_t timeout;
+
+ static int home(const uint8_t* destination) {
+  // FNV-1a over the MAC address.
+  uint32_t hash = 2166136261u;
+  for (int i = 0; i < 6; i++) {
+   hash = (hash ^ destination[i]) * 16777619u;
+  }
+  return hash % capacity;
+ }
+
+ bool expired(const route_info& route, uint32_t now) const {
+  return now - route.last_seen > timeout;
+ }
+
+ bool hasAlternate(const route_info& route, uint32_t now) const {
+  return route.alternate_hops > 0 && now - route.alternate_seen <= timeout;
+ }
+
+ static void setAlternate(route_info& route, const uint8_t* next_hop, uint8_t hops, uint32_t seen) {
+  memcpy(route.alternate, next_hop, 6);
+  route.alternate_hops = hops;
+  route.alternate_seen = seen;
+ }
+
+ int find(const uint8_t* destination) const {
+  int slot = home(destination);
+  for (int i = 0; i < probe_window; i++) {
+   if (!routes[slot].used) {
+    // Routes are never removed, only replaced, so the destination can't be further on.
+    return -1;
+   }
+   if (memcmp(routes[slot].destination, destination, 6) == 0) {
+    return slot;
+   }
+   slot = (slot + 1) % capacity;
+  }
+  return -1;
+ }
+
+public:
+ static constexpr int size = capacity;
+
+ // Routes not confirmed for timeout milliseconds are ignored and may be replaced.
+ RouteTable(uint32_t timeout) : timeout(timeout) {
+  memset(routes, 0, sizeof(routes));
+ }
+
+ // Get the route to destination, or NULL if we don't have a fresh one.
+ const route_info* lookup(const uint8_t* destination, uint32_t now) const {
+  int slot = find(destination);
+  if (slot < 0 || expired(routes[slot], now)) {
+   return NULL;
+  }
+  return &routes[slot];
+ }
+
+ // The route in slot, or NULL if it's free or stale. For walking the whole table, slot by slot.
+ const route_info* at(int slot, uint32_t now) const {
+  if (!routes[slot].used || expired(routes[slot], now)) {
+   return NULL;
+  }
+  return &routes[slot];
+ }
+
+ // The next hop to destination other than avoid, the alternate if need be, or NULL if we know none.
+ const uint8_t* nextHopAvoiding(const uint8_t* destination, const uint8_t* avoid, uint32_t now) const {
+  int slot = find(destination);
+  if (slot < 0) {
+   return NULL;
+  }
+  const route_info& route = routes[slot];
+  if (!expired(route, now) && memcmp(route.next_hop, avoid, 6) != 0) {
+   return route.next_hop;
+  }
+  if (hasAlternate(route, now) && memcmp(route.alternate, avoid, 6) != 0) {
+   return route.alternate;
+  }
+  return NULL;
+ }
+
+ // Sending to next_hop failed, so stop trusting every route through it until it's confirmed again.
+ // Routes with an alternate switch to it. The rest are only marked stale, since removing them
+ //  could break another destination's probe.
+ // Walks the whole table, which is fine as it only happens on failures. Returns the routes affected.
+ int invalidate(const uint8_t* next_hop, uint32_t now) {
+  int count = 0;
+  for (int i = 0; i < capacity; i++) {
+   route_info& route = routes[i];
+   if (!route.used) {
+    continue;
+   }
+   if (memcmp(route.alternate, next_hop, 6) == 0) {
+    route.alternate_hops = 0;
+   }
+   if (expired(route, now) || memcmp(route.next_hop, next_hop, 6) != 0) {
+    continue;
+   }
+   if (hasAlternate(route, now)) {
+    memcpy(route.next_hop, route.alternate, 6);
+    route.hops = route.alternate_hops;
+    route.last_seen = route.alternate_seen;
+    route.alternate_hops = 0;
+   }
+   else {
+    route.last_seen = now - timeout - 1;
+   }
+   count++;
+  }
+  return count;
+ }
+
+ // We heard from destination through next_hop, hops away.
+ // Keeps the current route unless this one is shorter or the current one has gone stale.
+ void update(const uint8_t* destination, const uint8_t* next_hop, uint8_t hops, uint32_t now) {
+  int slot = find(destination);
+  if (slot >= 0) {
+   route_info& route = routes[slot];
+   if (memcmp(route.next_hop, next_hop, 6) == 0) {
+    // Same route confirmed again. It may have gotten longer or shorter.
+    route.hops = hops;
+    route.last_seen = now;
+    return;
+   }
+   if (!expired(route, now)) {
+    if (hops >= route.hops) {
+     // No better, but a way around the next hop should that fail. Keep the shortest one.
+     // One two hops longer could be our own route coming back to us, through a neighbor we sent it to.
+     bool candidate = hops <= route.hops + 1;
+     if (candidate && (!hasAlternate(route, now) || memcmp(route.alternate, next_hop, 6) == 0 || hops <= route.alternate_hops)) {
+      setAlternate(route, next_hop, hops, now);
+     }
+     return;
+    }
+    // A shorter route. The one it replaces becomes the way around it.
+    setAlternate(route, route.next_hop, route.hops, route.last_seen);
+   }
+  }
+  else {
+   // Take the first free or stale slot in the window, else the stalest one.
+   int candidate = home(destination);
+   slot = candidate;
+   for (int i = 0; i < probe_window; i++) {
+    if (!routes[slot].used || expired(routes[slot], now)) {
+     candidate = slot;
+     break;
+    }
+    if (now - routes[slot].last_seen > now - routes[candidate].last_seen) {
+     candidate = slot;
+    }
+    slot = (slot + 1) % capacity;
+   }
+   slot = candidate;
+   routes[slot].alternate_hops = 0;
+  }
+  route_info& route = routes[slot];
+  memcpy(route.destination, destination, 6);
+  memcpy(route.next_hop, next_hop, 6);
+  if (memcmp(route.alternate, next_hop, 6) == 0) {
+   route.alternate_hops = 0;
+  }
+  route.hops = hops;
+  route.last_seen = now;
+  route.used = true;
+ }
+};
+
+#endif
@@ -0,0 +1,55 @@
+#ifndef NOWMESH_RX_QUEUE_H
+#define NOWMESH_RX_QUEUE_H
+
+#include <stdint.h>
+#include <string.h>
+
+// A frame as the SDK handed it to us, waiting to be processed.
+template <int frame_len>
+struct rx_frame {
+ // The neighbor that sent it.
+ uint8_t mac[6];
+ uint8_t len;
+ uint8_t data[frame_len];
+};
+
+// Fixed capacity FIFO of received frames.
+// Filled from the receive callback and drained from NowMesh::loop, so everything is preallocated.
+template <int capacity, int frame_len>
+class RxQueue {
+ static_assert(capacity > 0, "RxQueue capacity must be positive");
+
+ rx_frame<frame_len> frames[capacity];
+ int head = 0;
+ int count = 0;
+
+public:
+ int size() const {
+  return count;
+ }
+
+ // Copy a frame in. Returns false, and drops the frame, if the queue is full.
+ // len must be no more than frame_len.
+ bool push(const uint8_t* mac, const uint8_t* data, uint8_t len) {
+  if (count == capacity) {
+   return false;
+  }
+  rx_frame<frame_len>& frame = frames[(head + count) % capacity];
+  memcpy(frame.mac, mac, 6);
+  frame.len = len;
+  memcpy(frame.data, data, len);
+  count++;
+  return true;
+ }
+
+ rx_frame<frame_len>& front() {
+  return frames[head];
+ }
+
+ void pop() {
+  head = (head + 1) % capacity;
+  count--;
+ }
+};
+
+#endif
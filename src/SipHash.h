@@ -0,0 +1,98 @@
+#ifndef NOWMESH_SIPHASH_H
+#define NOWMESH_SIPHASH_H
+
+#include <stdint.h>
+#include <string.h>
+
+// SipHash-2-4, a keyed hash by Aumasson and Bernstein made for short messages, used to tag frames.
+// A 128 bit key gives a 64 bit tag that can't be forged without the key, and it's quick on
+//  short inputs since there's no block padding or key expansion beyond four words.
+// The key's starting state is worked out once, in setKey, rather than for every frame.
+// The input can come in two pieces, so a frame can be tagged along with its sender without copying.
+class SipHash {
+ uint64_t start[4] = {0, 0, 0, 0};
+
+ static uint64_t rotate(uint64_t x, int bits) {
+  return (x << bits) | (x >> (64 - bits));
+ }
+
+ static void round(uint64_t* v) {
+  v[0] += v[1];
+  v[1] = rotate(v[1], 13);
+  v[1] ^= v[0];
+  v[0] = rotate(v[0], 32);
+  v[2] += v[3];
+  v[3] = rotate(v[3], 16);
+  v[3] ^= v[2];
+  v[0] += v[3];
+  v[3] = rotate(v[3], 21);
+  v[3] ^= v[0];
+  v[2] += v[1];
+  v[1] = rotate(v[1], 17);
+  v[1] ^= v[2];
+  v[2] = rotate(v[2], 32);
+ }
+
+ static void compress(uint64_t* v, uint64_t word) {
+  v[3] ^= word;
+  round(v);
+  round(v);
+  v[0] ^= word;
+ }
+
+ static uint64_t readWord(const uint8_t* bytes) {
+  uint64_t word = 0;
+  for (int i = 7; i >= 0; i--) {
+   word = (word << 8) | bytes[i];
+  }
+  return word;
+ }
+
+public:
+ // key is 16 bytes.
+ void setKey(const uint8_t* key) {
+  uint64_t k0 = readWord(key);
+  uint64_t k1 = readWord(key + 8);
+  start[0] = k0 ^ 0x736f6d6570736575ull;
+  start[1] = k1 ^ 0x646f72616e646f6dull;
+  start[2] = k0 ^ 0x6c7967656e657261ull;
+  start[3] = k1 ^ 0x7465646279746573ull;
+ }
+
+ // Hash first followed by second.
+ uint64_t hash(const uint8_t* first, size_t first_len, const uint8_t* second, size_t second_len) const {
+  uint64_t v[4] = {start[0], start[1], start[2], start[3]};
+  size_t total = first_len + second_len;
+  uint64_t word = 0;
+  int filled = 0;
+  for (int piece = 0; piece < 2; piece++) {
+   const uint8_t* data = piece == 0 ? first : second;
+   size_t len = piece == 0 ? first_len : second_len;
+   size_t i = 0;
+   // Whole words straight from the input while we're on a word boundary.
+   if (filled == 0) {
+    for (; i + 8 <= len; i += 8) {
+     compress(v, readWord(data + i));
+    }
+   }
+   for (; i < len; i++) {
+    word |= (uint64_t)data[i] << (8 * filled);
+    if (++filled == 8) {
+     compress(v, word);
+     word = 0;
+     filled = 0;
+    }
+   }
+  }
+  // The last word carries the length in its top byte.
+  compress(v, word | ((uint64_t)(total & 0xff) << 56));
+  v[2] ^= 0xff;
+  round(v);
+  round(v);
+  round(v);
+  round(v);
+  return v[0] ^ v[1] ^ v[2] ^ v[3];
+ }
+};
+
+#endif
@@ -0,0 +1,64 @@
+#ifndef NOWMESH_TRACE_BUFFER_H
+#define NOWMESH_TRACE_BUFFER_H
+
+#include <stdint.h>
+#include <string.h>
+
+// One thing that happened to a message at one node, see NowMesh::setTracing.
+// Little-endian and packed, as it's written out and sent as is.
+struct __attribute__((packed)) trace_event {
+ // micros() when it happened, on the node's own clock.
+ uint32_t time;
+ // TRACE_ kind of event.
+ uint8_t event;
+ // The message, by type, originator and id.
+ uint8_t type;
+ uint8_t originator[6];
+ uint16_t id;
+ // Hops the message had taken to get here. 0 at its originator.
+ uint8_t hops;
+ // The neighbor it came from or went to, by softAP MAC, all zeroes if there isn't one.
+ uint8_t peer[6];
+ // For TRACE_SENT, the send status.
+ uint8_t status;
+};
+
+// Fixed capacity FIFO of trace events.
+// Filled as frames come and go and drained from the sketch or NowMesh::loop, so everything is
+//  preallocated. Events that don't fit are dropped, so the ones kept stay in order.
+template <int capacity>
+class TraceBuffer {
+ static_assert(capacity > 0, "TraceBuffer capacity must be positive");
+
+ trace_event events[capacity];
+ int head = 0;
+ int count = 0;
+
+public:
+ int size() const {
+  return count;
+ }
+
+ // Copy an event in. Returns false, and drops the event, if the buffer is full.
+ bool push(const trace_event& event) {
+  if (count == capacity) {
+   return false;
+  }
+  events[(head + count) % capacity] = event;
+  count++;
+  return true;
+ }
+
+ // Move up to max of the oldest events into out. Returns how many were moved.
+ int pop(trace_event* out, int max) {
+  int moved = 0;
+  while (moved < max && count > 0) {
+   memcpy(&out[moved++], &events[head], sizeof(trace_event));
+   head = (head + 1) % capacity;
+   count--;
+  }
+  return moved;
+ }
+};
+
+#endif
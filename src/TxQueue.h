@@ -0,0 +1,119 @@
+#ifndef NOWMESH_TX_QUEUE_H
+#define NOWMESH_TX_QUEUE_H
+
+#include <stdint.h>
+#include <string.h>
+
+// A frame waiting to be handed to esp_now_send.
+template <int frame_len>
+struct tx_frame {
+ // millis() when the frame was queued.
+ uint32_t queued_at;
+ // Peer to send to. Ignored if flood is set.
+ uint8_t target[6];
+ // Send to all peers.
+ bool flood;
+ // Already sent again after failing to reach its first next hop, see NowMesh::rerouteFrame.
+ bool rerouted;
+ uint8_t len;
+ uint8_t data[frame_len];
+};
+
+// Fixed capacity set of FIFOs of frames waiting to be sent, one per priority class.
+// The classes share one pool of frames, so a busy class can use all of it,
+//  and a frame stays in the same slot from push to pop.
+// The frame at the front of a class may be in flight. It stays queued until the SDK reports it sent,
+//  and is never the one dropped to make room.
+template <int capacity, int frame_len, int classes = 1>
+class TxQueue {
+ static_assert(capacity >= 2, "TxQueue needs room for the frame in flight and one more");
+ static_assert(capacity <= 255, "TxQueue holds at most 255 frames");
+ static_assert(classes >= 1, "TxQueue needs at least one class");
+
+ tx_frame<frame_len> frames[capacity];
+ // Each class is a ring of slots in frames.
+ uint8_t order[classes][capacity];
+ int heads[classes];
+ int counts[classes];
+ // Slots not holding a frame.
+ uint8_t spare[capacity];
+ int spare_count = capacity;
+ int high_water = 0;
+
+ uint8_t& slot(int cls, int position) {
+  return order[cls][(heads[cls] + position) % capacity];
+ }
+
+public:
+ TxQueue() {
+  for (int i = 0; i < capacity; i++) {
+   spare[i] = i;
+  }
+  for (int cls = 0; cls < classes; cls++) {
+   heads[cls] = 0;
+   counts[cls] = 0;
+  }
+ }
+
+ // Frames queued in all classes.
+ int size() const {
+  return capacity - spare_count;
+ }
+
+ int size(int cls) const {
+  return counts[cls];
+ }
+
+ bool full() const {
+  return spare_count == 0;
+ }
+
+ // Most frames ever queued at once.
+ int highWater() const {
+  return high_water;
+ }
+
+ tx_frame<frame_len>& front(int cls = 0) {
+  return frames[slot(cls, 0)];
+ }
+
+ // A class's frames in queue order, 0 being the front.
+ tx_frame<frame_len>& at(int cls, int position) {
+  return frames[slot(cls, position)];
+ }
+
+ // Oldest frame of a class that is not in flight. The class must not be empty or hold only that frame.
+ tx_frame<frame_len>& oldest(int cls, bool front_in_flight) {
+  return frames[slot(cls, front_in_flight ? 1 : 0)];
+ }
+
+ // Forget the oldest frame of a class that is not in flight, to make room.
+ void dropOldest(int cls, bool front_in_flight) {
+  if (front_in_flight) {
+   // Keep the frame in flight at the front by moving it up over the dropped one.
+   uint8_t dropped = slot(cls, 1);
+   slot(cls, 1) = slot(cls, 0);
+   slot(cls, 0) = dropped;
+  }
+  pop(cls);
+ }
+
+ // Get a slot at the back of a class to fill in. The queue must not be full.
+ tx_frame<frame_len>& push(int cls = 0) {
+  uint8_t free_slot = spare[--spare_count];
+  slot(cls, counts[cls]) = free_slot;
+  counts[cls]++;
+  if (size() > high_water) {
+   high_water = size();
+  }
+  return frames[free_slot];
+ }
+
+ void pop(int cls = 0) {
+  spare[spare_count++] = slot(cls, 0);
+  heads[cls] = (heads[cls] + 1) % capacity;
+  counts[cls]--;
+ }
+};
+
+#endif